@@ -0,0 +1,300 @@
+/*
+ * FogLAMP "MQTTScripted" micro-benchmarks of the message processing kernels.
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ *
+ * Measures the cost of calling the Python convert function, converting
+ * the returned DICT into a JSON document or into readings under the
+ * collapse and nest object policies, and converting timestamps. No MQTT
+ * broker is required.
+ *
+ * The script returns a DICT that is built once for each size and depth
+ * and cached by the script, the topic of the message selects the DICT.
+ * The cost of the conversion of a DICT is therefore the time reported
+ * less that of BM_ScriptCall, which returns an empty DICT.
+ *
+ * Usage: bench_kernels [--benchmark_filter=regex] [--benchmark_format=json]
+ */
+#include <benchmark/benchmark.h>
+#include <python_script.h>
+#include <object_policy.h>
+#include <mqtt_payload.h>
+#include <reading.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace rapidjson;
+
+#define BENCH_SCRIPT	"bench_kernels"
+
+static const char *policies[] = {
+	"Single reading & collapse",
+	"Single reading & nest",
+	"Multiple readings & collapse",
+	"Multiple readings & nest"
+};
+
+/**
+ * The script used by all the Python benchmarks. A topic of the form
+ * "<keys>/<depth>" returns a DICT with that number of keys at each
+ * level and a further key, child, holding the next level down. Any
+ * other topic returns an empty DICT.
+ */
+static const char *script =
+	"_dicts = {}\n"
+	"\n"
+	"def _build(keys, depth):\n"
+	"    d = {}\n"
+	"    for i in range(keys):\n"
+	"        if i % 3 == 0:\n"
+	"            d['int%d' % i] = i\n"
+	"        elif i % 3 == 1:\n"
+	"            d['float%d' % i] = i + 0.5\n"
+	"        else:\n"
+	"            d['string%d' % i] = 'value%d' % i\n"
+	"    if depth > 1:\n"
+	"        d['child'] = _build(keys, depth - 1)\n"
+	"    return d\n"
+	"\n"
+	"def convert(message, topic):\n"
+	"    d = _dicts.get(topic)\n"
+	"    if d is None:\n"
+	"        parts = topic.split('/')\n"
+	"        d = _build(int(parts[0]), int(parts[1])) if len(parts) == 2 else {}\n"
+	"        _dicts[topic] = d\n"
+	"    return d\n";
+
+/**
+ * Return the script shared by the Python benchmarks, the script is
+ * loaded the first time it is required
+ *
+ * @return PythonScript*	The loaded script or NULL on failure
+ */
+static PythonScript *benchScript()
+{
+	static PythonScript *python = NULL;
+	if (!python)
+	{
+		string path = getenv("FOGLAMP_DATA");
+		path += "/scripts/";
+		path += BENCH_SCRIPT;
+		path += ".py";
+		python = new PythonScript("bench");
+		if (!python->setScript(path))
+		{
+			delete python;
+			python = NULL;
+		}
+	}
+	return python;
+}
+
+/**
+ * The topic that selects a DICT with the given shape
+ *
+ * @param keys		The number of keys at each level
+ * @param depth		The number of levels
+ * @return string	The topic
+ */
+static string shapeTopic(long keys, long depth)
+{
+	char buf[40];
+	snprintf(buf, sizeof(buf), "%ld/%ld", keys, depth);
+	return string(buf);
+}
+
+/**
+ * Acquire the GIL, call the convert function and convert the empty DICT
+ * it returns
+ */
+static void BM_ScriptCall(benchmark::State& state)
+{
+	PythonScript *python = benchScript();
+	if (!python)
+	{
+		state.SkipWithError("Unable to load the benchmark script");
+		return;
+	}
+	// The payload refers to the strings, they must outlive it
+	string message = "{}", topic = "empty";
+	MQTTPayload payload(message, topic);
+	for (auto _ : state)
+	{
+		string asset = "bench";
+		Document *doc = python->execute(payload, asset);
+		benchmark::DoNotOptimize(doc);
+		delete doc;
+	}
+}
+BENCHMARK(BM_ScriptCall);
+
+/**
+ * Convert a DICT returned by the script into a JSON document. The
+ * arguments are the number of keys per level and the number of levels.
+ */
+static void BM_CreateJSON(benchmark::State& state)
+{
+	PythonScript *python = benchScript();
+	if (!python)
+	{
+		state.SkipWithError("Unable to load the benchmark script");
+		return;
+	}
+	string message = "{}", topic = shapeTopic(state.range(0), state.range(1));
+	MQTTPayload payload(message, topic);
+	for (auto _ : state)
+	{
+		string asset = "bench";
+		Document *doc = python->execute(payload, asset);
+		benchmark::DoNotOptimize(doc);
+		delete doc;
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0) * state.range(1));
+}
+BENCHMARK(BM_CreateJSON)->ArgNames({"keys", "depth"})
+	->ArgsProduct({{1, 8, 64, 512}, {1, 4, 16}});
+
+/**
+ * Convert a DICT returned by the script into readings. The arguments
+ * are the object policy, the number of keys per level and the number
+ * of levels.
+ */
+static void BM_GetValues(benchmark::State& state)
+{
+	PythonScript *python = benchScript();
+	if (!python)
+	{
+		state.SkipWithError("Unable to load the benchmark script");
+		return;
+	}
+	const char *policyName = policies[state.range(0)];
+	ObjectPolicy policy(policyName, "", "", "+00:00");
+	string message = "{}", topic = shapeTopic(state.range(1), state.range(2));
+	MQTTPayload payload(message, topic);
+	vector<Reading *> readings;
+	for (auto _ : state)
+	{
+		string asset = "bench";
+		if (!python->execute(payload, policy, asset, readings))
+		{
+			state.SkipWithError("The script failed");
+			break;
+		}
+		for (auto reading : readings)
+			delete reading;
+		readings.clear();
+	}
+	state.SetLabel(policyName);
+	state.SetItemsProcessed(state.iterations() * state.range(1) * state.range(2));
+}
+BENCHMARK(BM_GetValues)->ArgNames({"policy", "keys", "depth"})
+	->ArgsProduct({{0, 1, 2, 3}, {8, 64}, {1, 4, 16}});
+
+/**
+ * Convert a string timestamp
+ *
+ * @param format	The time format of the object policy
+ * @param ts		The timestamp to convert
+ */
+static void BM_ConvertStringTimestamp(benchmark::State& state, const char *format, const char *ts)
+{
+	ObjectPolicy policy("Single reading from root level", "ts", format, "+00:00");
+	for (auto _ : state)
+	{
+		UserTimestamp user_ts;
+		benchmark::DoNotOptimize(policy.convertTimestamp(ts, user_ts));
+		benchmark::DoNotOptimize(user_ts);
+	}
+}
+BENCHMARK_CAPTURE(BM_ConvertStringTimestamp, iso8601, "%Y-%m-%dT%H:%M:%S", "2021-06-01T12:34:56.789Z");
+BENCHMARK_CAPTURE(BM_ConvertStringTimestamp, iso8601_offset, "%Y-%m-%dT%H:%M:%S", "2021-06-01T12:34:56.789+02:00");
+BENCHMARK_CAPTURE(BM_ConvertStringTimestamp, iso8601_space, "%Y-%m-%d %H:%M:%S", "2021-06-01 12:34:56");
+BENCHMARK_CAPTURE(BM_ConvertStringTimestamp, any, "", "2021-06-01T12:34:56.789Z");
+BENCHMARK_CAPTURE(BM_ConvertStringTimestamp, strptime, "%d/%m/%Y %H:%M:%S", "01/06/2021 12:34:56");
+BENCHMARK_CAPTURE(BM_ConvertStringTimestamp, epoch_string, "epoch", "1622550896.789");
+
+/**
+ * Convert an integer timestamp
+ *
+ * @param format	The time format of the object policy
+ * @param ts		The timestamp to convert
+ */
+static void BM_ConvertIntegerTimestamp(benchmark::State& state, const char *format, int64_t ts)
+{
+	ObjectPolicy policy("Single reading from root level", "ts", format, "+00:00");
+	for (auto _ : state)
+	{
+		UserTimestamp user_ts;
+		benchmark::DoNotOptimize(policy.convertTimestamp(ts, user_ts));
+		benchmark::DoNotOptimize(user_ts);
+	}
+}
+BENCHMARK_CAPTURE(BM_ConvertIntegerTimestamp, epoch, "epoch", (int64_t)1622550896);
+BENCHMARK_CAPTURE(BM_ConvertIntegerTimestamp, epoch_ms, "epoch_ms", (int64_t)1622550896789);
+BENCHMARK_CAPTURE(BM_ConvertIntegerTimestamp, epoch_us, "epoch_us", (int64_t)1622550896789012);
+
+/**
+ * Convert a floating point timestamp
+ *
+ * @param format	The time format of the object policy
+ * @param ts		The timestamp to convert
+ */
+static void BM_ConvertDoubleTimestamp(benchmark::State& state, const char *format, double ts)
+{
+	ObjectPolicy policy("Single reading from root level", "ts", format, "+00:00");
+	for (auto _ : state)
+	{
+		UserTimestamp user_ts;
+		benchmark::DoNotOptimize(policy.convertTimestamp(ts, user_ts));
+		benchmark::DoNotOptimize(user_ts);
+	}
+}
+BENCHMARK_CAPTURE(BM_ConvertDoubleTimestamp, epoch, "epoch", 1622550896.789);
+BENCHMARK_CAPTURE(BM_ConvertDoubleTimestamp, epoch_ms, "epoch_ms", 1622550896789.5);
+
+int main(int argc, char **argv)
+{
+	// Scripts are loaded from the scripts directory of the FogLAMP data
+	// directory, use a private data directory for the benchmarks
+	char dataDir[] = "/tmp/bench_kernelsXXXXXX";
+	if (!mkdtemp(dataDir))
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+	setenv("FOGLAMP_DATA", dataDir, 1);
+	setenv("PYTHONDONTWRITEBYTECODE", "1", 1);
+	string scriptDir = string(dataDir) + "/scripts";
+	string scriptFile = scriptDir + "/" + BENCH_SCRIPT + ".py";
+	mkdir(scriptDir.c_str(), 0755);
+	FILE *fp = fopen(scriptFile.c_str(), "w");
+	if (!fp)
+	{
+		perror(scriptFile.c_str());
+		return 1;
+	}
+	fputs(script, fp);
+	fclose(fp);
+
+	benchmark::Initialize(&argc, argv);
+	if (!benchmark::ReportUnrecognizedArguments(argc, argv))
+	{
+		benchmark::RunSpecifiedBenchmarks();
+		benchmark::Shutdown();
+	}
+
+	unlink(scriptFile.c_str());
+	rmdir(scriptDir.c_str());
+	rmdir(dataDir);
+	return 0;
+}
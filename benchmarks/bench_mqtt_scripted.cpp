@@ -0,0 +1,344 @@
+/*
+ * FogLAMP "MQTTScripted" end to end throughput benchmark.
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ *
+ * Constructs the plugin from its default configuration, registers an
+ * ingest callback that counts and discards the readings and feeds
+ * generated payloads directly to processMessage, without a broker.
+ * Every payload type is run with every object policy and the results
+ * are written as JSON so that they may be compared between releases.
+ *
+ * Usage: bench_mqtt_scripted [--messages n] [--output file]
+ */
+#include <scripted.h>
+#include <mqtt_payload.h>
+#include <ondemand_parser.h>
+#include <plugin_api.h>
+#include <config_category.h>
+#include <reading.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <atomic>
+#include <new>
+#include <string>
+#include <vector>
+#include "version.h"
+
+using namespace std;
+
+extern "C" {
+	PLUGIN_INFORMATION *plugin_info();
+};
+
+#define DEFAULT_MESSAGES	100000	// Messages processed per case
+#define DISTINCT_PAYLOADS	64	// Number of different payloads generated per case
+#define BENCH_SCRIPT		"bench_convert"
+
+/*
+ * Count the C++ heap allocations made by the plugin. Allocations made by
+ * the Python runtime and the C library are not counted.
+ */
+static atomic<unsigned long> allocations(0);
+
+void *operator new(size_t size)
+{
+	allocations.fetch_add(1, memory_order_relaxed);
+	void *p = malloc(size ? size : 1);
+	if (!p)
+		throw bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+/**
+ * The ingest callback, counts the readings and deletes them
+ */
+static unsigned long ingestedReadings = 0;
+
+static void countReadings(void *data, vector<Reading *> *readings)
+{
+	ingestedReadings += readings->size();
+	for (auto reading : *readings)
+		delete reading;
+}
+
+/**
+ * A case of the benchmark
+ */
+typedef struct {
+	const char	*name;		// The name of the payload type
+	bool		script;		// Convert the payloads with a script
+	bool		json;		// The payloads are JSON
+} PayloadType;
+
+static const PayloadType payloadTypes[] = {
+	{ "flat JSON", false, true },
+	{ "nested JSON", false, true },
+	{ "simple value", false, false },
+	{ "scripted", true, true }
+};
+
+static const char *policies[] = {
+	"Single reading from root level",
+	"Single reading & collapse",
+	"Single reading & nest",
+	"Multiple readings & collapse",
+	"Multiple readings & nest"
+};
+
+/**
+ * Generate a payload
+ *
+ * @param type		The type of payload
+ * @param n		Used to vary the values in the payload
+ * @return string	The payload
+ */
+static string generatePayload(const PayloadType& type, int n)
+{
+	char buf[1024];
+	if (strcmp(type.name, "simple value") == 0)
+	{
+		snprintf(buf, sizeof(buf), "%d.%d", 20 + n % 10, n % 100);
+	}
+	else if (strcmp(type.name, "nested JSON") == 0)
+	{
+		snprintf(buf, sizeof(buf),
+			"{ \"ts\" : \"2021-06-01T12:%02d:%02d.%03dZ\", "
+			"\"motor\" : { \"speed\" : %d, \"current\" : %d.%d, "
+				"\"bearing\" : { \"temperature\" : %d.5, \"vibration\" : { \"x\" : %d, \"y\" : %d, \"z\" : %d } } }, "
+			"\"pump\" : { \"pressure\" : %d.25, \"flow\" : %d, \"state\" : \"running\" } }",
+			n % 60, (n / 60) % 60, n % 1000, 1400 + n % 100, n % 20, n % 10,
+			40 + n % 30, n % 7, n % 11, n % 13, 3 + n % 5, 100 + n % 50);
+	}
+	else
+	{
+		snprintf(buf, sizeof(buf),
+			"{ \"ts\" : \"2021-06-01T12:%02d:%02d.%03dZ\", \"temperature\" : %d.5, "
+			"\"humidity\" : %d, \"pressure\" : %d.25, \"speed\" : %d, \"current\" : %d.%d, "
+			"\"voltage\" : %d, \"power\" : %d.75, \"state\" : \"running\", \"count\" : %d }",
+			n % 60, (n / 60) % 60, n % 1000, 15 + n % 20, 40 + n % 50, 1000 + n % 30,
+			1400 + n % 100, n % 20, n % 10, 230 + n % 10, 500 + n % 300, n);
+	}
+	return string(buf);
+}
+
+/**
+ * Build the configuration category for a case from the default
+ * configuration of the plugin
+ *
+ * @param config	The configuration category to populate
+ * @param type		The payload type
+ * @param policy	The object policy
+ * @param parser	The JSON parser
+ * @param scriptDir	The directory holding the benchmark script
+ */
+static void buildConfig(ConfigCategory& config, const PayloadType& type, const char *policy,
+		const char *parser, const string& scriptDir)
+{
+	config.setItemsValueFromDefault();
+	config.setValue("policy", policy);
+	config.setValue("timestamp", "ts");
+	config.setValue("format", "%Y-%m-%dT%H:%M:%S");
+	config.setValue("jsonParser", parser);
+	if (type.script)
+	{
+		config.setValue("script", BENCH_SCRIPT);
+		config.setItemAttribute("script", ConfigCategory::FILE_ATTR,
+				scriptDir + "/" + BENCH_SCRIPT + ".py");
+	}
+}
+
+/**
+ * Run one case of the benchmark
+ *
+ * @param type		The payload type
+ * @param policy	The object policy
+ * @param parser	The JSON parser
+ * @param messages	The number of messages to process
+ * @param scriptDir	The directory holding the benchmark script
+ * @param results	The JSON results, the result of the case is appended
+ */
+static void runCase(const PayloadType& type, const char *policy, const char *parser, long messages,
+		const string& scriptDir, string& results)
+{
+	ConfigCategory config("benchmark", plugin_info()->config);
+	buildConfig(config, type, policy, parser, scriptDir);
+	MQTTScripted *mqtt = new MQTTScripted(&config);
+	mqtt->registerIngest(NULL, countReadings);
+
+	vector<string> payloads;
+	for (int i = 0; i < DISTINCT_PAYLOADS; i++)
+	{
+		payloads.push_back(generatePayload(type, i));
+	}
+	string topic = "benchmark/sensor";
+
+	// Warm up the script, plan and template caches
+	for (auto& payload : payloads)
+	{
+		mqtt->processMessage(MQTTPayload(payload, topic));
+	}
+
+	ingestedReadings = 0;
+	unsigned long startAllocations = allocations.load();
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+	for (long i = 0; i < messages; i++)
+	{
+		mqtt->processMessage(MQTTPayload(payloads[i % DISTINCT_PAYLOADS], topic));
+	}
+	mqtt->stop();	// Flush the readings held in the final partial batch
+	gettimeofday(&end, NULL);
+	unsigned long used = allocations.load() - startAllocations;
+	unsigned long readings = ingestedReadings;
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+
+	delete mqtt;
+
+	fprintf(stderr, "%-14s %-32s %-10s %10.0f msg/s %10.0f readings/s %8.1f allocs/msg\n",
+			type.name, policy, type.json && !type.script ? parser : "-",
+			messages / seconds, readings / seconds, (double)used / messages);
+
+	char buf[512];
+	snprintf(buf, sizeof(buf), "    { \"payload\" : \"%s\", \"policy\" : \"%s\", \"parser\" : \"%s\", "
+			"\"messages\" : %ld, \"readings\" : %lu, \"seconds\" : %.6f, "
+			"\"messagesPerSecond\" : %.1f, \"readingsPerSecond\" : %.1f, "
+			"\"allocationsPerMessage\" : %.2f }",
+			type.name, policy, type.json && !type.script ? parser : "",
+			messages, readings, seconds, messages / seconds, readings / seconds,
+			(double)used / messages);
+	if (!results.empty())
+	{
+		results += ",\n";
+	}
+	results += buf;
+}
+
+/**
+ * Write the script used by the scripted cases. The script parses the
+ * JSON payload and returns it, so the readings match the JSON cases.
+ *
+ * @param dir	The directory in which to write the script
+ */
+static void writeScript(const string& dir)
+{
+	string path = dir + "/" + BENCH_SCRIPT + ".py";
+	FILE *fp = fopen(path.c_str(), "w");
+	if (!fp)
+	{
+		fprintf(stderr, "Unable to create the benchmark script %s\n", path.c_str());
+		exit(1);
+	}
+	fprintf(fp, "import json\n\n");
+	fprintf(fp, "def convert(message, topic):\n");
+	fprintf(fp, "    return json.loads(message)\n");
+	fclose(fp);
+}
+
+/**
+ * Write the results of the benchmark as a JSON document
+ *
+ * @param fp		The file to write to
+ * @param results	The results of the individual cases
+ */
+static void writeResults(FILE *fp, const string& results)
+{
+	fprintf(fp, "{\n  \"benchmark\" : \"bench_mqtt_scripted\",\n");
+	fprintf(fp, "  \"version\" : \"%s\",\n", VERSION);
+	fprintf(fp, "  \"timestamp\" : %ld,\n", (long)time(0));
+	fprintf(fp, "  \"results\" : [\n%s\n  ]\n}\n", results.c_str());
+}
+
+int main(int argc, char **argv)
+{
+	long messages = DEFAULT_MESSAGES;
+	const char *output = NULL;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--messages") == 0 && i + 1 < argc)
+			messages = strtol(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc)
+			output = argv[++i];
+		else
+		{
+			fprintf(stderr, "Usage: %s [--messages n] [--output file]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (messages <= 0)
+	{
+		messages = DEFAULT_MESSAGES;
+	}
+
+	// Scripts are loaded from the scripts directory of the FogLAMP data
+	// directory, use a private data directory for the benchmark
+	char dataDir[] = "/tmp/bench_mqtt_scriptedXXXXXX";
+	if (!mkdtemp(dataDir))
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+	setenv("FOGLAMP_DATA", dataDir, 1);
+	setenv("PYTHONDONTWRITEBYTECODE", "1", 1);
+	string scriptDir = string(dataDir) + "/scripts";
+	mkdir(scriptDir.c_str(), 0755);
+	writeScript(scriptDir);
+
+	vector<const char *> parsers;
+	if (OnDemandParser::available())
+		parsers.push_back("On Demand");
+	parsers.push_back("Document");
+
+	string results;
+	for (auto& type : payloadTypes)
+	{
+		for (auto policy : policies)
+		{
+			if (type.json && !type.script)
+			{
+				for (auto parser : parsers)
+					runCase(type, policy, parser, messages, scriptDir, results);
+			}
+			else
+			{
+				runCase(type, policy, "Document", messages, scriptDir, results);
+			}
+		}
+	}
+
+	string script = scriptDir + "/" + BENCH_SCRIPT + ".py";
+	unlink(script.c_str());
+	rmdir(scriptDir.c_str());
+	rmdir(dataDir);
+
+	if (output)
+	{
+		FILE *fp = fopen(output, "w");
+		if (!fp)
+		{
+			perror(output);
+			return 1;
+		}
+		writeResults(fp, results);
+		fclose(fp);
+	}
+	else
+	{
+		writeResults(stdout, results);
+	}
+	return 0;
+}
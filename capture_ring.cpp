@@ -0,0 +1,218 @@
+/*
+ * FogLAMP "MQTTScripted" capture ring.
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <capture_ring.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+using namespace std;
+
+/**
+ * Construct a capture ring, the ring holds no messages until it is sized
+ */
+CaptureRing::CaptureRing() : m_size(0), m_recorded(0), m_enabled(false)
+{
+}
+
+/**
+ * Set the number of messages held in the ring. Any messages already
+ * captured are discarded. A size of 0 disables the capture.
+ *
+ * @param size	The number of messages to hold
+ */
+void CaptureRing::resize(unsigned int size)
+{
+	lock_guard<mutex> guard(m_mutex);
+	if (size == m_size)
+	{
+		return;
+	}
+	m_enabled = false;
+	vector<Entry>().swap(m_entries);
+	m_entries.resize(size);
+	m_size = size;
+	m_recorded = 0;
+	m_enabled = size > 0;
+}
+
+/**
+ * Discard the messages that have been captured
+ */
+void CaptureRing::clear()
+{
+	lock_guard<mutex> guard(m_mutex);
+	m_recorded = 0;
+}
+
+/**
+ * Record a message in the ring, replacing the oldest message if the
+ * ring is full. Topics and payloads longer than the slot are truncated.
+ *
+ * @param payload	The message
+ * @param result	The outcome of processing the message
+ * @param readings	The number of readings created from the message
+ * @param elapsed	The time taken to process the message in nanoseconds
+ * @param stages	The time spent in each stage in nanoseconds
+ */
+void CaptureRing::record(const MQTTPayload& payload, Result result, size_t readings,
+		uint64_t elapsed, const uint64_t *stages)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	size_t topicLength = payload.topicLength() < CAPTURE_TOPIC_SIZE
+				? payload.topicLength() : CAPTURE_TOPIC_SIZE;
+	size_t payloadLength = payload.length() < CAPTURE_PAYLOAD_SIZE
+				? payload.length() : CAPTURE_PAYLOAD_SIZE;
+
+	lock_guard<mutex> guard(m_mutex);
+	if (m_size == 0)
+	{
+		return;
+	}
+	Entry& entry = m_entries[m_recorded++ % m_size];
+	entry.time = now;
+	entry.elapsed = elapsed;
+	memcpy(entry.stages, stages, sizeof(entry.stages));
+	entry.length = payload.length();
+	entry.readings = readings;
+	entry.result = result;
+	entry.topicLength = topicLength;
+	memcpy(entry.topic, payload.topic(), topicLength);
+	entry.payloadLength = payloadLength;
+	memcpy(entry.payload, payload.data(), payloadLength);
+}
+
+/**
+ * Return the name of a result
+ *
+ * @param result	The result
+ * @return const char*	The name of the result
+ */
+const char *CaptureRing::resultName(Result result)
+{
+	switch (result)
+	{
+		case JSON:
+			return "json";
+		case SimpleValue:
+			return "simple value";
+		case Script:
+			return "script";
+		case ScriptBatch:
+			return "script batch";
+		case Rejected:
+			return "rejected";
+		default:
+			return "failed";
+	}
+}
+
+/**
+ * Append a string to a JSON string value, escaping the characters that
+ * are not permitted and any bytes that are not printable ASCII
+ *
+ * @param out		The string to append to
+ * @param str		The characters to append
+ * @param length	The number of characters
+ */
+void CaptureRing::escape(string& out, const char *str, size_t length)
+{
+	for (size_t i = 0; i < length; i++)
+	{
+		unsigned char c = str[i];
+		if (c == '"' || c == '\\')
+		{
+			out += '\\';
+			out += c;
+		}
+		else if (c < 0x20 || c >= 0x7f)
+		{
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", c);
+			out += buf;
+		}
+		else
+		{
+			out += c;
+		}
+	}
+}
+
+/**
+ * Return the messages held in the ring, oldest first, as JSON objects.
+ * Times are in microseconds, only the stages that were timed are given.
+ *
+ * @param entries	The vector to which the messages are appended
+ */
+void CaptureRing::dump(vector<string>& entries)
+{
+	lock_guard<mutex> guard(m_mutex);
+	unsigned long count = m_recorded < m_size ? m_recorded : m_size;
+	for (unsigned long i = m_recorded - count; i < m_recorded; i++)
+	{
+		const Entry& entry = m_entries[i % m_size];
+		char buf[160];
+		struct tm tm;
+		gmtime_r(&entry.time.tv_sec, &tm);
+		strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+		string json = "{ \"time\" : \"";
+		json += buf;
+		snprintf(buf, sizeof(buf), ".%06ld\", \"topic\" : \"", (long)entry.time.tv_usec);
+		json += buf;
+		escape(json, entry.topic, entry.topicLength);
+		json += "\", \"payload\" : \"";
+		escape(json, entry.payload, entry.payloadLength);
+		snprintf(buf, sizeof(buf), "\", \"length\" : %u, \"result\" : \"%s\", \"readings\" : %u, \"elapsed\" : %.1f",
+				entry.length, resultName((Result)entry.result), entry.readings,
+				entry.elapsed / 1000.0);
+		json += buf;
+		string stages;
+		for (int stage = 0; stage < StageTimers::STAGES; stage++)
+		{
+			if (entry.stages[stage])
+			{
+				snprintf(buf, sizeof(buf), "%s\"%s\" : %.1f", stages.empty() ? "" : ", ",
+						StageTimers::name((StageTimers::Stage)stage),
+						entry.stages[stage] / 1000.0);
+				stages += buf;
+			}
+		}
+		if (!stages.empty())
+		{
+			json += ", \"stages\" : { " + stages + " }";
+		}
+		json += " }";
+		entries.push_back(json);
+	}
+}
+
+/**
+ * Return the payload and topic of each message held in the ring that was
+ * converted by a script, oldest first. Messages whose topic or payload was
+ * truncated when it was recorded are not returned.
+ *
+ * @param messages	The vector to which the payloads and topics are appended
+ */
+void CaptureRing::scriptMessages(vector<pair<string, string> >& messages)
+{
+	lock_guard<mutex> guard(m_mutex);
+	unsigned long count = m_recorded < m_size ? m_recorded : m_size;
+	for (unsigned long i = m_recorded - count; i < m_recorded; i++)
+	{
+		const Entry& entry = m_entries[i % m_size];
+		if ((entry.result == Script || entry.result == ScriptBatch)
+				&& entry.payloadLength == entry.length
+				&& entry.topicLength < CAPTURE_TOPIC_SIZE)
+		{
+			messages.push_back(make_pair(string(entry.payload, entry.payloadLength),
+						string(entry.topic, entry.topicLength)));
+		}
+	}
+}
@@ -0,0 +1,267 @@
+/*
+ * FogLAMP "MQTTScripted" document plans.
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <document_plan.h>
+#include <string.h>
+#include <algorithm>
+
+using namespace std;
+using namespace rapidjson;
+
+/**
+ * Booleans are never mapped to datapoints, treat true and false as
+ * the same type so that they do not result in different shapes.
+ */
+static inline Type shapeType(const Value& value)
+{
+	Type type = value.GetType();
+	return type == kFalseType ? kTrueType : type;
+}
+
+/**
+ * Compile a plan for the root level of a document
+ *
+ * @param object	The root object of the document
+ * @param policy	The object policy
+ */
+DocumentPlan::DocumentPlan(const Value& object, const ObjectPolicy& policy)
+{
+	compile(object, policy, policy.getPolicy() != ObjectPolicy::FirstLevel,
+			policy.getPolicy() == ObjectPolicy::Multiple);
+}
+
+/**
+ * Compile a plan for a nested object
+ *
+ * @param object	The object
+ * @param policy	The object policy
+ * @param recurse	Child objects are nested or collapsed into this level
+ * @param multiple	Child objects create readings of their own
+ */
+DocumentPlan::DocumentPlan(const Value& object, const ObjectPolicy& policy, bool recurse, bool multiple)
+{
+	compile(object, policy, recurse, multiple);
+}
+
+/**
+ * Resolve the action for each member of an object. This follows the
+ * same rules as the conversion of documents that do not use a plan.
+ *
+ * @param object	The object
+ * @param policy	The object policy
+ * @param recurse	Child objects are nested or collapsed into this level
+ * @param multiple	Child objects create readings of their own
+ */
+void DocumentPlan::compile(const Value& object, const ObjectPolicy& policy, bool recurse, bool multiple)
+{
+	m_members.reserve(object.MemberCount());
+	for (auto& m : object.GetObject())
+	{
+		Action action = Skip;
+		if (policy.isTimestamp(m.name.GetString()))
+			action = Timestamp;
+		else if (m.value.IsNumber())
+			action = Number;
+		else if (m.value.IsString())
+			action = String;
+		else if (m.value.IsObject() && multiple)
+			action = Child;
+		else if (m.value.IsObject() && recurse)
+			action = policy.nest() ? Nest : Collapse;
+
+		m_members.emplace_back(string(m.name.GetString(), m.name.GetStringLength()),
+				shapeType(m.value), action);
+		if (action == Child || action == Nest || action == Collapse)
+		{
+			m_members.back().plan.reset(new DocumentPlan(m.value, policy, true, false));
+		}
+	}
+}
+
+/**
+ * Check if an object has the shape for which this plan was compiled
+ *
+ * @param object	The object to check
+ * @return bool		True if the plan may be used for the object
+ */
+bool DocumentPlan::matches(const Value& object) const
+{
+	if (object.MemberCount() != m_members.size())
+	{
+		return false;
+	}
+	size_t i = 0;
+	for (auto& m : object.GetObject())
+	{
+		const Member& member = m_members[i++];
+		if (shapeType(m.value) != member.type
+				|| m.name.GetStringLength() != member.name.size()
+				|| memcmp(m.name.GetString(), member.name.data(), member.name.size()) != 0)
+		{
+			return false;
+		}
+		if (member.plan && !member.plan->matches(m.value))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Create the readings from the root object of a document that matches
+ * this plan
+ *
+ * @param object	The root object of the document
+ * @param policy	The object policy
+ * @param asset		The asset name for the reading
+ * @param readings	The vector to which readings are appended
+ * @param pool		The pool of scratch vectors used to collect datapoints
+ */
+void DocumentPlan::createReadings(const Value& object, const ObjectPolicy& policy,
+		const string& asset, vector<Reading *>& readings, DatapointPool& pool) const
+{
+	Scratch<Datapoint *> points(pool);
+	UserTimestamp user_ts;
+
+	size_t i = 0;
+	for (auto& m : object.GetObject())
+	{
+		const Member& member = m_members[i++];
+		if (member.action == Child)
+		{
+			Scratch<Datapoint *> children(pool);
+			UserTimestamp ts;
+			member.plan->getValues(m.value, policy, *children, ts);
+			if (children->size() > 0)
+			{
+				Reading *reading = new Reading(member.name, *children);
+				if (ts.set)
+					reading->setUserTimestamp(ts.tv);
+				readings.push_back(reading);
+			}
+		}
+	}
+	getValues(object, policy, *points, user_ts);
+	if (points->size() > 0)
+	{
+		Reading *reading = new Reading(asset, *points);
+		if (user_ts.set)
+			reading->setUserTimestamp(user_ts.tv);
+		readings.push_back(reading);
+	}
+}
+
+/**
+ * Get the datapoints from an object that matches this plan
+ *
+ * @param object	The object
+ * @param policy	The object policy
+ * @param points	The datapoint array
+ * @param user_ts	Set to the converted timestamp if one is found
+ */
+void DocumentPlan::getValues(const Value& object, const ObjectPolicy& policy,
+		vector<Datapoint *>& points, UserTimestamp& user_ts) const
+{
+	size_t i = 0;
+	for (auto& m : object.GetObject())
+	{
+		const Member& member = m_members[i++];
+		switch (member.action)
+		{
+			case Timestamp:
+				if (m.value.IsString())
+					policy.convertTimestamp(m.value.GetString(), user_ts);
+				else if (m.value.IsInt64())
+					policy.convertTimestamp((int64_t)m.value.GetInt64(), user_ts);
+				else if (m.value.IsDouble())
+					policy.convertTimestamp(m.value.GetDouble(), user_ts);
+				break;
+			case Number:
+				if (m.value.IsInt64())
+				{
+					DatapointValue dpv((long)m.value.GetInt64());
+					points.push_back(new Datapoint(member.name, dpv));
+				}
+				else if (m.value.IsDouble())
+				{
+					DatapointValue dpv(m.value.GetDouble());
+					points.push_back(new Datapoint(member.name, dpv));
+				}
+				break;
+			case String:
+			{
+				DatapointValue dpv(m.value.GetString());
+				points.push_back(new Datapoint(member.name, dpv));
+				break;
+			}
+			case Nest:
+			{
+				vector<Datapoint *> *children = new vector<Datapoint *>;
+				UserTimestamp ts;
+				member.plan->getValues(m.value, policy, *children, ts);
+				DatapointValue dpv(children, true);
+				points.push_back(new Datapoint(member.name, dpv));
+				break;
+			}
+			case Collapse:
+			{
+				UserTimestamp ts;
+				member.plan->getValues(m.value, policy, points, ts);
+				break;
+			}
+			case Child:
+			case Skip:
+				break;
+		}
+	}
+}
+
+/**
+ * Return the plan for a document received on a topic, compiling a new
+ * plan if the document does not match the shape of any of the plans
+ * cached for the topic.
+ *
+ * @param topic		The topic the document was received on
+ * @param object	The root object of the document
+ * @param policy	The object policy
+ * @return DocumentPlan*	The plan for the document
+ */
+const DocumentPlan *PlanCache::getPlan(const string& topic, const Value& object, const ObjectPolicy& policy)
+{
+	auto it = m_plans.find(topic);
+	if (it == m_plans.end())
+	{
+		if (m_plans.size() >= MAX_CACHED_TOPICS)
+		{
+			m_plans.clear();
+		}
+		it = m_plans.emplace(topic, vector<unique_ptr<DocumentPlan> >()).first;
+	}
+	vector<unique_ptr<DocumentPlan> >& plans = it->second;
+	for (size_t i = 0; i < plans.size(); i++)
+	{
+		if (plans[i]->matches(object))
+		{
+			m_hits++;
+			// Keep the most recently used shape first
+			if (i > 0)
+				rotate(plans.begin(), plans.begin() + i, plans.begin() + i + 1);
+			return plans[0].get();
+		}
+	}
+
+	m_misses++;
+	if (plans.size() >= MAX_SHAPES_PER_TOPIC)
+	{
+		plans.pop_back();
+	}
+	plans.insert(plans.begin(), unique_ptr<DocumentPlan>(new DocumentPlan(object, policy)));
+	return plans[0].get();
+}
@@ -0,0 +1,124 @@
+/*
+ * FogLAMP "MQTTScripted" duplicate message filter.
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <duplicate_filter.h>
+
+using namespace std;
+
+/**
+ * Construct a duplicate filter
+ *
+ * @param window	The time in milliseconds within which a message
+ *			received on both clients is a duplicate
+ */
+DuplicateFilter::DuplicateFilter(long window) : m_window(window)
+{
+}
+
+/**
+ * Check if a message has already been received on the other client. The
+ * first copy of a message is recorded, the second copy is matched with
+ * it and reported as a duplicate.
+ *
+ * @param client	The client the message was received on, 0 or 1
+ * @param topic		The topic the message was received on
+ * @param topicLength	The length of the topic
+ * @param payload	The payload of the message
+ * @param payloadLength	The length of the payload
+ * @return bool		True if the message is a duplicate and should be discarded
+ */
+bool DuplicateFilter::duplicate(int client, const char *topic, size_t topicLength,
+		const void *payload, size_t payloadLength)
+{
+	uint64_t key = hash(topic, topicLength, payload, payloadLength);
+	Time now = chrono::steady_clock::now();
+
+	lock_guard<mutex> guard(m_mutex);
+	expire(now);
+	Pending& pending = m_pending[key];
+	deque<Time>& other = pending.received[1 - client];
+	if (!other.empty())
+	{
+		other.pop_front();
+		return true;
+	}
+	pending.received[client].push_back(now);
+	m_received.push_back(make_pair(now, key));
+	return false;
+}
+
+/**
+ * Forget all of the messages received
+ */
+void DuplicateFilter::clear()
+{
+	lock_guard<mutex> guard(m_mutex);
+	m_pending.clear();
+	m_received.clear();
+}
+
+/**
+ * Remove the messages received before the start of the window. Must be
+ * called holding the mutex.
+ *
+ * @param now	The current time
+ */
+void DuplicateFilter::expire(Time now)
+{
+	Time cutoff = now - m_window;
+	while (!m_received.empty() && m_received.front().first < cutoff)
+	{
+		auto it = m_pending.find(m_received.front().second);
+		m_received.pop_front();
+		if (it == m_pending.end())
+		{
+			continue;
+		}
+		bool empty = true;
+		for (auto& received : it->second.received)
+		{
+			while (!received.empty() && received.front() < cutoff)
+			{
+				received.pop_front();
+			}
+			empty = empty && received.empty();
+		}
+		if (empty)
+		{
+			m_pending.erase(it);
+		}
+	}
+}
+
+/**
+ * Return the 64 bit FNV-1a hash of the topic and payload of a message
+ *
+ * @param topic		The topic the message was received on
+ * @param topicLength	The length of the topic
+ * @param payload	The payload of the message
+ * @param payloadLength	The length of the payload
+ * @return uint64_t	The hash
+ */
+uint64_t DuplicateFilter::hash(const char *topic, size_t topicLength,
+		const void *payload, size_t payloadLength)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < topicLength; i++)
+	{
+		hash = (hash ^ (unsigned char)topic[i]) * 0x100000001b3ULL;
+	}
+	// Separate the topic from the payload
+	hash = (hash ^ 0xff) * 0x100000001b3ULL;
+	const unsigned char *p = (const unsigned char *)payload;
+	for (size_t i = 0; i < payloadLength; i++)
+	{
+		hash = (hash ^ p[i]) * 0x100000001b3ULL;
+	}
+	return hash;
+}
@@ -0,0 +1,173 @@
+/*
+ * FogLAMP "MQTTScripted" flow control.
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <flow_control.h>
+#include <chrono>
+
+using namespace std;
+
+/**
+ * Construct the flow control with the default policy and thresholds
+ */
+FlowControl::FlowControl() : m_pressure(false), m_discarded(0), m_policy(Block),
+	m_threshold(DEFAULT_PRESSURE_THRESHOLD), m_maxLatency(DEFAULT_MAX_INGEST_LATENCY),
+	m_count(0), m_depth(0), m_latency(0), m_shutdown(false)
+{
+}
+
+/**
+ * Set the policy and thresholds. Any pressure currently applied is
+ * released and will be reapplied if the new thresholds are exceeded.
+ *
+ * @param policy	The policy applied whilst under pressure
+ * @param threshold	The percentage of the queue depth at which pressure is applied
+ * @param maxLatency	The ingest latency in milliseconds at which pressure is applied, 0 disables the check
+ */
+void FlowControl::configure(Policy policy, int threshold, long maxLatency)
+{
+	lock_guard<mutex> guard(m_mutex);
+	m_policy = policy;
+	m_threshold = threshold > 0 && threshold <= 100 ? threshold : DEFAULT_PRESSURE_THRESHOLD;
+	m_maxLatency = maxLatency >= 0 ? maxLatency : DEFAULT_MAX_INGEST_LATENCY;
+	m_latency = 0;
+	m_pressure = false;
+	m_relieved.notify_all();
+}
+
+/**
+ * Report the occupancy of the ingress queue
+ *
+ * @param count		The number of messages queued
+ * @param depth		The depth of the queue
+ * @return Transition	The change in pressure, if any
+ */
+FlowControl::Transition FlowControl::queued(size_t count, size_t depth)
+{
+	lock_guard<mutex> guard(m_mutex);
+	m_count = count;
+	m_depth = depth;
+	return evaluate();
+}
+
+/**
+ * Report the time taken by the south service to accept a batch of readings
+ *
+ * @param latency	The time taken in milliseconds
+ * @return Transition	The change in pressure, if any
+ */
+FlowControl::Transition FlowControl::ingested(long latency)
+{
+	lock_guard<mutex> guard(m_mutex);
+	m_latency = latency;
+	return evaluate();
+}
+
+/**
+ * Apply or relieve pressure based on the last reported queue occupancy
+ * and ingest latency. Must be called holding the mutex.
+ *
+ * @return Transition	The change in pressure, if any
+ */
+FlowControl::Transition FlowControl::evaluate()
+{
+	size_t high = (m_depth * m_threshold) / 100;
+	if (high == 0)
+	{
+		high = 1;
+	}
+	bool slow = m_maxLatency > 0 && m_latency > m_maxLatency;
+	if (!m_pressure)
+	{
+		if (m_count >= high || (slow && m_count > 0))
+		{
+			m_reason = slow ? "the south service is slow to accept readings"
+					: "the ingress queue is filling";
+			m_pressure = true;
+			return Pressure;
+		}
+		return Unchanged;
+	}
+	bool drained = m_count <= high / 2;
+	bool fast = m_maxLatency == 0 || m_latency <= m_maxLatency / 2;
+	if (m_count == 0 || (drained && fast))
+	{
+		m_pressure = false;
+		m_relieved.notify_all();
+		return Relieved;
+	}
+	return Unchanged;
+}
+
+/**
+ * Wait until the pressure is relieved or the flow control is shutdown.
+ * The caller should report the queue occupancy again if the timeout
+ * expires, as the last report may have been overtaken.
+ *
+ * @param timeout	The maximum time to wait in milliseconds
+ * @return bool		False if the timeout expired
+ */
+bool FlowControl::wait(long timeout)
+{
+	unique_lock<mutex> lck(m_mutex);
+	return m_relieved.wait_for(lck, chrono::milliseconds(timeout),
+			[this] { return !m_pressure || m_shutdown; });
+}
+
+/**
+ * Return the reason pressure was last applied
+ *
+ * @return string	The reason
+ */
+string FlowControl::getReason()
+{
+	lock_guard<mutex> guard(m_mutex);
+	return m_reason;
+}
+
+/**
+ * Release any waiting callers, used when the plugin is stopped
+ */
+void FlowControl::shutdown()
+{
+	lock_guard<mutex> guard(m_mutex);
+	m_shutdown = true;
+	m_relieved.notify_all();
+}
+
+/**
+ * Allow the flow control to be used again after a shutdown
+ */
+void FlowControl::restart()
+{
+	lock_guard<mutex> guard(m_mutex);
+	m_shutdown = false;
+	m_pressure = false;
+	m_count = 0;
+	m_latency = 0;
+}
+
+/**
+ * Convert the name of a policy, as given in the configuration, to the policy
+ *
+ * @param name		The name of the policy
+ * @param policy	Set to the policy
+ * @return bool		False if the name is not recognised
+ */
+bool FlowControl::parsePolicy(const string& name, Policy& policy)
+{
+	if (name.compare("Block") == 0)
+		policy = Block;
+	else if (name.compare("Pause") == 0)
+		policy = Pause;
+	else if (name.compare("Discard") == 0)
+		policy = Discard;
+	else
+		return false;
+	return true;
+}
@@ -0,0 +1,118 @@
+#ifndef _CAPTURE_RING_H
+#define _CAPTURE_RING_H
+/*
+ * FogLAMP south service plugin
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <mqtt_payload.h>
+#include <stage_timer.h>
+#include <sys/time.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <utility>
+#include <mutex>
+#include <atomic>
+
+#define DEFAULT_CAPTURE_SIZE	64	// Default number of messages held in the capture ring
+#define CAPTURE_TOPIC_SIZE	128	// Bytes of the topic held for each message
+#define CAPTURE_PAYLOAD_SIZE	512	// Bytes of the payload held for each message
+
+/**
+ * A ring holding the most recent messages processed by the plugin, the
+ * outcome of processing them and the time taken. The topic and the start
+ * of the payload are copied into fixed size slots, so recording a message
+ * makes no allocations and the ring can be left enabled in production.
+ * The ring is dumped on demand to troubleshoot live traffic without
+ * enabling debug logging.
+ *
+ * Any number of threads may record messages concurrently.
+ */
+class CaptureRing {
+	public:
+		enum Result { JSON, SimpleValue, Script, ScriptBatch, Rejected, Failed };
+				CaptureRing();
+		void		resize(unsigned int size);
+		unsigned int	size() const { return m_size; };
+		bool		enabled() const
+				{
+					return m_enabled.load(std::memory_order_relaxed);
+				};
+		void		record(const MQTTPayload& payload, Result result, size_t readings,
+						uint64_t elapsed, const uint64_t *stages);
+		void		clear();
+		void		dump(std::vector<std::string>& entries);
+		void		scriptMessages(std::vector<std::pair<std::string, std::string> >& messages);
+		static const char
+				*resultName(Result result);
+	private:
+		typedef struct {
+			struct timeval	time;
+			uint64_t	elapsed;
+			uint64_t	stages[StageTimers::STAGES];
+			uint32_t	length;
+			uint32_t	readings;
+			uint16_t	topicLength;
+			uint16_t	payloadLength;
+			uint8_t		result;
+			char		topic[CAPTURE_TOPIC_SIZE];
+			char		payload[CAPTURE_PAYLOAD_SIZE];
+		} Entry;
+		static void	escape(std::string& out, const char *str, size_t length);
+		std::mutex	m_mutex;
+		std::vector<Entry>
+				m_entries;
+		unsigned int	m_size;
+		unsigned long	m_recorded;
+		std::atomic<bool>
+				m_enabled;
+};
+
+/**
+ * Capture the processing of a message from the creation of the object
+ * until it is destroyed. The message is recorded in the ring with the
+ * result that has been set, the time taken and, if latency statistics
+ * are enabled, the time spent in each stage. Nothing is done if the
+ * ring is not enabled.
+ */
+class Capture {
+	public:
+		Capture(CaptureRing& ring, const MQTTPayload& payload) :
+			m_ring(ring), m_payload(payload), m_result(CaptureRing::Failed), m_readings(0),
+			m_start(ring.enabled() ? StageTimers::now() : 0)
+		{
+			if (m_start)
+			{
+				for (int i = 0; i < StageTimers::STAGES; i++)
+					m_stages[i] = 0;
+				StageTimers::capture(m_stages);
+			}
+		};
+		~Capture()
+		{
+			if (m_start)
+			{
+				StageTimers::capture(NULL);
+				m_ring.record(m_payload, m_result, m_readings,
+						StageTimers::now() - m_start, m_stages);
+			}
+		};
+		void	result(CaptureRing::Result result, size_t readings)
+		{
+			m_result = result;
+			m_readings = readings;
+		};
+	private:
+		CaptureRing&		m_ring;
+		const MQTTPayload&	m_payload;
+		CaptureRing::Result	m_result;
+		size_t			m_readings;
+		uint64_t		m_start;
+		uint64_t		m_stages[StageTimers::STAGES];
+};
+#endif
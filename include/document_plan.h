@@ -0,0 +1,86 @@
+#ifndef _DOCUMENT_PLAN_H
+#define _DOCUMENT_PLAN_H
+/*
+ * FogLAMP south service plugin
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <rapidjson/document.h>
+#include <object_policy.h>
+#include <scratch_pool.h>
+#include <reading.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+
+#define MAX_SHAPES_PER_TOPIC	4	// Number of document shapes remembered for each topic
+#define MAX_CACHED_TOPICS	1000	// Number of topics for which plans are cached
+
+/**
+ * A compiled plan for extracting readings from JSON documents that
+ * have a particular shape, i.e. the same member names, in the same
+ * order, with the same types.
+ *
+ * The plan resolves, once, which member is the timestamp, how each
+ * member is mapped to a datapoint according to the object policy and
+ * the datapoint names. Documents that match the shape are converted
+ * without examining the member names or types again.
+ */
+class DocumentPlan {
+	public:
+				DocumentPlan(const rapidjson::Value& object, const ObjectPolicy& policy);
+		bool		matches(const rapidjson::Value& object) const;
+		void		createReadings(const rapidjson::Value& object, const ObjectPolicy& policy,
+					const std::string& asset, std::vector<Reading *>& readings,
+					DatapointPool& pool) const;
+	private:
+		enum Action { Skip, Timestamp, Number, String, Nest, Collapse, Child };
+		class Member {
+			public:
+				Member(const std::string& name, rapidjson::Type type, Action action) :
+					name(name), type(type), action(action) {};
+				std::string	name;
+				rapidjson::Type	type;
+				Action		action;
+				std::unique_ptr<DocumentPlan>
+						plan;
+		};
+				DocumentPlan(const rapidjson::Value& object, const ObjectPolicy& policy,
+					bool recurse, bool multiple);
+		void		compile(const rapidjson::Value& object, const ObjectPolicy& policy,
+					bool recurse, bool multiple);
+		void		getValues(const rapidjson::Value& object, const ObjectPolicy& policy,
+					std::vector<Datapoint *>& points, UserTimestamp& user_ts) const;
+		std::vector<Member>	m_members;
+};
+
+/**
+ * A cache of the document plans for each topic. Devices publishing to
+ * a topic almost always send documents of the same shape, the most
+ * recently used shapes for each topic are retained and a new plan is
+ * compiled when a document of a different shape is received.
+ *
+ * The plans depend upon the object policy, the cache must be cleared
+ * when the policy changes. The cache is not thread safe.
+ */
+class PlanCache {
+	public:
+				PlanCache() : m_hits(0), m_misses(0) {};
+		const DocumentPlan
+				*getPlan(const std::string& topic, const rapidjson::Value& object,
+					const ObjectPolicy& policy);
+		void		clear() { m_plans.clear(); };
+		unsigned long	hits() const { return m_hits; };
+		unsigned long	misses() const { return m_misses; };
+	private:
+		std::unordered_map<std::string, std::vector<std::unique_ptr<DocumentPlan> > >
+				m_plans;
+		unsigned long	m_hits;
+		unsigned long	m_misses;
+};
+#endif
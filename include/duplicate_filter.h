@@ -0,0 +1,59 @@
+#ifndef _DUPLICATE_FILTER_H
+#define _DUPLICATE_FILTER_H
+/*
+ * FogLAMP south service plugin
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <chrono>
+#include <deque>
+#include <unordered_map>
+#include <mutex>
+
+#define DUPLICATE_WINDOW	2000	// Time in milliseconds within which a message received on both clients is a duplicate
+
+/**
+ * Detects the messages delivered to both of two clients whilst one
+ * client replaces the other. Each message is identified by a hash of its
+ * topic and payload. A message is a duplicate if a message with the same
+ * hash was received on the other client within the window and has not
+ * already been matched. Messages with the same content that are published
+ * more than once are received the same number of times on each client,
+ * so only the second copy of each is reported as a duplicate.
+ *
+ * A message received on one client before the other has subscribed, and
+ * an identical message received on the other client only after the first
+ * has stopped receiving, are wrongly reported as duplicates if they fall
+ * within the window.
+ */
+class DuplicateFilter {
+	public:
+				DuplicateFilter(long window = DUPLICATE_WINDOW);
+		bool		duplicate(int client, const char *topic, size_t topicLength,
+						const void *payload, size_t payloadLength);
+		void		clear();
+		static uint64_t	hash(const char *topic, size_t topicLength,
+						const void *payload, size_t payloadLength);
+	private:
+		typedef std::chrono::steady_clock::time_point	Time;
+		typedef struct {
+			std::deque<Time>	received[2];
+		} Pending;
+		void		expire(Time now);
+		std::mutex	m_mutex;
+		std::chrono::milliseconds
+				m_window;
+		std::unordered_map<uint64_t, Pending>
+				m_pending;
+		// The order in which the messages were received, used to
+		// remove the pending messages once the window has passed
+		std::deque<std::pair<Time, uint64_t> >
+				m_received;
+};
+#endif
@@ -0,0 +1,81 @@
+#ifndef _FLOW_CONTROL_H
+#define _FLOW_CONTROL_H
+/*
+ * FogLAMP south service plugin
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <string>
+
+#define DEFAULT_PRESSURE_THRESHOLD	80	// Percentage of the queue depth at which pressure is applied
+#define DEFAULT_MAX_INGEST_LATENCY	1000	// Ingest latency in milliseconds at which pressure is applied
+#define FLOW_CHECK_INTERVAL		1000	// Interval in milliseconds at which a waiting caller rechecks the queue
+
+/**
+ * Flow control between the ingest pipeline and the receipt of messages
+ * from the broker. The occupancy of the ingress queue and the time
+ * taken by the south service to accept readings are monitored, when
+ * either exceeds its threshold the pipeline is considered to be under
+ * pressure. The pressure is relieved once the queue has drained to
+ * half the threshold and the ingest latency has fallen to half its
+ * threshold, or the queue is empty. A slow ingest latency only applies
+ * pressure whilst there are messages queued.
+ *
+ * Whilst under pressure one of the policies is applied to the messages
+ * received from the broker
+ *
+ *   Block	The message arrival callback waits, so no further messages
+ *		are received and once the maximum in flight is reached the
+ *		broker holds the backlog. A QoS 1 message has already been
+ *		acknowledged when the callback is called. The wait is
+ *		limited to one keep alive interval, after which the
+ *		connection is paused
+ *   Pause	The plugin disconnects from the broker until the pressure
+ *		is relieved, with a persistent session the broker queues
+ *		the messages published in the meantime
+ *   Discard	Messages are acknowledged and discarded
+ */
+class FlowControl {
+	public:
+		enum Policy { Block, Pause, Discard };
+		enum Transition { Unchanged, Pressure, Relieved };
+				FlowControl();
+		void		configure(Policy policy, int threshold, long maxLatency);
+		Policy		getPolicy() const { return m_policy; };
+		bool		underPressure() const { return m_pressure; };
+		Transition	queued(size_t count, size_t depth);
+		Transition	ingested(long latency);
+		bool		wait(long timeout);
+		void		discarded() { m_discarded++; };
+		unsigned long	getDiscarded() { return m_discarded.exchange(0); };
+		std::string	getReason();
+		void		shutdown();
+		void		restart();
+		static bool	parsePolicy(const std::string& name, Policy& policy);
+	private:
+		Transition	evaluate();
+		std::mutex	m_mutex;
+		std::condition_variable
+				m_relieved;
+		std::atomic<bool>
+				m_pressure;
+		std::atomic<unsigned long>
+				m_discarded;
+		std::atomic<Policy>
+				m_policy;
+		int		m_threshold;
+		long		m_maxLatency;
+		size_t		m_count;
+		size_t		m_depth;
+		long		m_latency;
+		bool		m_shutdown;
+		std::string	m_reason;
+};
+#endif
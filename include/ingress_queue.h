@@ -0,0 +1,97 @@
+#ifndef _INGRESS_QUEUE_H
+#define _INGRESS_QUEUE_H
+/*
+ * FogLAMP south service plugin
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <MQTTAsync.h>
+#include <spill_buffer.h>
+#include <sys/time.h>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+#define DEFAULT_QUEUE_DEPTH	1000	// Default number of messages buffered between MQTT and processing
+
+/**
+ * An entry in the ingress queue. The entry holds the message and topic
+ * name exactly as they were passed to the message arrival callback, the
+ * consumer takes ownership of them when the entry is removed from the
+ * queue.
+ *
+ * Messages read back from the spill buffer have no message, the topic
+ * and payload are held in a single allocated buffer, pointed to by the
+ * topic name, that the consumer must free.
+ */
+typedef struct {
+	char			*topicName;
+	int			topicLen;
+	MQTTAsync_message	*message;
+	size_t			payloadLen;
+	struct timeval		received;
+} QueueEntry;
+
+/**
+ * Statistics gathered by the ingress queue
+ */
+typedef struct {
+	size_t			depth;		// The configured queue depth
+	size_t			current;	// Number of messages currently queued
+	size_t			highWater;	// Largest number of messages queued
+	unsigned long		queued;		// Total number of messages queued
+	unsigned long		maxWait;	// Longest time a message was queued in microseconds
+	unsigned long		spilled;	// Total number of messages written to the spill buffer
+	unsigned long		spillEntries;	// Number of messages currently in the spill buffer
+	size_t			spillUsed;	// Bytes currently used in the spill buffer
+	size_t			spillSize;	// Size of the spill buffer in bytes, 0 if there is none
+} QueueStatistics;
+
+/**
+ * A bounded ring buffer that sits between the MQTT message arrival
+ * callback and the thread that processes the messages. This decouples
+ * the Paho receive thread from the conversion of messages, allowing
+ * bursts of messages to be absorbed without stalling the network
+ * connection. Only when the queue is full will the arrival callback
+ * be blocked.
+ *
+ * The queue may be extended by a spill buffer on disk. Once the queue is
+ * full messages are copied to the spill buffer, and all messages that
+ * follow are also spilled until it has been emptied so that the order
+ * of the messages is preserved. Only when the spill buffer is also full
+ * is the arrival callback blocked. When the queue is shutdown only the
+ * messages in the ring are drained, the spilled messages are kept in the
+ * file to be recovered.
+ */
+class IngressQueue {
+	public:
+				IngressQueue(size_t depth);
+				~IngressQueue();
+		bool		spill(const std::string& path, size_t size);
+		bool		push(char *topicName, int topicLen, MQTTAsync_message *message);
+		bool		pop(QueueEntry& entry, long timeout = -1);
+		bool		drained();
+		void		occupancy(size_t& count, size_t& depth);
+		void		resize(size_t depth);
+		void		shutdown();
+		void		restart();
+		void		getStatistics(QueueStatistics& stats);
+	private:
+		std::vector<QueueEntry>	m_ring;
+		SpillBuffer		m_spill;
+		unsigned long		m_spilled;
+		size_t			m_head;
+		size_t			m_count;
+		size_t			m_highWater;
+		unsigned long		m_queued;
+		unsigned long		m_maxWait;
+		bool			m_shutdown;
+		std::mutex		m_mutex;
+		std::condition_variable	m_notEmpty;
+		std::condition_variable	m_notFull;
+};
+#endif
@@ -0,0 +1,99 @@
+#ifndef _MQTT_PAYLOAD_H
+#define _MQTT_PAYLOAD_H
+/*
+ * FogLAMP south service plugin
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <MQTTAsync.h>
+#include <string.h>
+#include <stdlib.h>
+#include <string>
+
+/**
+ * A length delimited view of the payload of an MQTT message and the
+ * topic on which it arrived.
+ *
+ * When constructed from the message arrival callback the payload takes
+ * ownership of the MQTTAsync_message and topic name that were allocated
+ * by the MQTT client library and returns them to the library when it is
+ * destroyed. This allows the payload to be handed to the processing code
+ * without copying it. The payload is not NULL terminated and may contain
+ * embedded NULL characters, the length must always be used.
+ *
+ * A payload read back from the spill buffer owns a single allocated
+ * buffer holding the topic followed by the payload, which is freed when
+ * the payload is destroyed.
+ *
+ * A payload may also be constructed as a non-owning view of existing
+ * memory, in which case the caller must ensure the memory outlives the
+ * payload.
+ */
+class MQTTPayload {
+	public:
+		MQTTPayload(char *topicName, int topicLen, MQTTAsync_message *message) :
+				m_message(message), m_topicName(topicName), m_buffer(NULL)
+		{
+			m_data = (const char *)message->payload;
+			m_length = message->payloadlen;
+			m_topic = topicName;
+			m_topicLength = topicLen > 0 ? topicLen : strlen(topicName);
+		};
+		MQTTPayload(char *buffer, size_t topicLength, size_t length) :
+				m_message(NULL), m_topicName(NULL), m_buffer(buffer),
+				m_data(buffer + topicLength), m_length(length),
+				m_topic(buffer), m_topicLength(topicLength)
+		{
+		};
+		MQTTPayload(const char *data, size_t length, const char *topic, size_t topicLength) :
+				m_message(NULL), m_topicName(NULL), m_buffer(NULL),
+				m_data(data), m_length(length),
+				m_topic(topic), m_topicLength(topicLength)
+		{
+		};
+		MQTTPayload(const std::string& payload, const std::string& topic) :
+				m_message(NULL), m_topicName(NULL), m_buffer(NULL),
+				m_data(payload.data()), m_length(payload.length()),
+				m_topic(topic.data()), m_topicLength(topic.length())
+		{
+		};
+		MQTTPayload(MQTTPayload&& rhs) :
+				m_message(rhs.m_message), m_topicName(rhs.m_topicName),
+				m_buffer(rhs.m_buffer), m_data(rhs.m_data), m_length(rhs.m_length),
+				m_topic(rhs.m_topic), m_topicLength(rhs.m_topicLength)
+		{
+			rhs.m_message = NULL;
+			rhs.m_topicName = NULL;
+			rhs.m_buffer = NULL;
+		};
+		~MQTTPayload()
+		{
+			if (m_message)
+				MQTTAsync_freeMessage(&m_message);
+			if (m_topicName)
+				MQTTAsync_free(m_topicName);
+			free(m_buffer);
+		};
+		const char	*data() const { return m_data; };
+		size_t		length() const { return m_length; };
+		const char	*topic() const { return m_topic; };
+		size_t		topicLength() const { return m_topicLength; };
+		std::string	str() const { return std::string(m_data, m_length); };
+		std::string	topicStr() const { return std::string(m_topic, m_topicLength); };
+	private:
+				MQTTPayload(const MQTTPayload&);
+		MQTTPayload&	operator=(const MQTTPayload&);
+	private:
+		MQTTAsync_message	*m_message;
+		char			*m_topicName;
+		char			*m_buffer;
+		const char		*m_data;
+		size_t			m_length;
+		const char		*m_topic;
+		size_t			m_topicLength;
+};
+#endif
@@ -0,0 +1,50 @@
+#ifndef _OBJECT_POLICY_H
+#define _OBJECT_POLICY_H
+/*
+ * FogLAMP south service plugin
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <logger.h>
+#include <timestamp_parser.h>
+#include <string.h>
+#include <string>
+
+/**
+ * The policy used to map the JSON documents in MQTT payloads, or the
+ * DICT objects returned by the script, into readings. This includes
+ * the treatment of nested objects and the extraction and conversion
+ * of the timestamp property. The timestamp format is compiled into a
+ * parser once, when the policy is created.
+ *
+ * A policy is immutable once created, a reconfiguration creates a new
+ * policy. This allows the policy to be shared with the threads that
+ * execute the script without holding the plugin mutex.
+ */
+class ObjectPolicy {
+	public:
+		enum Policy { FirstLevel, Collapse, Multiple };
+				ObjectPolicy(const std::string& policy, const std::string& timestamp,
+						const std::string& format, const std::string& timezone);
+		Policy		getPolicy() const { return m_policy; };
+		bool		nest() const { return m_nest; };
+		bool		isTimestamp(const char *name) const
+				{
+					return strcmp(name, m_timestamp.c_str()) == 0;
+				};
+		bool		convertTimestamp(const char *ts, UserTimestamp& user_ts) const;
+		bool		convertTimestamp(int64_t ts, UserTimestamp& user_ts) const;
+		bool		convertTimestamp(double ts, UserTimestamp& user_ts) const;
+	private:
+		static long	parseTimezone(const std::string& timezone);
+		Policy		m_policy;
+		bool		m_nest;
+		std::string	m_timestamp;
+		TimestampParser	m_parser;
+		Logger		*m_logger;
+};
+#endif
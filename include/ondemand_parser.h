@@ -0,0 +1,47 @@
+#ifndef _ONDEMAND_PARSER_H
+#define _ONDEMAND_PARSER_H
+/*
+ * FogLAMP south service plugin
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <mqtt_payload.h>
+#include <object_policy.h>
+#include <reading.h>
+#include <scratch_pool.h>
+#include <string>
+#include <vector>
+
+/**
+ * A JSON parser that uses the simdjson on demand API to convert a
+ * payload directly into readings, following the rules of the object
+ * policy, in a single pass without building a document.
+ *
+ * simdjson requires C++17, the parser is only functional if the plugin
+ * was built with simdjson available. The implementation is hidden from
+ * this header so that the remainder of the plugin may be built as C++11.
+ *
+ * A parser instance is not thread safe, each worker thread should have
+ * its own instance.
+ */
+class OnDemandParser {
+	public:
+				OnDemandParser();
+				~OnDemandParser();
+		bool		parse(const MQTTPayload& payload, const ObjectPolicy& policy,
+					const std::string& asset, std::vector<Reading *>& readings);
+		static bool	available();
+		const DatapointPool&
+				datapointPool() const { return m_pool; };
+	private:
+				OnDemandParser(const OnDemandParser&);
+		OnDemandParser&	operator=(const OnDemandParser&);
+		class Impl;
+		Impl		*m_impl;
+		DatapointPool	m_pool;
+};
+#endif
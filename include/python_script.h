@@ -14,15 +14,69 @@
 #include <Python.h>
 #include <pyruntime.h>
 #include <rapidjson/document.h>
+#include <mqtt_payload.h>
+#include <object_policy.h>
+#include <scratch_pool.h>
+#include <reading.h>
+#include <thread>
+#include <mutex>
+#include <vector>
+
+/*
+ * Python 3.12 and later support sub-interpreters that have their own GIL,
+ * allowing scripts to be executed in parallel on multiple cores
+ */
+#if PY_VERSION_HEX >= 0x030C0000
+#define PYTHON_SUBINTERPRETERS	1
+#endif
 
 class PythonScript {
 	public:
-		PythonScript(const std::string& name);
+		enum PayloadType { PayloadString, PayloadBytes, PayloadMemoryView };
+		PythonScript(const std::string& name, bool subInterpreter = false);
+		PythonScript(const std::string& name, PythonScript *parent);
 		~PythonScript();
 		bool			setScript(const std::string& file);
-		rapidjson::Document	*execute(const std::string& message, const std::string& topic,  std::string& asset);
+		bool			loadScript(const std::string& file);
+		void			swapScript(PythonScript& other);
+		static bool		readScript(const std::string& name, std::string& path,
+						std::string& source);
+		rapidjson::Document	*execute(const MQTTPayload& payload, std::string& asset);
+		rapidjson::Document	*execute(const std::string& message, const std::string& topic,  std::string& asset)
+					{
+						MQTTPayload payload(message, topic);
+						return execute(payload, asset);
+					};
+		bool			execute(const MQTTPayload& payload, const ObjectPolicy& policy,
+						std::string& asset, std::vector<Reading *>& readings);
+		bool			executeBatch(const std::vector<MQTTPayload>& payloads, const ObjectPolicy& policy,
+						const std::string& asset, std::vector<Reading *>& readings);
+		bool			hasBatch() const { return m_pBatchFunc != NULL; };
+		void			setPayloadType(PayloadType type) { m_payloadType = type; };
+		PayloadType		getPayloadType() const { return m_payloadType; };
+		const DatapointPool&	datapointPool() const { return m_pool; };
+		static bool		parallelSupported()
+					{
+#ifdef PYTHON_SUBINTERPRETERS
+						return true;
+#else
+						return false;
+#endif
+					};
 	private:
+		PyObject		*callConvert(const MQTTPayload& payload, std::string& asset, PyObject *&pDict);
+		bool			parseReturn(PyObject *pReturn, std::string& asset, PyObject *&pDict);
+		PyObject		*payloadObject(const MQTTPayload& payload);
+		void			releasePayload(PyObject *pMessage);
+		void lock();
+		void unlock();
 		void createJSON(PyObject *pValue, rapidjson::Value& node, rapidjson::Document::AllocatorType& alloc);
+		void createReadings(PyObject *pDict, const std::string& asset, const ObjectPolicy& policy,
+				std::vector<Reading *>& readings);
+		void getValues(PyObject *pDict, const ObjectPolicy& policy, std::vector<Datapoint *>& points,
+				bool recurse, UserTimestamp& user_ts);
+		void addValue(PyObject *key, PyObject *value, const ObjectPolicy& policy,
+				std::vector<Datapoint *>& points, bool recurse, UserTimestamp& user_ts);
 		void freeMemObj(PyObject *obj1);
 		void freeMemAll(PyObject *obj1, char *str, PyObject *obj3);
 		void logError();
@@ -32,9 +86,17 @@ class PythonScript {
 		Logger			*m_logger;
 		PyObject		*m_pFunc;
 		PyObject		*m_pModule;
+		PyObject		*m_pBatchFunc;
+		PayloadType		m_payloadType;
 		PythonRuntime		*m_runtime;
 		bool			m_failedScript;
 		int			m_execCount;
+		PyInterpreterState	*m_interpreter;
+		PythonScript		*m_parent;
+		std::mutex		m_threadStatesMutex;
+		std::vector<std::pair<std::thread::id, PyThreadState *> >
+					m_threadStates;
+		DatapointPool		m_pool;
 };
 
 #endif
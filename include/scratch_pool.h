@@ -0,0 +1,83 @@
+#ifndef _SCRATCH_POOL_H
+#define _SCRATCH_POOL_H
+/*
+ * FogLAMP south service plugin
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <vector>
+#include <atomic>
+
+#define MAX_POOLED_VECTORS	32	// Maximum number of free vectors retained by a pool
+
+/**
+ * A pool of the scratch vectors used to collect datapoints whilst a
+ * payload is converted into readings. Vectors are returned to the pool
+ * once the readings have been created, retaining the storage they have
+ * grown, so that the conversion of subsequent payloads does not need to
+ * allocate.
+ *
+ * The readings and datapoints themselves are owned, and deleted, by the
+ * south service and so can not be allocated from the pool.
+ *
+ * A pool is not thread safe, each worker should have its own pool. The
+ * statistics may be read from any thread.
+ */
+template<typename T> class ScratchPool {
+	public:
+		ScratchPool() : m_acquired(0), m_reused(0) {};
+		~ScratchPool()
+		{
+			for (auto v : m_free)
+				delete v;
+		};
+		std::vector<T>	*acquire()
+		{
+			m_acquired.fetch_add(1, std::memory_order_relaxed);
+			if (m_free.empty())
+				return new std::vector<T>;
+			m_reused.fetch_add(1, std::memory_order_relaxed);
+			std::vector<T> *v = m_free.back();
+			m_free.pop_back();
+			return v;
+		};
+		void		release(std::vector<T> *v)
+		{
+			v->clear();
+			if (m_free.size() < MAX_POOLED_VECTORS)
+				m_free.push_back(v);
+			else
+				delete v;
+		};
+		unsigned long	acquired() const { return m_acquired.load(std::memory_order_relaxed); };
+		unsigned long	reused() const { return m_reused.load(std::memory_order_relaxed); };
+	private:
+		std::vector<std::vector<T> *>	m_free;
+		std::atomic<unsigned long>	m_acquired;
+		std::atomic<unsigned long>	m_reused;
+};
+
+/**
+ * A scratch vector that is acquired from a pool for the lifetime of
+ * the object and then returned to the pool
+ */
+template<typename T> class Scratch {
+	public:
+		Scratch(ScratchPool<T>& pool) : m_pool(pool), m_vector(pool.acquire()) {};
+		~Scratch() { m_pool.release(m_vector); };
+		std::vector<T>&	operator*() { return *m_vector; };
+		std::vector<T>	*operator->() { return m_vector; };
+	private:
+		Scratch(const Scratch&);
+		Scratch&	operator=(const Scratch&);
+		ScratchPool<T>&	m_pool;
+		std::vector<T>	*m_vector;
+};
+
+class Datapoint;
+typedef ScratchPool<Datapoint *> DatapointPool;
+#endif
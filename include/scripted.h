@@ -9,28 +9,80 @@
  *
  * Author: Mark Riddoch
  */
-#include <MQTTClient.h>
+#include <MQTTAsync.h>
 #include <python_script.h>
+#include <mqtt_payload.h>
+#include <ingress_queue.h>
+#include <flow_control.h>
+#include <stage_timer.h>
+#include <capture_ring.h>
+#include <duplicate_filter.h>
+#include <object_policy.h>
+#include <ondemand_parser.h>
+#include <simple_value.h>
+#include <document_plan.h>
+#include <subscription.h>
 #include <reading.h>
 #include <config_category.h>
 #include <plugin_api.h>
 #include <logger.h>
 #include <string>
 #include <vector>
+#include <map>
 #include <mutex>
+#include <condition_variable>
 #include <thread>
+#include <memory>
+#include <atomic>
 
 typedef void (*INGEST_CB)(void *, Reading);
+typedef void (*INGEST_CB2)(void *, std::vector<Reading *>*);
 
 #define	INITIAL_RECONNECT_WAIT	100	// Number of milliseconds before next attempt to reconnect
 #define MAX_RECONNECT_WAIT	(10 * INITIAL_RECONNECT_WAIT)
 #define CONNECT_ERROR_INTERVAL  60      // Interval between connection errors in seconds
+#define DEFAULT_BATCH_SIZE	100	// Default maximum number of readings per ingest call
+#define DEFAULT_BATCH_LATENCY	50	// Default time in milliseconds readings may be held before ingest
+#define MAX_SCRIPT_BATCH	250	// Maximum number of messages passed to convert_batch in one call
+#define QUEUE_STATS_INTERVAL	60	// Interval between reports of ingress queue statistics in seconds
+#define LATENCY_ASSET_SUFFIX	"Latency"	// Appended to the service name to give the latency statistics asset
+#define CONNECT_TIMEOUT		30	// Time in seconds allowed for a connection attempt
+#define DEFAULT_MAX_INFLIGHT	20	// Default maximum number of QoS 1 and 2 messages in flight
+#define ALTERNATE_ID_SUFFIX	"-alt"	// Distinguishes the client ID of a replacement client from the client it replaces
+#define DEFAULT_VALIDATION_MESSAGES	8	// Default number of captured messages a new script must convert
+#define KEEP_ALIVE_INTERVAL	20	// MQTT keep alive interval in seconds, also the longest time messages are blocked
+
+/**
+ * The scripts of the additional subscriptions used by a worker, indexed
+ * by script name
+ */
+typedef std::map<std::string, PythonScript *> ScriptCache;
+
+/**
+ * The source of each script used by the additional subscriptions when it
+ * was last loaded, indexed by script name
+ */
+typedef std::map<std::string, std::string> ScriptSources;
+
+class MQTTScripted;
+
+/**
+ * The context given to the message and connection lost callbacks of an
+ * MQTT client. Each client has its own context so the plugin can tell
+ * the clients apart whilst a replacement client is brought up alongside
+ * the client it replaces.
+ */
+typedef struct {
+	MQTTScripted	*plugin;
+	int		index;
+} ClientContext;
 
 /**
  * A scripted MQTT client plugin.
  *
- * The plugin connects to an MQTT broker and subscribes to a given
- * token. Any messages that are receioved may be either simple JSON
+ * The plugin connects to an MQTT broker and subscribes to one or more
+ * topics, each of which may have its own asset name, object policy and
+ * script. Any messages that are receioved may be either simple JSON
  * douments, a single value or a generic string message. This later
  * type will be passed to a Python script that is defined by the user.
  * This Python script must convert the message to a Python DICT that
@@ -44,33 +96,99 @@ class MQTTScripted {
 		void		reconfigure(const ConfigCategory& config);
 		bool		start();
 		void		stop();
-		void		registerIngest(void *data, void (*cb)(void *, Reading))
+		void		registerIngest(void *data, INGEST_CB cb)
 				{
 					m_ingest = cb;
+					m_ingestMany = NULL;
 					m_data = data;
 				}
-		void		processMessage(const std::string& topic, const std::string& payload);
-		bool		reconnect();
+		void		registerIngest(void *data, INGEST_CB2 cb)
+				{
+					m_ingestMany = cb;
+					m_ingest = NULL;
+					m_data = data;
+				}
+		bool		acceptMessage(const ClientContext *context, const char *topicName, int topicLen,
+						const MQTTAsync_message *message);
+		bool		queueMessage(char *topicName, int topicLen, MQTTAsync_message *message);
+		bool		activeClient(const ClientContext *context) const
+				{
+					return context->index == m_activeClient.load(std::memory_order_acquire);
+				};
+		void		processMessage(const MQTTPayload& payload, unsigned int worker = 0);
+		void		processMessages(const std::vector<MQTTPayload>& payloads, unsigned int worker);
+		void		processQueue(unsigned int worker);
 		std::string	getName() { return m_name; };
 		void		sslError(const char *str, int len) {
 					m_logger->error("SSL Error: %s", str);
 				};
-		void		reconnection() {
-					std::lock_guard<std::mutex> guard(m_mutex);
-					backgroundReconnect();
-				}
+		void		reconnection(const ClientContext *context);
 		void		reconnectRetry();
+		void		scriptLoader();
+		void		connected(bool sessionPresent);
+		void		connectFailed(int code, const char *message);
+		void		disconnected();
+		void		subscribed(MQTTAsync_successData *response);
+		void		subscribeFailed(int code);
+		bool		capture(const std::string& action);
 	private:
-		void			(*m_ingest)(void *, Reading);
+		INGEST_CB		m_ingest;
+		INGEST_CB2		m_ingestMany;
 		std::string		privateKeyPath();
 		std::string		serverCertPath();
 		std::string		clientCertPath();
 		std::string		pemPath();
-		void			processDocument(rapidjson::Document& doc, const std::string &asset);
-		void			getValues(const rapidjson::Value& object, std::vector<Datapoint *>& points, bool recurse, std::string& user_ts);
-		void			processPolicy(const std::string& policy);
-		void			convertTimestamp(std::string& ts);
+		size_t			processDocument(rapidjson::Document& doc, const ObjectPolicy& policy,
+						const std::string &asset, const std::string& topic);
+		void			processMessage(const MQTTPayload& payload, const Subscription& subscription,
+						size_t index, unsigned int worker);
+		void			processMessages(const std::vector<MQTTPayload>& payloads, size_t start, size_t end,
+						const Subscriptions& subscriptions, size_t index, unsigned int worker);
+		bool			reconnect(std::unique_lock<std::mutex>& lck);
+		bool			createClient();
+		void			destroyClient(std::unique_lock<std::mutex>& lck);
+		void			disconnectClient(std::unique_lock<std::mutex>& lck, MQTTAsync client);
+		void			retireClient(std::unique_lock<std::mutex>& lck);
+		bool			replaceClient();
+		void			setReconfigureMode(const ConfigCategory& config);
+		bool			subscribe();
+		void			setMaxInflight(const ConfigCategory& config);
+		void			setSharedGroup(const ConfigCategory& config);
+		void			setPersistence(const ConfigCategory& config);
+		void			setFlowControl(const ConfigCategory& config);
+		void			flowUpdate();
+		void			flowTransition(FlowControl::Transition transition);
+		void			block();
+		void			pause(std::unique_lock<std::mutex>& lck);
+		std::string		stateDirectory();
+		bool			sameSessionTopics();
+		void			saveSessionTopics();
+		std::string		clientID() const;
+		std::string		primaryScript() const;
 		void			backgroundReconnect();
+		void			reportQueueStatistics(bool force);
+		void			reportPoolStatistics(bool force);
+		void			reportStageTimers(bool ingestReading);
+		void			setStageTimers(const ConfigCategory& config);
+		void			setCapture(const ConfigCategory& config);
+		void			dumpCapture();
+		void			ingest(Reading *reading);
+		void			flushBatch();
+		long			batchTimeout();
+		void			setBatching(const ConfigCategory& config);
+		void			setPayloadType(const ConfigCategory& config);
+		void			setJsonParser(const ConfigCategory& config);
+		void			setValidation(const ConfigCategory& config);
+		bool			prepareScripts(const std::string& script, PythonScript::PayloadType payloadType,
+						std::vector<PythonScript *>& scripts);
+		bool			validateScript(PythonScript *python, const std::string& script,
+						const Subscriptions& subscriptions, unsigned int count);
+		PythonScript		*workerScript(unsigned int worker);
+		bool			batchConvert(unsigned int worker);
+		PythonScript		*workerScript(unsigned int worker, size_t index,
+						const Subscription& subscription);
+		void			prepareSubscriptionScripts(const Subscriptions& subscriptions,
+						PythonScript::PayloadType payloadType, unsigned int count);
 
 	private:
 		std::string		m_asset;
@@ -80,13 +198,57 @@ class MQTTScripted {
 		std::string		m_content;
 		int			m_qos;
 		std::string		m_clientID;
+		std::string		m_sharedGroup;
 		Logger			*m_logger;
 		std::mutex		m_mutex;
-		MQTTClient		m_client;
+		MQTTAsync		m_client;
+		// A client that is still receiving messages whilst the client
+		// that replaces it connects and subscribes
+		MQTTAsync		m_retiring;
+		std::string		m_retiringID;
+		ClientContext		m_contexts[2];
+		int			m_clientContext;
+		std::atomic<int>	m_activeClient;
+		// Set whilst both the retiring client and its replacement
+		// may receive messages
+		std::atomic<bool>	m_overlap;
+		DuplicateFilter		m_duplicates;
+		bool			m_clientPersistent;
+		bool			m_clientShared;
+		bool			m_makeBeforeBreak;
 		void			*m_data;
-		PythonScript		*m_python;
+		std::vector<PythonScript *>
+					m_pythons;
+		// Scripts loaded and validated by the script loader thread,
+		// waiting to replace the script of each worker
+		std::vector<PythonScript *>
+					m_candidates;
+		std::vector<PythonScript *>
+					m_replacedScripts;
+		std::thread		*m_loaderThread;
+		std::condition_variable	m_loaderCond;
+		bool			m_loaderStopping;
+		unsigned long		m_preparedGeneration;
+		unsigned int		m_validationMessages;
+		std::vector<ScriptCache>
+					m_subscriptionScripts;
+		// Subscription scripts loaded and validated by the script
+		// loader thread, waiting to be used by each worker
+		std::vector<ScriptCache>
+					m_subscriptionCandidates;
+		// Only used by the script loader thread
+		ScriptSources		m_scriptSources;
+		std::shared_ptr<Subscriptions>
+					m_preparedSubscriptions;
+		std::shared_ptr<Subscriptions>
+					m_subscriptions;
+		std::vector<OnDemandParser *>
+					m_jsonParsers;
+		bool			m_onDemand;
 		std::string		m_name;
-		bool			m_restart;
+		unsigned long		m_scriptGeneration;
+		PythonScript::PayloadType
+					m_payloadType;
 		std::string		m_key;
 		std::string		m_serverCert;
 		std::string		m_clientCert;
@@ -98,15 +260,49 @@ class MQTTScripted {
 		std::string		m_password;
 		enum { mFailed, mCreated, mConnected }
 					m_state;
+		// The connection mutex protects the MQTT client, the connection
+		// settings and state. It is never held whilst waiting for the
+		// broker and is acquired after m_mutex if both are required.
+		std::mutex		m_connectionMutex;
+		std::condition_variable	m_connectionCond;
+		bool			m_connectPending;
+		bool			m_disconnectPending;
+		int			m_connectError;
+		std::string		m_connectMessage;
+		bool			m_connectionLost;
+		bool			m_restart;
+		bool			m_stopping;
+		bool			m_paused;
+		int			m_maxInflight;
+		bool			m_persistent;
+		std::string		m_persistenceDir;
+		std::vector<std::string>
+					m_topics;
+		std::vector<std::string>
+					m_subscribedTopics;
+		std::atomic<bool>	m_replaying;
+		std::atomic<unsigned long>
+					m_replayed;
+		FlowControl		m_flow;
 		std::string		m_pemPath;
-		enum { mPolicyFirstLevel, mPolicyCollapse, mPolicyMultiple }
+		std::shared_ptr<ObjectPolicy>
 					m_policy;
-		bool			m_nest;
-		std::string		m_timestamp;
-		std::string		m_timeFormat;
-		long			m_offset;
+		PlanCache		m_planCache;
+		DatapointPool		m_documentPool;
 		std::thread		*m_reconnectThread;
 		bool			m_reap;
 		time_t			m_connectFailTime;
+		IngressQueue		*m_queue;
+		std::vector<std::thread *>
+					m_processThreads;
+		time_t			m_statsTime;
+		size_t			m_reportedHighWater;
+		long			m_spillSize;
+		bool			m_latencyReading;
+		CaptureRing		m_capture;
+		std::vector<Reading *>	m_batch;
+		size_t			m_batchSize;
+		long			m_batchLatency;
+		struct timeval		m_batchStart;
 };
 #endif
@@ -0,0 +1,38 @@
+#ifndef _SHARED_SUBSCRIPTION_H
+#define _SHARED_SUBSCRIPTION_H
+/*
+ * FogLAMP south service plugin
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <string>
+#include <vector>
+
+#define SHARED_PREFIX	"$share/"
+
+/**
+ * Support for MQTT shared subscriptions. Clients that subscribe to a
+ * topic as members of the same share group have the messages published
+ * on the topic divided between them by the broker, rather than each
+ * client receiving every message. This allows several south services to
+ * share the load of a high rate topic.
+ *
+ * Every member of a group must connect with a different client ID, as
+ * a broker disconnects an existing client when another connects with
+ * the same ID.
+ */
+class SharedSubscription {
+	public:
+		static bool		validGroup(const std::string& group);
+		static std::string	topic(const std::string& group, const std::string& filter);
+		static std::vector<std::string>
+					topics(const std::string& group, const std::vector<std::string>& filters);
+		static std::string	clientID(const std::string& name);
+		static std::string	clientID(const std::string& name, const std::string& group,
+						const std::string& sessionDir);
+};
+#endif
@@ -0,0 +1,39 @@
+#ifndef _SIMPLE_VALUE_H
+#define _SIMPLE_VALUE_H
+/*
+ * FogLAMP south service plugin
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <datapoint.h>
+#include <string>
+#include <vector>
+
+/**
+ * Parser for payloads that contain one or more simple values rather
+ * than a JSON document.
+ *
+ * A payload may contain a single value or a list of values separated
+ * by commas or whitespace. Leading and trailing whitespace is ignored.
+ * Values may be numbers, including scientific notation, nan and inf,
+ * or the booleans true and false. Numbers are returned as floating
+ * point datapoints and booleans as the integers 1 and 0.
+ *
+ * A single value is returned as a datapoint with the given name, a list
+ * of values as datapoints with the name suffixed by _0, _1 etc.
+ */
+class SimpleValue {
+	public:
+		static bool	parse(const char *data, size_t length, const std::string& name,
+					std::vector<Datapoint *>& points);
+		static bool	isNumeric(const char *data, size_t length);
+		static bool	parseNumber(const char *start, const char *end, double& value);
+		static bool	isObject(const char *data, size_t length);
+	private:
+		static bool	parseKeyword(const char *start, const char *end, double& value, bool& boolean);
+};
+#endif
@@ -0,0 +1,85 @@
+#ifndef _SPILL_BUFFER_H
+#define _SPILL_BUFFER_H
+/*
+ * FogLAMP south service plugin
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <sys/time.h>
+#include <stdint.h>
+#include <string>
+
+#define SPILL_MAGIC		0x4d515353	// Identifies a spill file
+#define SPILL_RECORD		0x52454331	// Identifies a message record
+#define SPILL_WRAP		0x57524150	// Marks the unused end of the data area
+#define SPILL_VERSION		1
+#define SPILL_HEADER_SIZE	4096		// The header occupies the first page of the file
+
+/**
+ * A ring of messages held in a memory mapped file. The topic and payload
+ * of each message are copied into the file, allowing a burst of messages
+ * far larger than can be held in memory to be absorbed. As the file is
+ * mapped shared, the messages that have not been read survive a crash of
+ * the service and are recovered when the file is next opened.
+ *
+ * The file consists of a header page, holding the size of the data area
+ * and the offsets of the oldest and next records, followed by the data
+ * area. The offsets increase monotonically and are taken modulo the size
+ * of the data area. A record is written in full before the offset of the
+ * next record is advanced past it, so a record is never partially
+ * visible after a crash.
+ *
+ * The offset of the oldest record is advanced as soon as a record is
+ * read, before the message has been converted and ingested. Messages
+ * are delivered at most once, a message that has been read but not yet
+ * ingested when the service crashes is lost.
+ *
+ * The buffer is not thread safe, the caller must serialise access.
+ */
+class SpillBuffer {
+	public:
+				SpillBuffer();
+				~SpillBuffer();
+		bool		open(const std::string& path, size_t size);
+		void		close();
+		bool		isOpen() const { return m_header != NULL; };
+		bool		empty() const { return !m_header || m_header->head == m_header->tail; };
+		size_t		used() const { return m_header ? m_header->tail - m_header->head : 0; };
+		size_t		capacity() const { return m_size; };
+		unsigned long	entries() const { return m_entries; };
+		bool		fits(size_t topicLength, size_t payloadLength) const;
+		bool		append(const char *topic, size_t topicLength,
+						const void *payload, size_t payloadLength,
+						const struct timeval& received);
+		bool		read(char **buffer, size_t& topicLength, size_t& payloadLength,
+						struct timeval& received);
+	private:
+		typedef struct {
+			uint32_t	magic;
+			uint32_t	version;
+			uint64_t	size;
+			uint64_t	head;
+			uint64_t	tail;
+		} Header;
+		typedef struct {
+			uint32_t	magic;
+			uint32_t	topicLength;
+			uint32_t	payloadLength;
+			uint32_t	reserved;
+			int64_t		seconds;
+			int64_t		microseconds;
+		} Record;
+		static size_t	recordSize(size_t topicLength, size_t payloadLength);
+		bool		recover();
+		Header		*m_header;
+		char		*m_data;
+		size_t		m_size;
+		size_t		m_mapSize;
+		int		m_fd;
+		unsigned long	m_entries;
+};
+#endif
@@ -0,0 +1,157 @@
+#ifndef _STAGE_TIMER_H
+#define _STAGE_TIMER_H
+/*
+ * FogLAMP south service plugin
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+
+#define HISTOGRAM_SUB_BITS	3	// Each power of two is divided into 2^3 buckets, 12.5% resolution
+
+/**
+ * A histogram of latencies in nanoseconds with buckets spaced in the
+ * manner of an HDR histogram. Values below 2^HISTOGRAM_SUB_BITS have a
+ * bucket each, above that every power of two is divided into the same
+ * number of linear buckets, so the relative error of any reported value
+ * is bounded regardless of its magnitude.
+ *
+ * Recording a value is a single relaxed atomic increment, any number of
+ * threads may record concurrently and the histogram may be collected
+ * whilst values are being recorded.
+ */
+class LatencyHistogram {
+	public:
+		static const int	SUB_BUCKETS = 1 << HISTOGRAM_SUB_BITS;
+		static const int	BUCKETS = (64 - HISTOGRAM_SUB_BITS + 1) * SUB_BUCKETS;
+		typedef struct {
+			uint64_t	count;
+			uint64_t	p50;
+			uint64_t	p99;
+			uint64_t	p999;
+			uint64_t	max;
+		} Summary;
+				LatencyHistogram();
+		void		record(uint64_t value)
+				{
+					m_buckets[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+					uint64_t max = m_max.load(std::memory_order_relaxed);
+					while (value > max && !m_max.compare_exchange_weak(max, value,
+								std::memory_order_relaxed))
+						;
+				};
+		void		collect(Summary& summary, bool reset);
+		static int	bucket(uint64_t value)
+				{
+					if (value < (uint64_t)SUB_BUCKETS)
+						return (int)value;
+					int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+					return (shift + 1) * SUB_BUCKETS
+						+ (int)((value >> shift) & (SUB_BUCKETS - 1));
+				};
+		static uint64_t	upperBound(int bucket);
+	private:
+		std::atomic<uint64_t>	m_buckets[BUCKETS];
+		std::atomic<uint64_t>	m_max;
+};
+
+/**
+ * The latency histograms of the stages of the processing of a message.
+ * The stages may nest, the time spent converting timestamps is also
+ * included in the stage that converts the payload.
+ *
+ * The time of each stage may also be accumulated for the message being
+ * processed by the calling thread, by passing an array of STAGES values
+ * to capture.
+ *
+ * The histograms are shared by all the threads of the process. Timing is
+ * enabled at runtime with setEnabled, and may be removed from the build
+ * entirely by building without STAGE_TIMERS, in which case the timers
+ * compile to nothing.
+ */
+class StageTimers {
+	public:
+		enum Stage { Queue, Parse, Script, Timestamp, Document, Ingest, STAGES };
+		static bool	compiled();
+		static bool	enabled()
+				{
+					return m_enabled.load(std::memory_order_relaxed);
+				};
+		static void	setEnabled(bool enabled);
+		static void	record(Stage stage, uint64_t nanoseconds)
+				{
+#ifdef STAGE_TIMERS
+					if (enabled())
+					{
+						m_histograms[stage].record(nanoseconds);
+						if (m_capture)
+							m_capture[stage] += nanoseconds;
+					}
+#endif
+				};
+		static void	capture(uint64_t *stages)
+				{
+					m_capture = stages;
+				};
+		static void	collect(Stage stage, LatencyHistogram::Summary& summary, bool reset)
+				{
+					m_histograms[stage].collect(summary, reset);
+				};
+		static const char
+				*name(Stage stage);
+		static uint64_t	now()
+				{
+					struct timespec ts;
+					clock_gettime(CLOCK_MONOTONIC, &ts);
+					return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+				};
+	private:
+		static std::atomic<bool>
+				m_enabled;
+		static LatencyHistogram
+				m_histograms[STAGES];
+		static thread_local uint64_t
+				*m_capture;
+};
+
+#ifdef STAGE_TIMERS
+/**
+ * Time a stage from the creation of the timer until it is destroyed,
+ * or stop is called. Nothing is recorded if timing is not enabled.
+ */
+class StageTimer {
+	public:
+		StageTimer(StageTimers::Stage stage) : m_stage(stage),
+				m_start(StageTimers::enabled() ? StageTimers::now() : 0)
+		{
+		};
+		~StageTimer()
+		{
+			stop();
+		};
+		void	stop()
+		{
+			if (m_start)
+			{
+				StageTimers::record(m_stage, StageTimers::now() - m_start);
+				m_start = 0;
+			}
+		};
+	private:
+		StageTimers::Stage	m_stage;
+		uint64_t		m_start;
+};
+#else
+class StageTimer {
+	public:
+		StageTimer(StageTimers::Stage) {};
+		void	stop() {};
+};
+#endif
+#endif
@@ -0,0 +1,103 @@
+#ifndef _SUBSCRIPTION_H
+#define _SUBSCRIPTION_H
+/*
+ * FogLAMP south service plugin
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <config_category.h>
+#include <object_policy.h>
+#include <topic_matcher.h>
+#include <topic_template.h>
+#include <logger.h>
+#include <string>
+#include <vector>
+#include <memory>
+
+/**
+ * A topic filter the plugin subscribes to, together with the asset name,
+ * object policy and optional script used for the messages received on it.
+ *
+ * The asset name, and the datapoint name used for simple values, may be
+ * templates that are expanded using the topic of each message. Expansion
+ * is not thread safe and must be done holding the plugin mutex.
+ */
+class Subscription {
+	public:
+				Subscription(const std::string& topic, const std::string& asset,
+						const std::string& datapoint,
+						std::shared_ptr<ObjectPolicy> policy,
+						const std::string& script) :
+					m_topic(topic), m_asset(asset),
+					m_datapoint(datapoint.empty() ? topic : datapoint, !datapoint.empty()),
+					m_policy(policy), m_script(script)
+				{
+				};
+		const std::string&
+				getTopic() const { return m_topic; };
+		const std::string&
+				getAsset(const char *topic, size_t length, std::string& buffer) const
+				{
+					return m_asset.expand(topic, length, buffer);
+				};
+		const std::string&
+				getDatapoint(const char *topic, size_t length, std::string& buffer) const
+				{
+					return m_datapoint.expand(topic, length, buffer);
+				};
+		bool		assetPerTopic() const { return !m_asset.isConstant(); };
+		std::shared_ptr<ObjectPolicy>
+				getPolicy() const { return m_policy; };
+		const std::string&
+				getScript() const { return m_script; };
+		bool		hasScript() const { return !m_script.empty(); };
+	private:
+		std::string	m_topic;
+		TopicTemplate	m_asset;
+		TopicTemplate	m_datapoint;
+		std::shared_ptr<ObjectPolicy>
+				m_policy;
+		std::string	m_script;
+};
+
+/**
+ * The set of subscriptions of the plugin. The first subscription is
+ * always the primary subscription defined by the topic, asset, policy
+ * and script configuration items, any others are taken from the
+ * subscriptions configuration item.
+ *
+ * The set is immutable once created, a reconfiguration creates a new
+ * set. This allows it to be shared with the worker threads without
+ * holding the plugin mutex.
+ */
+class Subscriptions {
+	public:
+		static const size_t	PRIMARY = 0;
+				Subscriptions(const ConfigCategory& config,
+						std::shared_ptr<ObjectPolicy> policy,
+						const std::string& script);
+		size_t		size() const { return m_subscriptions.size(); };
+		const Subscription&
+				operator[](size_t index) const
+				{
+					return m_subscriptions[index];
+				};
+		size_t		match(const char *topic, size_t length) const;
+		bool		sameTopics(const Subscriptions& other) const;
+		void		getTopics(std::vector<std::string>& topics) const;
+	private:
+				Subscriptions(const Subscriptions&);
+		Subscriptions&	operator=(const Subscriptions&);
+		void		addSubscriptions(const ConfigCategory& config,
+						std::shared_ptr<ObjectPolicy> policy,
+						const std::string& datapoint);
+		std::vector<Subscription>
+				m_subscriptions;
+		TopicMatcher	m_matcher;
+		Logger		*m_logger;
+};
+#endif
@@ -0,0 +1,55 @@
+#ifndef _TIMESTAMP_PARSER_H
+#define _TIMESTAMP_PARSER_H
+/*
+ * FogLAMP south service plugin
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <sys/time.h>
+#include <stdint.h>
+#include <string>
+
+/**
+ * A user timestamp extracted from a payload
+ */
+struct UserTimestamp {
+	UserTimestamp() : set(false) { tv.tv_sec = 0; tv.tv_usec = 0; };
+	bool		set;
+	struct timeval	tv;
+};
+
+/**
+ * A parser for the timestamps found in payloads. The configured time
+ * format is compiled once into a parse plan when the parser is created,
+ * rather than being interpreted for every timestamp.
+ *
+ * ISO-8601/RFC-3339 formats are handled by a hand written parser that
+ * also honours any zone designator in the timestamp. Other formats are
+ * parsed with strptime. Numeric timestamps are treated as the time since
+ * the epoch, the format may be set to "epoch", "epoch_ms" or "epoch_us"
+ * to define the units, otherwise the units are inferred from the
+ * magnitude of the value.
+ *
+ * All timestamps are converted directly to a UTC timeval, timestamps
+ * without a zone designator are assumed to be in the configured timezone.
+ */
+class TimestampParser {
+	public:
+				TimestampParser(const std::string& format, long offset);
+		bool		parse(const char *ts, struct timeval& tv) const;
+		bool		fromInteger(int64_t value, struct timeval& tv) const;
+		bool		fromDouble(double value, struct timeval& tv) const;
+	private:
+		enum Plan { Auto, ISO8601, EpochSeconds, EpochMillis, EpochMicros, Strptime };
+		bool		parseISO(const char *ts, struct timeval& tv) const;
+		bool		parseStrptime(const char *ts, struct timeval& tv) const;
+		bool		parseNumeric(const char *ts, struct timeval& tv) const;
+		Plan		m_plan;
+		std::string	m_format;
+		long		m_offset;
+};
+#endif
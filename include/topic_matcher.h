@@ -0,0 +1,44 @@
+#ifndef _TOPIC_MATCHER_H
+#define _TOPIC_MATCHER_H
+/*
+ * FogLAMP south service plugin
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <string>
+
+/**
+ * Match MQTT topic names against a set of topic filters that may contain
+ * the + and # wildcards.
+ *
+ * The filters are compiled into a tree with a node per topic level, so
+ * a topic name is matched against all of the filters in a single walk
+ * of its levels. When a topic matches more than one filter the filter
+ * that was added first is returned.
+ *
+ * As required by the MQTT specification, topics that start with $ are
+ * not matched by filters that start with a wildcard.
+ */
+class TopicMatcher {
+	public:
+				TopicMatcher();
+				~TopicMatcher();
+		bool		add(const std::string& filter, int index);
+		int		match(const char *topic, size_t length) const;
+		int		match(const std::string& topic) const
+				{
+					return match(topic.c_str(), topic.length());
+				};
+		static bool	valid(const std::string& filter);
+	private:
+		class Node;
+				TopicMatcher(const TopicMatcher&);
+		TopicMatcher&	operator=(const TopicMatcher&);
+		int		match(const Node *node, const char *level, const char *end, bool firstLevel) const;
+		Node		*m_root;
+};
+#endif
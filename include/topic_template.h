@@ -0,0 +1,70 @@
+#ifndef _TOPIC_TEMPLATE_H
+#define _TOPIC_TEMPLATE_H
+/*
+ * FogLAMP south service plugin
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#define MAX_TEMPLATE_TOPICS	1000	// Maximum number of topics for which the expansion is cached
+
+/**
+ * A name, such as an asset name, that may be derived from the topic a
+ * message was received on. The template may contain references to the
+ * topic that are substituted when the template is expanded.
+ *
+ *   {topic}	The complete topic name
+ *   {topic[n]}	Level n of the topic, counting from 0. Negative values
+ *		count from the last level, {topic[-1]} is the last level
+ *   {{ and }}	Literal braces
+ *
+ * The template is compiled once when it is created. The expansions are
+ * cached per topic, up to MAX_TEMPLATE_TOPICS topics, so that the name
+ * for a topic that has been seen before is returned without allocation.
+ * Cached expansions are never removed, references to them remain valid
+ * for the lifetime of the template.
+ *
+ * The cache is not thread safe, expand must not be called concurrently.
+ */
+class TopicTemplate {
+	public:
+				TopicTemplate(const std::string& text, bool compile = true);
+		bool		isConstant() const { return m_constant; };
+		const std::string&
+				getText() const { return m_text; };
+		const std::string&
+				expand(const char *topic, size_t length, std::string& buffer) const;
+		const std::string&
+				expand(const std::string& topic, std::string& buffer) const
+				{
+					return expand(topic.c_str(), topic.length(), buffer);
+				};
+	private:
+		enum PartType { Literal, Topic, Level };
+		class Part {
+			public:
+				Part(PartType type, const std::string& text, int level) :
+					type(type), text(text), level(level) {};
+				PartType	type;
+				std::string	text;
+				int		level;
+		};
+		bool		compile();
+		void		substitute(const char *topic, size_t length, std::string& result) const;
+		std::string	m_text;
+		bool		m_constant;
+		std::vector<Part>
+				m_parts;
+		mutable std::unordered_map<std::string, std::string>
+				m_cache;
+		mutable std::string
+				m_key;
+};
+#endif
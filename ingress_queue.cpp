@@ -0,0 +1,305 @@
+/*
+ * FogLAMP "MQTTScripted" ingress queue.
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <ingress_queue.h>
+#include <stage_timer.h>
+#include <string.h>
+#include <chrono>
+
+using namespace std;
+
+/**
+ * Construct an ingress queue
+ *
+ * @param depth	The maximum number of messages that may be queued
+ */
+IngressQueue::IngressQueue(size_t depth) : m_spilled(0), m_head(0), m_count(0), m_highWater(0),
+	m_queued(0), m_maxWait(0), m_shutdown(false)
+{
+	m_ring.resize(depth > 0 ? depth : 1);
+}
+
+/**
+ * Destructor for the ingress queue. Any messages that remain in the
+ * queue are returned to the MQTT client library.
+ */
+IngressQueue::~IngressQueue()
+{
+	while (m_count > 0)
+	{
+		QueueEntry& entry = m_ring[m_head];
+		MQTTAsync_freeMessage(&entry.message);
+		MQTTAsync_free(entry.topicName);
+		m_head = (m_head + 1) % m_ring.size();
+		m_count--;
+	}
+}
+
+/**
+ * Extend the queue with a spill buffer held in a file. Any messages left
+ * in the file by a previous instance of the queue are recovered and will
+ * be returned before any new messages.
+ *
+ * @param path		The path of the spill file
+ * @param size		The size of the spill buffer in bytes
+ * @return bool		False if the spill file could not be opened
+ */
+bool IngressQueue::spill(const string& path, size_t size)
+{
+	lock_guard<mutex> guard(m_mutex);
+	bool opened = m_spill.open(path, size);
+	m_notEmpty.notify_all();
+	return opened;
+}
+
+/**
+ * Append a message to the queue. If the queue is full the message is
+ * written to the spill buffer, if there is one, otherwise the caller will
+ * be blocked until space becomes available. A message that is too large
+ * for the spill buffer blocks the caller until the spill buffer has been
+ * emptied. The message is timestamped with the time it was received.
+ *
+ * @param topicName	The topic the message was received on
+ * @param topicLen	The topic length as reported by the MQTT client library
+ * @param message	The MQTT message
+ * @return bool		False if the queue has been shutdown and the message was not queued
+ */
+bool IngressQueue::push(char *topicName, int topicLen, MQTTAsync_message *message)
+{
+	struct timeval received;
+	gettimeofday(&received, NULL);
+
+	unique_lock<mutex> lck(m_mutex);
+	size_t topicLength = topicLen > 0 ? topicLen : strlen(topicName);
+	bool spill = m_spill.isOpen() && m_spill.fits(topicLength, message->payloadlen);
+	while (!m_shutdown)
+	{
+		if (spill && (m_count == m_ring.size() || !m_spill.empty()))
+		{
+			if (m_spill.append(topicName, topicLength, message->payload, message->payloadlen, received))
+			{
+				m_spilled++;
+				m_queued++;
+				lck.unlock();
+				MQTTAsync_freeMessage(&message);
+				MQTTAsync_free(topicName);
+				m_notEmpty.notify_one();
+				return true;
+			}
+		}
+		else if (m_count < m_ring.size() && m_spill.empty())
+		{
+			// A message too large to spill waits for the spilled
+			// messages to be read, so it is not taken before them
+			break;
+		}
+		m_notFull.wait(lck);
+	}
+	if (m_shutdown)
+	{
+		return false;
+	}
+	QueueEntry& entry = m_ring[(m_head + m_count) % m_ring.size()];
+	entry.topicName = topicName;
+	entry.topicLen = topicLen;
+	entry.message = message;
+	entry.payloadLen = message->payloadlen;
+	entry.received = received;
+	m_count++;
+	m_queued++;
+	if (m_count > m_highWater)
+	{
+		m_highWater = m_count;
+	}
+	lck.unlock();
+	m_notEmpty.notify_one();
+	return true;
+}
+
+/**
+ * Remove the oldest message from the queue, blocking until a message
+ * is available or the timeout expires. Once the queue has been shutdown
+ * any remaining messages in the ring will still be returned, allowing
+ * the queue to be drained. The messages in the spill buffer are not
+ * returned, they remain in the file until the queue is restarted or
+ * they are recovered by the next instance of the queue.
+ *
+ * @param entry		The entry to populate with the message
+ * @param timeout	The maximum time to wait in milliseconds, -1 waits indefinitely
+ * @return bool		False if the timeout expired or the queue is shutdown and empty
+ */
+bool IngressQueue::pop(QueueEntry& entry, long timeout)
+{
+	unique_lock<mutex> lck(m_mutex);
+	if (timeout < 0)
+	{
+		while (m_count == 0 && m_spill.empty() && !m_shutdown)
+		{
+			m_notEmpty.wait(lck);
+		}
+	}
+	else
+	{
+		auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeout);
+		while (m_count == 0 && m_spill.empty() && !m_shutdown)
+		{
+			if (m_notEmpty.wait_until(lck, deadline) == cv_status::timeout)
+			{
+				break;
+			}
+		}
+	}
+	if (m_count > 0)
+	{
+		// Messages in the ring are always older than those spilled
+		entry = m_ring[m_head];
+		m_head = (m_head + 1) % m_ring.size();
+		m_count--;
+	}
+	else if (m_shutdown)
+	{
+		// Spilled messages are left to be recovered on restart
+		return false;
+	}
+	else
+	{
+		size_t topicLength;
+		if (!m_spill.read(&entry.topicName, topicLength, entry.payloadLen, entry.received))
+		{
+			return false;
+		}
+		entry.topicLen = topicLength;
+		entry.message = NULL;
+	}
+
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	unsigned long wait = (now.tv_sec - entry.received.tv_sec) * 1000000
+				+ (now.tv_usec - entry.received.tv_usec);
+	if (wait > m_maxWait)
+	{
+		m_maxWait = wait;
+	}
+	StageTimers::record(StageTimers::Queue, (uint64_t)wait * 1000);
+	lck.unlock();
+	m_notFull.notify_one();
+	return true;
+}
+
+/**
+ * Check if the queue has been shutdown and all the messages
+ * have been removed from the ring. Messages may remain in the
+ * spill buffer.
+ *
+ * @return bool	True if the queue is shutdown and the ring is empty
+ */
+bool IngressQueue::drained()
+{
+	lock_guard<mutex> guard(m_mutex);
+	return m_shutdown && m_count == 0;
+}
+
+/**
+ * Return the occupancy of the queue. If there is a spill buffer the
+ * queue is only full once the spill buffer is full, so the occupancy of
+ * the spill buffer, in bytes, is returned.
+ *
+ * @param count	Set to the number of messages, or bytes, queued
+ * @param depth	Set to the depth of the queue, or size of the spill buffer
+ */
+void IngressQueue::occupancy(size_t& count, size_t& depth)
+{
+	lock_guard<mutex> guard(m_mutex);
+	if (m_spill.isOpen())
+	{
+		// The messages in the ring are negligible against the size of
+		// the spill buffer, but keep the count non-zero whilst queued
+		count = m_spill.used() + m_count;
+		depth = m_spill.capacity();
+	}
+	else
+	{
+		count = m_count;
+		depth = m_ring.size();
+	}
+}
+
+/**
+ * Change the depth of the queue. Messages already queued are retained,
+ * if there are more queued messages than the new depth then the
+ * queue will not shrink below the number of queued messages.
+ *
+ * @param depth	The new queue depth
+ */
+void IngressQueue::resize(size_t depth)
+{
+	lock_guard<mutex> guard(m_mutex);
+	if (depth < m_count)
+	{
+		depth = m_count;
+	}
+	if (depth == 0)
+	{
+		depth = 1;
+	}
+	if (depth == m_ring.size())
+	{
+		return;
+	}
+	vector<QueueEntry> ring(depth);
+	for (size_t i = 0; i < m_count; i++)
+	{
+		ring[i] = m_ring[(m_head + i) % m_ring.size()];
+	}
+	m_ring.swap(ring);
+	m_head = 0;
+	m_notFull.notify_all();
+}
+
+/**
+ * Shutdown the queue. Any blocked producers are released and consumers
+ * will be returned false once the ring has been drained. Messages in the
+ * spill buffer are kept in the file, so that a shutdown does not wait for
+ * a large backlog to be processed.
+ */
+void IngressQueue::shutdown()
+{
+	lock_guard<mutex> guard(m_mutex);
+	m_shutdown = true;
+	m_notEmpty.notify_all();
+	m_notFull.notify_all();
+}
+
+/**
+ * Allow a queue that has been shutdown to be used again
+ */
+void IngressQueue::restart()
+{
+	lock_guard<mutex> guard(m_mutex);
+	m_shutdown = false;
+}
+
+/**
+ * Return the statistics for the queue
+ *
+ * @param stats	The statistics structure to populate
+ */
+void IngressQueue::getStatistics(QueueStatistics& stats)
+{
+	lock_guard<mutex> guard(m_mutex);
+	stats.depth = m_ring.size();
+	stats.current = m_count;
+	stats.highWater = m_highWater;
+	stats.queued = m_queued;
+	stats.maxWait = m_maxWait;
+	stats.spilled = m_spilled;
+	stats.spillEntries = m_spill.entries();
+	stats.spillUsed = m_spill.used();
+	stats.spillSize = m_spill.capacity();
+}
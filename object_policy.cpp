@@ -0,0 +1,139 @@
+/*
+ * FogLAMP "MQTTScripted" object policy.
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <object_policy.h>
+#include <stage_timer.h>
+#include <stdlib.h>
+
+using namespace std;
+
+/**
+ * Construct an object policy
+ *
+ * @param policy	The object policy configuration value
+ * @param timestamp	The name of the property that holds the timestamp
+ * @param format	The format of timestamps in the payload
+ * @param timezone	The timezone of the timestamps as an offset from UTC, e.g. -08:00
+ */
+ObjectPolicy::ObjectPolicy(const string& policy, const string& timestamp,
+		const string& format, const string& timezone) :
+	m_policy(FirstLevel), m_nest(false), m_timestamp(timestamp),
+	m_parser(format, parseTimezone(timezone))
+{
+	m_logger = Logger::getLogger();
+
+	if (policy.compare("Single reading from root level") == 0)
+	{
+		m_policy = FirstLevel;
+		m_nest = false;
+	}
+	else if (policy.compare("Single reading & collapse") == 0)
+	{
+		m_policy = Collapse;
+		m_nest = false;
+	}
+	else if (policy.compare("Single reading & nest") == 0)
+	{
+		m_policy = Collapse;
+		m_nest = true;
+	}
+	else if (policy.compare("Multiple readings & collapse") == 0)
+	{
+		m_policy = Multiple;
+		m_nest = false;
+	}
+	else if (policy.compare("Multiple readings & nest") == 0)
+	{
+		m_policy = Multiple;
+		m_nest = true;
+	}
+	else
+	{
+		m_logger->error("Unsupported value for policy configuration '%s'", policy.c_str());
+	}
+}
+
+/**
+ * Parse the timezone configuration into an offset from UTC
+ *
+ * @param timezone	The timezone as an offset from UTC, e.g. -08:00
+ * @return long		The offset from UTC in seconds
+ */
+long ObjectPolicy::parseTimezone(const string& timezone)
+{
+	long offset = strtol(timezone.c_str(), NULL, 10);
+	offset *= 60 * 60;
+	auto res = timezone.find_first_of(':');
+	if (res != string::npos)
+	{
+		string mins = timezone.substr(res + 1);
+		long num = strtol(mins.c_str(), NULL, 10);
+		num *= 60;
+		if (timezone.find_first_of('-') < res)
+			offset -= num;
+		else
+			offset += num;
+	}
+	return offset;
+}
+
+/**
+ * Convert a string timestamp from the payload
+ *
+ * @param ts		Timestamp to convert
+ * @param user_ts	The converted timestamp
+ * @return bool		True if the timestamp could be converted
+ */
+bool ObjectPolicy::convertTimestamp(const char *ts, UserTimestamp& user_ts) const
+{
+	StageTimer timer(StageTimers::Timestamp);
+	if (m_parser.parse(ts, user_ts.tv))
+	{
+		user_ts.set = true;
+		return true;
+	}
+	m_logger->debug("Unable to parse timestamp '%s'", ts);
+	return false;
+}
+
+/**
+ * Convert an integer timestamp from the payload
+ *
+ * @param ts		Timestamp to convert
+ * @param user_ts	The converted timestamp
+ * @return bool		True if the timestamp could be converted
+ */
+bool ObjectPolicy::convertTimestamp(int64_t ts, UserTimestamp& user_ts) const
+{
+	StageTimer timer(StageTimers::Timestamp);
+	if (m_parser.fromInteger(ts, user_ts.tv))
+	{
+		user_ts.set = true;
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Convert a floating point timestamp from the payload
+ *
+ * @param ts		Timestamp to convert
+ * @param user_ts	The converted timestamp
+ * @return bool		True if the timestamp could be converted
+ */
+bool ObjectPolicy::convertTimestamp(double ts, UserTimestamp& user_ts) const
+{
+	StageTimer timer(StageTimers::Timestamp);
+	if (m_parser.fromDouble(ts, user_ts.tv))
+	{
+		user_ts.set = true;
+		return true;
+	}
+	return false;
+}
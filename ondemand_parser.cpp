@@ -0,0 +1,405 @@
+/*
+ * FogLAMP "MQTTScripted" on demand JSON parser.
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <ondemand_parser.h>
+
+using namespace std;
+
+#ifdef HAVE_SIMDJSON
+#include <simdjson.h>
+#include <string.h>
+
+using namespace simdjson;
+
+/**
+ * The simdjson implementation of the on demand parser
+ */
+class OnDemandParser::Impl {
+	public:
+		bool		parse(const MQTTPayload& payload, const ObjectPolicy& policy,
+					const string& asset, vector<Reading *>& readings, DatapointPool& pool);
+	private:
+		bool		getValues(ondemand::object object, const ObjectPolicy& policy,
+					vector<Datapoint *>& points, bool recurse, UserTimestamp& user_ts);
+		bool		addValue(const string& name, ondemand::value value, const ObjectPolicy& policy,
+					vector<Datapoint *>& points, bool recurse, UserTimestamp& user_ts);
+		bool		convertTimestamp(ondemand::value value, const ObjectPolicy& policy,
+					UserTimestamp& user_ts);
+		ondemand::parser	m_parser;
+		vector<char>		m_buffer;
+};
+
+/**
+ * Parse the payload into readings. simdjson requires the input to be
+ * followed by SIMDJSON_PADDING readable bytes, the payload buffer from
+ * the MQTT client library gives no such guarantee so the payload is
+ * copied into a padded buffer that is reused between messages.
+ *
+ * @param payload	The MQTT message payload
+ * @param policy	The object policy
+ * @param asset		The asset name for the reading
+ * @param readings	The vector to which readings are appended
+ * @param pool		The pool of scratch vectors used to collect datapoints
+ * @return bool		False if the payload is not a valid JSON object
+ */
+bool OnDemandParser::Impl::parse(const MQTTPayload& payload, const ObjectPolicy& policy,
+		const string& asset, vector<Reading *>& readings, DatapointPool& pool)
+{
+	size_t length = payload.length();
+	if (m_buffer.size() < length + SIMDJSON_PADDING)
+	{
+		m_buffer.resize(length + SIMDJSON_PADDING);
+	}
+	memcpy(m_buffer.data(), payload.data(), length);
+
+	ondemand::document doc;
+	if (m_parser.iterate(m_buffer.data(), length, m_buffer.size()).get(doc))
+	{
+		return false;
+	}
+	ondemand::object root;
+	if (doc.get_object().get(root))
+	{
+		return false;
+	}
+
+	Scratch<Datapoint *> points(pool);
+	UserTimestamp user_ts;
+	bool ok = true;
+	if (policy.getPolicy() == ObjectPolicy::Multiple)
+	{
+		for (auto field : root)
+		{
+			string_view key;
+			ondemand::value value;
+			ondemand::json_type type;
+			if (field.unescaped_key().get(key) || field.value().get(value) || value.type().get(type))
+			{
+				ok = false;
+				break;
+			}
+			string name(key);
+			if (type == ondemand::json_type::object && !policy.isTimestamp(name.c_str()))
+			{
+				ondemand::object child;
+				Scratch<Datapoint *> children(pool);
+				UserTimestamp ts;
+				if (value.get_object().get(child) || !getValues(child, policy, *children, true, ts))
+				{
+					for (auto dp : *children)
+						delete dp;
+					ok = false;
+					break;
+				}
+				if (children->size() > 0)
+				{
+					Reading *reading = new Reading(name, *children);
+					if (ts.set)
+						reading->setUserTimestamp(ts.tv);
+					readings.push_back(reading);
+				}
+			}
+			else if (!addValue(name, value, policy, *points, false, user_ts))
+			{
+				ok = false;
+				break;
+			}
+		}
+	}
+	else
+	{
+		ok = getValues(root, policy, *points, policy.getPolicy() == ObjectPolicy::Collapse, user_ts);
+	}
+
+	// Reject trailing content after the object
+	if (ok && !doc.at_end())
+	{
+		ok = false;
+	}
+	if (!ok)
+	{
+		for (auto dp : *points)
+			delete dp;
+		return false;
+	}
+
+	if (points->size() > 0)
+	{
+		Reading *reading = new Reading(asset, *points);
+		if (user_ts.set)
+			reading->setUserTimestamp(user_ts.tv);
+		readings.push_back(reading);
+	}
+	return true;
+}
+
+/**
+ * Get the datapoints from the current level of an object. If the recurse
+ * flag is set child objects are also processed, either being nested or
+ * collapsed into the current level depending upon the object policy.
+ *
+ * @param object	The object to iterate over
+ * @param policy	The object policy
+ * @param points	The datapoint array
+ * @param recurse	Recurse to nested objects
+ * @param user_ts	Set to the converted timestamp if one is found
+ * @return bool		False if the object is not valid JSON
+ */
+bool OnDemandParser::Impl::getValues(ondemand::object object, const ObjectPolicy& policy,
+		vector<Datapoint *>& points, bool recurse, UserTimestamp& user_ts)
+{
+	for (auto field : object)
+	{
+		string_view key;
+		ondemand::value value;
+		if (field.unescaped_key().get(key) || field.value().get(value))
+		{
+			return false;
+		}
+		if (!addValue(string(key), value, policy, points, recurse, user_ts))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Add a single object member to the datapoint array. Members of types
+ * that can not be mapped to datapoints are skipped.
+ *
+ * @param name		The member name
+ * @param value		The member value
+ * @param policy	The object policy
+ * @param points	The datapoint array
+ * @param recurse	Recurse to nested objects
+ * @param user_ts	Set to the converted timestamp if the member is the timestamp
+ * @return bool		False if the value is not valid JSON
+ */
+bool OnDemandParser::Impl::addValue(const string& name, ondemand::value value, const ObjectPolicy& policy,
+		vector<Datapoint *>& points, bool recurse, UserTimestamp& user_ts)
+{
+	if (policy.isTimestamp(name.c_str()))
+	{
+		return convertTimestamp(value, policy, user_ts);
+	}
+
+	ondemand::json_type type;
+	if (value.type().get(type))
+	{
+		return false;
+	}
+	switch (type)
+	{
+		case ondemand::json_type::number:
+		{
+			ondemand::number_type ntype;
+			if (value.get_number_type().get(ntype))
+			{
+				return false;
+			}
+			if (ntype == ondemand::number_type::signed_integer)
+			{
+				int64_t v;
+				if (value.get_int64().get(v))
+					return false;
+				DatapointValue dpv((long)v);
+				points.push_back(new Datapoint(name, dpv));
+			}
+			else if (ntype != ondemand::number_type::unsigned_integer)
+			{
+				// Integers too large for a uint64 are treated as doubles
+				double d;
+				if (value.get_double().get(d))
+					return false;
+				DatapointValue dpv(d);
+				points.push_back(new Datapoint(name, dpv));
+			}
+			return true;
+		}
+		case ondemand::json_type::string:
+		{
+			string_view str;
+			if (value.get_string().get(str))
+			{
+				return false;
+			}
+			string s(str);
+			DatapointValue dpv(s);
+			points.push_back(new Datapoint(name, dpv));
+			return true;
+		}
+		case ondemand::json_type::object:
+		{
+			if (!recurse)
+			{
+				return true;
+			}
+			ondemand::object child;
+			if (value.get_object().get(child))
+			{
+				return false;
+			}
+			UserTimestamp ts;
+			if (policy.nest())
+			{
+				vector<Datapoint *> *children = new vector<Datapoint *>;
+				if (!getValues(child, policy, *children, true, ts))
+				{
+					for (auto dp : *children)
+						delete dp;
+					delete children;
+					return false;
+				}
+				DatapointValue dpv(children, true);
+				points.push_back(new Datapoint(name, dpv));
+				return true;
+			}
+			return getValues(child, policy, points, true, ts);
+		}
+		default:
+			// Arrays, booleans and nulls are not mapped to datapoints
+			return true;
+	}
+}
+
+/**
+ * Convert the value of the timestamp member. Timestamps may be strings
+ * or numeric values that give the time since the epoch.
+ *
+ * @param value		The value of the timestamp member
+ * @param policy	The object policy
+ * @param user_ts	The converted timestamp
+ * @return bool		False if the value is not valid JSON
+ */
+bool OnDemandParser::Impl::convertTimestamp(ondemand::value value, const ObjectPolicy& policy,
+		UserTimestamp& user_ts)
+{
+	ondemand::json_type type;
+	if (value.type().get(type))
+	{
+		return false;
+	}
+	if (type == ondemand::json_type::string)
+	{
+		string_view str;
+		if (value.get_string().get(str))
+		{
+			return false;
+		}
+		policy.convertTimestamp(string(str).c_str(), user_ts);
+	}
+	else if (type == ondemand::json_type::number)
+	{
+		ondemand::number_type ntype;
+		if (value.get_number_type().get(ntype))
+		{
+			return false;
+		}
+		if (ntype == ondemand::number_type::signed_integer)
+		{
+			int64_t ts;
+			if (value.get_int64().get(ts))
+				return false;
+			policy.convertTimestamp(ts, user_ts);
+		}
+		else if (ntype != ondemand::number_type::unsigned_integer)
+		{
+			double ts;
+			if (value.get_double().get(ts))
+				return false;
+			policy.convertTimestamp(ts, user_ts);
+		}
+	}
+	return true;
+}
+
+/**
+ * Construct an on demand parser
+ */
+OnDemandParser::OnDemandParser() : m_impl(new Impl)
+{
+}
+
+/**
+ * Destructor for the on demand parser
+ */
+OnDemandParser::~OnDemandParser()
+{
+	delete m_impl;
+}
+
+/**
+ * Parse a payload that should contain a JSON object into readings.
+ * If the payload is not a valid JSON object no readings are created.
+ *
+ * @param payload	The MQTT message payload
+ * @param policy	The object policy
+ * @param asset		The asset name for the reading
+ * @param readings	The vector to which readings are appended
+ * @return bool		False if the payload is not a valid JSON object
+ */
+bool OnDemandParser::parse(const MQTTPayload& payload, const ObjectPolicy& policy,
+		const string& asset, vector<Reading *>& readings)
+{
+	size_t existing = readings.size();
+	if (m_impl->parse(payload, policy, asset, readings, m_pool))
+	{
+		return true;
+	}
+	// Discard any readings created before the error was found
+	for (size_t i = existing; i < readings.size(); i++)
+	{
+		delete readings[i];
+	}
+	readings.resize(existing);
+	return false;
+}
+
+/**
+ * Return if the on demand parser is available in this build
+ */
+bool OnDemandParser::available()
+{
+	return true;
+}
+
+#else
+
+/**
+ * Construct an on demand parser, the plugin was built without simdjson
+ */
+OnDemandParser::OnDemandParser() : m_impl(NULL)
+{
+}
+
+/**
+ * Destructor for the on demand parser
+ */
+OnDemandParser::~OnDemandParser()
+{
+}
+
+/**
+ * The plugin was built without simdjson, no payloads can be parsed
+ */
+bool OnDemandParser::parse(const MQTTPayload& payload, const ObjectPolicy& policy,
+		const string& asset, vector<Reading *>& readings)
+{
+	return false;
+}
+
+/**
+ * Return if the on demand parser is available in this build
+ */
+bool OnDemandParser::available()
+{
+	return false;
+}
+#endif
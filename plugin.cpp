@@ -19,8 +19,6 @@
 #include <rapidjson/document.h>
 #include <version.h>
 
-typedef void (*INGEST_CB)(void *, Reading);
-
 using namespace std;
 
 #define PLUGIN_NAME	"mqtt-scripted"
@@ -36,7 +34,7 @@ static const char *default_config = QUOTE({
 		"readonly" : "true"
 		},
 	"asset" : {
-       		"description" : "Asset name",
+       		"description" : "Asset name. This may include parts of the topic of the message, {topic} is replaced by the topic and {topic[n]} by level n of the topic",
 		"type" : "string",
 	       	"default" : "mqtt",
 		"displayName" : "Asset Name",
@@ -124,7 +122,7 @@ static const char *default_config = QUOTE({
 		"displayName": "Timestamp"
 		},
 	"format" : {
-       		"description" : "The format of timestamps to pass if using the time based data selection method and also the format of timestamps in the payload",
+       		"description" : "The format of timestamps in the payload, a strptime format or one of epoch, epoch_ms or epoch_us for numeric timestamps",
 		"type" : "string",
 	       	"default" : "",
 		"displayName" : "Time Format",
@@ -147,7 +145,167 @@ static const char *default_config = QUOTE({
 		"default" : "",
 		"order" : "14",
 		"displayName": "Script"
-		} 
+		},
+	"payloadType" : {
+		"description" : "The type of Python object used to pass the message payload to the script. A string is decoded as UTF-8, bytes is a copy of the payload and a memory view gives the script direct read only access to the received payload",
+		"type" : "enumeration",
+		"options" : [ "String", "Bytes", "Memory View" ],
+		"default" : "String",
+		"order" : "19",
+		"displayName": "Payload Type",
+		"validity": "script != \"\""
+		},
+	"queueDepth" : {
+		"description" : "The maximum number of messages that may be buffered between receiving them from the MQTT broker and processing them",
+		"type" : "integer",
+		"default" : "1000",
+		"order" : "15",
+		"displayName": "Queue Depth",
+		"minimum" : "1"
+		},
+	"batchSize" : {
+		"description" : "The maximum number of readings that will be passed to the south service in a single call",
+		"type" : "integer",
+		"default" : "100",
+		"order" : "16",
+		"displayName": "Batch Size",
+		"minimum" : "1"
+		},
+	"batchLatency" : {
+		"description" : "The maximum time in milliseconds readings will be held before they are passed to the south service",
+		"type" : "integer",
+		"default" : "50",
+		"order" : "17",
+		"displayName": "Batch Latency",
+		"minimum" : "0"
+		},
+	"workers" : {
+		"description" : "The number of threads used to process messages. When more than one is used each runs the script in a separate Python sub-interpreter, this requires Python 3.12 or later. Changes take effect when the service is restarted",
+		"type" : "integer",
+		"default" : "1",
+		"order" : "18",
+		"displayName": "Script Workers",
+		"minimum" : "1"
+		},
+	"jsonParser" : {
+		"description" : "The parser used for JSON payloads when no script is defined. The on demand parser creates readings directly from the payload without building a document and requires the plugin to be built with simdjson",
+		"type" : "enumeration",
+		"options" : [ "On Demand", "Document" ],
+		"default" : "On Demand",
+		"order" : "20",
+		"displayName": "JSON Parser",
+		"validity": "script == \"\""
+		},
+	"subscriptions" : {
+		"description" : "Additional topics to subscribe to. Each subscription has a topic and may set an asset, policy, timestamp, format, timezone and script, those not set are taken from the main configuration. A script is the name of a file in the FogLAMP scripts directory",
+		"type" : "JSON",
+		"default" : "{ \"subscriptions\" : [] }",
+		"order" : "21",
+		"displayName": "Subscriptions"
+		},
+	"datapoint" : {
+		"description" : "The name of the datapoint created for simple value payloads, if blank the topic is used. This may include parts of the topic of the message in the same way as the asset name",
+		"type" : "string",
+		"default" : "",
+		"order" : "22",
+		"displayName": "Datapoint Name"
+		},
+	"maxInflight" : {
+		"description" : "The maximum number of QoS 1 and 2 messages that may be in flight between the plugin and the broker at any time. Changes cause the plugin to reconnect to the broker",
+		"type" : "integer",
+		"default" : "20",
+		"order" : "23",
+		"displayName": "Maximum In Flight",
+		"minimum" : "1"
+		},
+	"sharedGroup" : {
+		"description" : "Subscribe to the topics as a member of this shared subscription group. The messages are divided between all the services in the group. Leave empty to receive every message",
+		"type" : "string",
+		"default" : "",
+		"order" : "24",
+		"displayName": "Shared Group"
+		},
+	"persistentSession" : {
+		"description" : "Keep the session with the broker when the plugin disconnects, so that QoS 1 and 2 messages published whilst the plugin is not running are delivered when it restarts",
+		"type" : "boolean",
+		"default" : "false",
+		"order" : "25",
+		"displayName": "Persistent Session"
+		},
+	"flowControl" : {
+		"description" : "The action taken when the ingest pipeline can not keep up with the messages received. Block stops receiving messages, falling back to Pause if the pressure lasts longer than the keep alive interval, Pause disconnects from the broker until the pipeline has caught up and Discard drops the messages",
+		"type" : "enumeration",
+		"options" : [ "Block", "Pause", "Discard" ],
+		"default" : "Block",
+		"order" : "26",
+		"displayName": "Flow Control"
+		},
+	"pressureThreshold" : {
+		"description" : "The percentage of the queue depth at which flow control is applied. It is released when the queue has drained to half this level",
+		"type" : "integer",
+		"default" : "80",
+		"order" : "27",
+		"displayName": "Pressure Threshold %",
+		"minimum" : "1",
+		"maximum" : "100"
+		},
+	"maxIngestLatency" : {
+		"description" : "The time in milliseconds the south service may take to accept a batch of readings before flow control is applied. A value of 0 disables the check",
+		"type" : "integer",
+		"default" : "1000",
+		"order" : "28",
+		"displayName": "Maximum Ingest Latency",
+		"minimum" : "0"
+		},
+	"spillSize" : {
+		"description" : "The size in megabytes of a buffer on disk used to hold bursts of messages that overflow the queue. A value of 0 disables the spill buffer. Changes take effect when the service is restarted",
+		"type" : "integer",
+		"default" : "0",
+		"order" : "29",
+		"displayName": "Spill Buffer Size (MB)",
+		"minimum" : "0"
+		},
+	"stageTimers" : {
+		"description" : "Time each stage of the processing of messages and report the latency percentiles periodically in the log",
+		"type" : "boolean",
+		"default" : "false",
+		"order" : "30",
+		"displayName": "Latency Statistics"
+		},
+	"captureSize" : {
+		"description" : "The number of recent messages held in memory, with the result of processing them, that may be dumped to the log on demand by the capture operation. The messages are also used to test a new script before it replaces the running script. A value of 0 disables the capture, a new script is then only checked to load",
+		"type" : "integer",
+		"default" : "64",
+		"order" : "31",
+		"displayName": "Capture Buffer Size",
+		"minimum" : "0",
+		"maximum" : "10000"
+		},
+	"reconfigureMode" : {
+		"description" : "How the connection to the broker is replaced when the connection settings or topics are changed. Make before break keeps the existing connection until the new connection has subscribed, so no messages are missed whilst reconnecting",
+		"type" : "enumeration",
+		"options" : [ "Make before break", "Break before make" ],
+		"default" : "Make before break",
+		"order" : "32",
+		"displayName": "Reconfigure Connection"
+		},
+	"validationMessages" : {
+		"description" : "The number of the most recently captured messages that a new script must convert without error before it replaces the running script. The messages are taken from the capture buffer. A value of 0 only checks the new script loads",
+		"type" : "integer",
+		"default" : "8",
+		"order" : "33",
+		"displayName": "Script Validation Messages",
+		"minimum" : "0",
+		"maximum" : "10000"
+		},
+	"latencyReading" : {
+		"description" : "Also ingest the latency percentiles, in microseconds, as a reading with the asset name of the service followed by Latency. The reading is added to the readings of the service",
+		"type" : "boolean",
+		"default" : "false",
+		"order" : "34",
+		"displayName": "Latency Reading",
+		"validity" : "stageTimers == \"true\""
+		}
 	});
 
 /**
@@ -157,13 +315,22 @@ extern "C" {
 
 /**
  * The plugin information structure
+ *
+ * Version 2 of the south plugin interface is used by default, allowing
+ * readings to be passed to the south service in batches. The version 1
+ * interface, that passes a single reading per call, may be selected at
+ * build time by defining SINGLE_READING_INGEST.
  */
 static PLUGIN_INFORMATION info = {
 	PLUGIN_NAME,              // Name
 	VERSION,                  // Version
-	SP_ASYNC, 		  // Flags
+	SP_ASYNC|SP_CONTROL,	  // Flags
 	PLUGIN_TYPE_SOUTH,        // Type
+#ifdef SINGLE_READING_INGEST
 	"1.0.0",                  // Interface version
+#else
+	"2.0.0",                  // Interface version
+#endif
 	default_config		  // Default configuration
 };
 
@@ -203,7 +370,11 @@ MQTTScripted *mqtt = (MQTTScripted *)handle;
 /**
  * Register ingest callback
  */
+#ifdef SINGLE_READING_INGEST
 void plugin_register_ingest(PLUGIN_HANDLE *handle, INGEST_CB cb, void *data)
+#else
+void plugin_register_ingest(PLUGIN_HANDLE *handle, INGEST_CB2 cb, void *data)
+#endif
 {
 MQTTScripted *mqtt = (MQTTScripted *)handle;
 
@@ -215,7 +386,11 @@ MQTTScripted *mqtt = (MQTTScripted *)handle;
 /**
  * Poll for a plugin reading
  */
+#ifdef SINGLE_READING_INGEST
 Reading plugin_poll(PLUGIN_HANDLE *handle)
+#else
+vector<Reading *> *plugin_poll(PLUGIN_HANDLE *handle)
+#endif
 {
 MQTTScripted *mqtt = (MQTTScripted *)handle;
 
@@ -234,6 +409,45 @@ ConfigCategory	config(mqtt->getName(), newConfig);
 	mqtt->reconfigure(config);
 }
 
+/**
+ * Control entry point, writing "dump" or "clear" to "capture" dumps the
+ * messages held in the capture ring to the log or discards them
+ */
+bool plugin_write(PLUGIN_HANDLE *handle, string& name, string& value)
+{
+MQTTScripted *mqtt = (MQTTScripted *)handle;
+
+	if (name.compare("capture") == 0)
+	{
+		return mqtt->capture(value);
+	}
+	Logger::getLogger()->error("Unknown control item '%s'", name.c_str());
+	return false;
+}
+
+/**
+ * Control operation entry point. The "capture" operation dumps the
+ * messages held in the capture ring to the log, or discards them if
+ * given an "action" parameter of "clear"
+ */
+bool plugin_operation(PLUGIN_HANDLE *handle, string& operation, int count, PLUGIN_PARAMETER **params)
+{
+MQTTScripted *mqtt = (MQTTScripted *)handle;
+
+	if (operation.compare("capture") == 0)
+	{
+		string action = "dump";
+		for (int i = 0; i < count; i++)
+		{
+			if (params[i]->name.compare("action") == 0)
+				action = params[i]->value;
+		}
+		return mqtt->capture(action);
+	}
+	Logger::getLogger()->error("Unknown control operation '%s'", operation.c_str());
+	return false;
+}
+
 /**
  * Shutdown the plugin
  */
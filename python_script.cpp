@@ -7,9 +7,13 @@
  *                                      
  * Author: Mark Riddoch
  */
+#define PY_SSIZE_T_CLEAN	// Must precede the first include of Python.h
 #include <python_script.h>
 #include <utils.h>
 #include <dlfcn.h>
+#include <thread>
+#include <fstream>
+#include <sstream>
 #include "plugin_api.h"
 
 using namespace std;
@@ -17,13 +21,30 @@ using namespace rapidjson;
 
 void logError();
 
+#ifndef PYTHON_SUBINTERPRETERS
+/*
+ * The state returned when the GIL of the main interpreter is acquired. The
+ * state is held per thread as the worker and the thread that loads a new
+ * script may both use the same instance.
+ */
+static thread_local PyGILState_STATE gilState;
+#endif
+
 /**
  * Constructor for the PythonScript class that is used to
  * convert the message payload
  *
- * @param name	The name of the south service
+ * If a sub-interpreter is requested and the Python version supports
+ * sub-interpreters with their own GIL, the script will be run in a
+ * new sub-interpreter. This allows multiple instances of the script
+ * to execute in parallel. Otherwise the script is run in the main
+ * interpreter.
+ *
+ * @param name			The name of the south service
+ * @param subInterpreter	Run the script in a dedicated sub-interpreter
  */
-PythonScript::PythonScript(const string& name) : m_init(false), m_pFunc(NULL), m_pModule(NULL)
+PythonScript::PythonScript(const string& name, bool subInterpreter) : m_init(false), m_pFunc(NULL), m_pModule(NULL),
+	m_pBatchFunc(NULL), m_payloadType(PayloadString), m_interpreter(NULL), m_parent(NULL)
 {
 	m_logger = Logger::getLogger();
 
@@ -35,7 +56,43 @@ PythonScript::PythonScript(const string& name) : m_init(false), m_pFunc(NULL), m
 	// Inititialise embedded Python
 	m_runtime = PythonRuntime::getPythonRuntime();
 
+#ifdef PYTHON_SUBINTERPRETERS
+	// The GIL state API is not used where sub-interpreters are supported,
+	// the thread may also hold thread states for sub-interpreters and the
+	// API would return one of those rather than one for the main interpreter
+	PyThreadState *initState = PyThreadState_New(PyInterpreterState_Main());
+	PyEval_RestoreThread(initState);
+	PyThreadState *mainState = NULL;
+	if (subInterpreter)
+	{
+		PyInterpreterConfig config;
+		memset(&config, 0, sizeof(config));
+		config.use_main_obmalloc = 0;
+		config.allow_fork = 0;
+		config.allow_exec = 0;
+		config.allow_threads = 1;
+		config.allow_daemon_threads = 0;
+		config.check_multi_interp_extensions = 1;	// Required for a separate GIL
+		config.gil = PyInterpreterConfig_OWN_GIL;
+		PyThreadState *tstate = NULL;
+		mainState = PyThreadState_Get();
+		PyStatus status = Py_NewInterpreterFromConfig(&tstate, &config);
+		if (PyStatus_Exception(status))
+		{
+			m_logger->error("Failed to create Python sub-interpreter, the main interpreter will be used");
+			PyThreadState_Swap(mainState);
+			mainState = NULL;
+		}
+		else
+		{
+			// The sub-interpreter's GIL is now held by this thread
+			m_interpreter = PyThreadState_GetInterpreter(tstate);
+			m_threadStates.push_back(make_pair(this_thread::get_id(), tstate));
+		}
+	}
+#else
 	PyGILState_STATE state = PyGILState_Ensure(); // acquire GIL
+#endif
 
 	// Set Python path for embedded Python 3.5
 	// Get current sys.path. borrowed reference
@@ -46,17 +103,140 @@ PythonScript::PythonScript(const string& name) : m_init(false), m_pFunc(NULL), m
 	PyList_Insert(sysPath, 0, pPath);
 	// Remove temp object
 	Py_CLEAR(pPath);
+
+#ifdef PYTHON_SUBINTERPRETERS
+	if (mainState)
+	{
+		// Release the sub-interpreter and return to the main interpreter
+		PyEval_SaveThread();
+		PyEval_RestoreThread(mainState);
+	}
+	PyThreadState_Clear(initState);
+	PyThreadState_DeleteCurrent();
+#else
 	PyGILState_Release(state);
+#endif
 
 	m_init = true;
 }
 
+/**
+ * Constructor for a PythonScript that runs a further script in the
+ * interpreter of an existing instance. The new instance uses the
+ * interpreter lock and thread states of the parent, it must be
+ * destroyed before the parent and only used by the threads that use
+ * the parent.
+ *
+ * @param name		The name of the south service
+ * @param parent	The instance whose interpreter is used
+ */
+PythonScript::PythonScript(const string& name, PythonScript *parent) : m_init(false), m_pFunc(NULL), m_pModule(NULL),
+	m_pBatchFunc(NULL), m_payloadType(parent->m_payloadType), m_interpreter(NULL), m_parent(parent)
+{
+	m_logger = Logger::getLogger();
+	m_runtime = parent->m_runtime;
+	m_init = true;
+}
+
 /**
  * Destructor for the Python script class
  */
 PythonScript::~PythonScript()
 {
 	m_init = false;
+	if (m_parent)
+	{
+		// The interpreter belongs to the parent
+		lock();
+		Py_CLEAR(m_pFunc);
+		Py_CLEAR(m_pBatchFunc);
+		Py_CLEAR(m_pModule);
+		unlock();
+		return;
+	}
+#ifdef PYTHON_SUBINTERPRETERS
+	lock();
+	Py_CLEAR(m_pFunc);
+	Py_CLEAR(m_pBatchFunc);
+	Py_CLEAR(m_pModule);
+	// The interpreter can only be ended from its last thread
+	// state, delete those created for the other threads
+	PyThreadState *current = PyThreadState_Get();
+	for (auto& ts : m_threadStates)
+	{
+		if (ts.second != current)
+		{
+			PyThreadState_Clear(ts.second);
+			PyThreadState_Delete(ts.second);
+		}
+	}
+	if (m_interpreter)
+	{
+		Py_EndInterpreter(current);
+	}
+	else
+	{
+		PyThreadState_Clear(current);
+		PyThreadState_DeleteCurrent();
+	}
+	m_threadStates.clear();
+	m_interpreter = NULL;
+#endif
+}
+
+/**
+ * Acquire the interpreter lock for the interpreter in which the script
+ * runs. Where sub-interpreters are supported a thread state is created
+ * the first time a thread uses the instance, for the main interpreter
+ * as well as a sub-interpreter. The GIL state API is only used if they
+ * are not supported.
+ */
+void PythonScript::lock()
+{
+	if (m_parent)
+	{
+		m_parent->lock();
+		return;
+	}
+#ifdef PYTHON_SUBINTERPRETERS
+	thread::id id = this_thread::get_id();
+	PyThreadState *tstate = NULL;
+	unique_lock<mutex> lck(m_threadStatesMutex);
+	for (auto& ts : m_threadStates)
+	{
+		if (ts.first == id)
+		{
+			tstate = ts.second;
+			break;
+		}
+	}
+	if (!tstate)
+	{
+		tstate = PyThreadState_New(m_interpreter ? m_interpreter : PyInterpreterState_Main());
+		m_threadStates.push_back(make_pair(id, tstate));
+	}
+	lck.unlock();
+	PyEval_RestoreThread(tstate);
+#else
+	gilState = PyGILState_Ensure();
+#endif
+}
+
+/**
+ * Release the interpreter lock acquired by lock()
+ */
+void PythonScript::unlock()
+{
+	if (m_parent)
+	{
+		m_parent->unlock();
+		return;
+	}
+#ifdef PYTHON_SUBINTERPRETERS
+	PyEval_SaveThread();
+#else
+	PyGILState_Release(gilState);
+#endif
 }
 
 /**
@@ -82,7 +262,7 @@ bool PythonScript::setScript(const string& name)
 	{
 		start = 0;
 	}
-	PyGILState_STATE state = PyGILState_Ensure();
+	lock();
 
 	string scriptName = name.substr(start);
 	size_t end = scriptName.rfind(".py");
@@ -104,7 +284,7 @@ bool PythonScript::setScript(const string& name)
 		{
 			logError();
 
-			PyGILState_Release(state);
+			unlock();
 			m_failedScript = true;
 			return false;
 		}
@@ -112,6 +292,7 @@ bool PythonScript::setScript(const string& name)
 		{
 			Py_CLEAR(m_pModule);
 			Py_CLEAR(m_pFunc);
+			Py_CLEAR(m_pBatchFunc);
 		}
 		m_pModule = new_module;
 	}
@@ -122,6 +303,7 @@ bool PythonScript::setScript(const string& name)
 		{
 			Py_CLEAR(m_pModule);
 			Py_CLEAR(m_pFunc);
+			Py_CLEAR(m_pBatchFunc);
 		}
 		m_logger->debug("Python load module %s", scriptName.c_str());
 
@@ -134,7 +316,7 @@ bool PythonScript::setScript(const string& name)
 	{
 		logError();
 
-		PyGILState_Release(state);
+		unlock();
 		m_failedScript = true;
 		return false;
 	}
@@ -150,20 +332,178 @@ bool PythonScript::setScript(const string& name)
 		m_failedScript = true;
 	}
 
-	PyGILState_Release(state);
+	// The optional convert_batch function is passed lists of messages and topics
+	Py_CLEAR(m_pBatchFunc);
+	if (PyObject_HasAttrString(m_pModule, (char *)"convert_batch"))
+	{
+		m_pBatchFunc = PyObject_GetAttrString(m_pModule, (char *)"convert_batch");
+		if (m_pBatchFunc && !PyCallable_Check(m_pBatchFunc))
+		{
+			m_logger->warn("The convert_batch attribute of the script is not callable and will be ignored");
+			Py_CLEAR(m_pBatchFunc);
+		}
+		else if (m_pBatchFunc)
+		{
+			m_logger->info("The script defines a convert_batch function, messages will be converted in batches");
+		}
+	}
+
+	unlock();
 
 	return m_pFunc != NULL;;
 }
 
+/**
+ * Load a script into a new module object, leaving any module already
+ * imported from the script in place. The module is not added to the
+ * modules of the interpreter, so a script that is running is not
+ * replaced until swapScript is called. The script is compiled from
+ * the source file, any error is logged with the line on which it
+ * occurred.
+ *
+ * @param name	The name of the Python script
+ * @return bool	True if the script was loaded and defines a convert function
+ */
+bool PythonScript::loadScript(const string& name)
+{
+	m_failedScript = true;
+	m_execCount = 0;
+
+	string path, source;
+	if (!readScript(name, path, source))
+	{
+		m_logger->error("Unable to read the Python script %s", name.c_str());
+		return false;
+	}
+	size_t start = path.find_last_of("/");
+	string scriptName = start == string::npos ? path : path.substr(start + 1);
+	size_t end = scriptName.rfind(".py");
+	if (end != std::string::npos)
+	{
+		scriptName = scriptName.substr(0, end);
+	}
+
+	m_logger->debug("Python load module %s from %s", scriptName.c_str(), path.c_str());
+	lock();
+	Py_CLEAR(m_pFunc);
+	Py_CLEAR(m_pBatchFunc);
+	Py_CLEAR(m_pModule);
+
+	PyObject *pCode = Py_CompileString(source.c_str(), path.c_str(), Py_file_input);
+	if (!pCode)
+	{
+		logError();
+		unlock();
+		return false;
+	}
+	PyObject *pModule = PyModule_New(scriptName.c_str());
+	PyObject *pDict = PyModule_GetDict(pModule);	// Borrowed reference
+	PyObject *pPath = PyUnicode_DecodeFSDefault(path.c_str());
+	PyDict_SetItemString(pDict, "__file__", pPath);
+	PyDict_SetItemString(pDict, "__builtins__", PyEval_GetBuiltins());
+	Py_CLEAR(pPath);
+	PyObject *pResult = PyEval_EvalCode(pCode, pDict, pDict);
+	Py_CLEAR(pCode);
+	if (!pResult)
+	{
+		logError();
+		Py_CLEAR(pModule);
+		unlock();
+		return false;
+	}
+	Py_CLEAR(pResult);
+	m_pModule = pModule;
+	m_script = scriptName;
+
+	m_pFunc = PyObject_GetAttrString(m_pModule, (char*)"convert");
+	if (!m_pFunc || !PyCallable_Check(m_pFunc))
+	{
+		PyErr_Clear();
+		m_logger->error("The supplied script does not define a function called 'convert'");
+		Py_CLEAR(m_pFunc);
+		unlock();
+		return false;
+	}
+	if (PyObject_HasAttrString(m_pModule, (char *)"convert_batch"))
+	{
+		m_pBatchFunc = PyObject_GetAttrString(m_pModule, (char *)"convert_batch");
+		if (m_pBatchFunc && !PyCallable_Check(m_pBatchFunc))
+		{
+			m_logger->warn("The convert_batch attribute of the script is not callable and will be ignored");
+			Py_CLEAR(m_pBatchFunc);
+		}
+	}
+	unlock();
+
+	m_failedScript = false;
+	return true;
+}
+
+/**
+ * Read the source of a script. A name without a directory that is not
+ * found in the current directory is read from the scripts directory,
+ * from which modules are imported.
+ *
+ * @param name		The name of the Python script
+ * @param path		Set to the path the script was read from
+ * @param source	Set to the source of the script
+ * @return bool		False if the script could not be read
+ */
+bool PythonScript::readScript(const string& name, string& path, string& source)
+{
+	path = name;
+	ifstream in(path);
+	if (!in && path.find('/') == string::npos)
+	{
+		path = getDataDir() + "/scripts/" + name;
+		in.open(path);
+	}
+	if (!in)
+	{
+		return false;
+	}
+	stringstream buffer;
+	buffer << in.rdbuf();
+	source = buffer.str();
+	return true;
+}
+
+/**
+ * Exchange the script of this instance with that of another instance
+ * that runs in the same interpreter. Only the references to the module
+ * and functions are exchanged, no Python code is run. The instance must
+ * not be executing the script whilst the exchange is made.
+ *
+ * @param other	The instance to exchange scripts with
+ */
+void PythonScript::swapScript(PythonScript& other)
+{
+	swap(m_pModule, other.m_pModule);
+	swap(m_pFunc, other.m_pFunc);
+	swap(m_pBatchFunc, other.m_pBatchFunc);
+	swap(m_script, other.m_script);
+	swap(m_failedScript, other.m_failedScript);
+	m_execCount = 0;
+	if (m_pBatchFunc)
+	{
+		m_logger->info("The script defines a convert_batch function, messages will be converted in batches");
+	}
+}
+
 /**
  * Execute the mapping function. This function is always called
  * convert and is passed the MQTT message as a string. It must return
  * a Python DICT which is a set of key/value pairs that make up the data
  * points for this reading.
  *
- * @param message	The MQTT message string
+ * The payload is decoded as UTF-8 directly from the MQTT buffer using
+ * the surrogateescape error handler, so embedded NULL characters and
+ * binary payloads are passed intact to the script.
+ *
+ * @param payload	The MQTT message payload and topic
+ * @param asset		Set to the asset name if returned by the script
  */
-Document *PythonScript::execute(const string& message, const string& topic, string& asset)
+Document *PythonScript::execute(const MQTTPayload& payload, string& asset)
 {
 Document *doc = NULL;
 
@@ -178,18 +518,246 @@ Document *doc = NULL;
 		return doc;
 	}
 
-	PyGILState_STATE state = PyGILState_Ensure();
+	lock();
+	PyObject *pDict;
+	PyObject *pReturn = callConvert(payload, asset, pDict);
+	if (pReturn)
+	{
+		doc = new Document();
+		doc->SetObject();
+		if (pDict)
+		{
+			createJSON(pDict, *doc, doc->GetAllocator());
+		}
+		Py_CLEAR(pReturn);
+	}
+	unlock();
+	return doc;
+}
+
+/**
+ * Execute the mapping function and convert the DICT it returns directly
+ * into readings using the supplied object policy. This avoids the creation
+ * of an intermediate JSON document.
+ *
+ * @param payload	The MQTT message payload and topic
+ * @param policy	The object policy to apply to the returned DICT
+ * @param asset		The default asset name, set to the asset name if returned by the script
+ * @param readings	The readings created from the returned DICT
+ * @return bool		True if the script executed successfully
+ */
+bool PythonScript::execute(const MQTTPayload& payload, const ObjectPolicy& policy, string& asset,
+		vector<Reading *>& readings)
+{
+	if (m_failedScript)
+	{
+		m_execCount++;
+		if (m_execCount > 100)
+		{
+			m_logger->warn("The plugin is unable to process data without a valid 'convert' funtion in the script.");
+			m_execCount = 0;
+		}
+		return false;
+	}
+
+	lock();
+	PyObject *pDict;
+	PyObject *pReturn = callConvert(payload, asset, pDict);
+	bool success = pReturn != NULL;
+	if (pReturn)
+	{
+		if (pDict)
+		{
+			createReadings(pDict, asset, policy, readings);
+		}
+		Py_CLEAR(pReturn);
+	}
+	unlock();
+	return success;
+}
+
+/**
+ * Execute the convert_batch function of the script, passing it a list of
+ * messages and a list of the topics on which they were received. The
+ * function must return a list with an entry for each message, each entry
+ * takes the same form as the return from the convert function.
+ *
+ * @param payloads	The MQTT message payloads and topics
+ * @param policy	The object policy to apply to the returned DICTs
+ * @param asset		The default asset name
+ * @param readings	The readings created from the returned DICTs
+ * @return bool		True if the script executed successfully
+ */
+bool PythonScript::executeBatch(const vector<MQTTPayload>& payloads, const ObjectPolicy& policy,
+		const string& asset, vector<Reading *>& readings)
+{
+	if (m_failedScript)
+	{
+		m_execCount += payloads.size();
+		if (m_execCount > 100)
+		{
+			m_logger->warn("The plugin is unable to process data without a valid 'convert' funtion in the script.");
+			m_execCount = 0;
+		}
+		return false;
+	}
+
+	lock();
+	if (!m_pBatchFunc)
+	{
+		unlock();
+		return false;
+	}
+
+	Py_ssize_t count = payloads.size();
+	PyObject *pMessages = PyList_New(count);
+	PyObject *pTopics = PyList_New(count);
+	// A reference to each memoryview is kept so that every view is
+	// released, even if the script removes it from the list
+	vector<PyObject *> views;
+	bool valid = pMessages && pTopics;
+	for (Py_ssize_t i = 0; valid && i < count; i++)
+	{
+		const MQTTPayload& payload = payloads[i];
+		PyObject *pMessage = payloadObject(payload);
+		PyObject *pTopic = PyUnicode_DecodeUTF8(payload.topic(), payload.topicLength(), "surrogateescape");
+		if (!pMessage || !pTopic)
+		{
+			Py_XDECREF(pMessage);
+			Py_XDECREF(pTopic);
+			valid = false;
+			break;
+		}
+		if (m_payloadType == PayloadMemoryView)
+		{
+			Py_INCREF(pMessage);
+			views.push_back(pMessage);
+		}
+		// PyList_SET_ITEM steals the references
+		PyList_SET_ITEM(pMessages, i, pMessage);
+		PyList_SET_ITEM(pTopics, i, pTopic);
+	}
+
+	PyObject *pReturn = NULL;
+	if (valid)
+	{
+		pReturn = PyObject_CallFunctionObjArgs(m_pBatchFunc, pMessages, pTopics, NULL);
+	}
+	for (auto pMessage : views)
+	{
+		releasePayload(pMessage);
+	}
+	Py_CLEAR(pMessages);
+	Py_CLEAR(pTopics);
+
+	bool rval = false;
+	if (!pReturn)
+	{
+		logError();
+	}
+	else if (!PyList_Check(pReturn))
+	{
+		m_logger->error("The return from the Python convert_batch function must be a list");
+		m_failedScript = true;
+		m_execCount = 0;
+	}
+	else
+	{
+		Py_ssize_t n = PyList_GET_SIZE(pReturn);
+		if (n != count)
+		{
+			m_logger->warn("The Python convert_batch function returned %ld results for %ld messages",
+					(long)n, (long)count);
+		}
+		for (Py_ssize_t i = 0; i < n; i++)
+		{
+			string itemAsset = asset;
+			PyObject *pDict;
+			if (parseReturn(PyList_GET_ITEM(pReturn, i), itemAsset, pDict) && pDict)
+			{
+				createReadings(pDict, itemAsset, policy, readings);
+			}
+		}
+		rval = true;
+	}
+	Py_CLEAR(pReturn);
+	unlock();
+	return rval;
+}
+
+/**
+ * Create the Python object that is passed to the script for the
+ * message payload. By default the payload is decoded as UTF-8 directly
+ * from the MQTT buffer using the surrogateescape error handler so that
+ * binary data is not lost. The script may instead be configured to
+ * receive a bytes object or a read only memoryview of the MQTT buffer,
+ * the latter avoids both decoding and copying the payload. Must be
+ * called with the interpreter lock held.
+ *
+ * @param payload	The MQTT message payload
+ * @return PyObject*	A new reference to the message object
+ */
+PyObject *PythonScript::payloadObject(const MQTTPayload& payload)
+{
+	switch (m_payloadType)
+	{
+		case PayloadBytes:
+			return PyBytes_FromStringAndSize(payload.data(), payload.length());
+		case PayloadMemoryView:
+			return PyMemoryView_FromMemory((char *)payload.data(), payload.length(), PyBUF_READ);
+		default:
+			return PyUnicode_DecodeUTF8(payload.data(), payload.length(), "surrogateescape");
+	}
+}
+
+/**
+ * Release the Python object created by payloadObject. A memoryview is
+ * explicitly released so that the script can not access the MQTT buffer
+ * once the message has been processed, even if it retained a reference
+ * to the memoryview. Must be called with the interpreter lock held.
+ *
+ * @param pMessage	The message object to release
+ */
+void PythonScript::releasePayload(PyObject *pMessage)
+{
+	if (pMessage && PyMemoryView_Check(pMessage))
+	{
+		PyObject *pResult = PyObject_CallMethod(pMessage, "release", NULL);
+		if (!pResult)
+		{
+			PyErr_Clear();
+		}
+		Py_XDECREF(pResult);
+	}
+	Py_XDECREF(pMessage);
+}
+
+/**
+ * Call the convert function of the script and validate the value it
+ * returns. Must be called with the interpreter lock held.
+ *
+ * @param payload	The MQTT message payload and topic
+ * @param asset		Set to the asset name if returned by the script
+ * @param pDict		Set to the DICT returned by the script or NULL if no data was returned
+ * @return PyObject*	The value returned by the script, or NULL on failure. The caller must release this.
+ */
+PyObject *PythonScript::callConvert(const MQTTPayload& payload, string& asset, PyObject *&pDict)
+{
+	pDict = NULL;
+
 	if (m_pFunc)
 	{
 		if (PyCallable_Check(m_pFunc))
 		{
-			PyObject *dict = NULL;
-			PyObject *assetObject = NULL;
-			PyObject *pValue = NULL;
 			PyObject *pReturn = NULL;
 		       
+			PyObject *pMessage = payloadObject(payload);
+			PyObject *pTopic = PyUnicode_DecodeUTF8(payload.topic(), payload.topicLength(), "surrogateescape");
 			try {
-				pReturn = PyObject_CallFunction(m_pFunc, "ss", message.c_str(), topic.c_str());
+				if (pMessage && pTopic)
+					pReturn = PyObject_CallFunctionObjArgs(m_pFunc, pMessage, pTopic, NULL);
+				releasePayload(pMessage);
+				Py_CLEAR(pTopic);
 			} catch (exception& e) {
 				m_logger->error("Execution of the convert Python function failed: %s", e.what());
 				return NULL;
@@ -200,185 +768,156 @@ Document *doc = NULL;
 				logError();
 				return NULL;
 			}
-			else if (pReturn == Py_None)
+			if (!parseReturn(pReturn, asset, pDict))
 			{
-				doc = new Document();
-				auto& alloc = doc->GetAllocator();
-				doc->SetObject();
-				return doc;
+				Py_CLEAR(pReturn);
+				return NULL;
 			}
-			else if (PyTuple_Check(pReturn))
-			{
-				if (PyArg_ParseTuple(pReturn, "O|O", &assetObject, &dict) == false)
-				{
+			return pReturn;
+		}
+		else
+		{
+			m_logger->error("The convert function is not callable in the supplied Python script");
+		}
+	}
+	else
+	{
+		m_logger->fatal("The supplied Python script does not define a valid \"convert\" function");
+	}
 
-					m_logger->error("Return from Python convert function is of an incorrect type, it should be a Python DICT object or a string with the asset code and a DICT object with the reading data");
-					Py_CLEAR(pReturn);
-					m_failedScript = true;
-					m_execCount = 0;
-					return NULL;
-				}
+	return NULL;
+}
 
-				if (assetObject == NULL)
-				{
+/**
+ * Check the value returned by the convert function is valid and extract
+ * the asset name and DICT from it. The value may be a DICT, None, or a
+ * tuple of an asset name and a DICT or None.
+ *
+ * @param pReturn	The value returned by the convert function
+ * @param asset		Set to the asset name if one was returned
+ * @param pDict		Set to the returned DICT or NULL if no data was returned
+ * @return bool		True if the returned value is valid
+ */
+bool PythonScript::parseReturn(PyObject *pReturn, string& asset, PyObject *&pDict)
+{
+PyObject *dict = NULL;
+PyObject *assetObject = NULL;
+PyObject *pValue = NULL;
 
-					m_logger->error("When the return from the Python convert function is a pair of values the first of these must be a string containing the asset code");
-					Py_CLEAR(pReturn);
-					m_failedScript = true;
-					m_execCount = 0;
-					return NULL;
+	pDict = NULL;
+	if (pReturn == Py_None)
+	{
+		return true;
+	}
+	else if (PyTuple_Check(pReturn))
+	{
+		if (PyArg_ParseTuple(pReturn, "O|O", &assetObject, &dict) == false)
+		{
 
-				}
-				else if (assetObject == Py_None)
-				{
+			m_logger->error("Return from Python convert function is of an incorrect type, it should be a Python DICT object or a string with the asset code and a DICT object with the reading data");
+			m_failedScript = true;
+			m_execCount = 0;
+			return false;
+		}
 
-					m_logger->error("The returned asset name was None, either a valid string must be returned or the asset name may be omitted");
-					Py_CLEAR(pReturn);
-					m_failedScript = true;
-					m_execCount = 0;
-					return NULL;
+		if (assetObject == NULL)
+		{
 
-				}
-				else if (dict == NULL)
-				{
+			m_logger->error("When the return from the Python convert function is a pair of values the first of these must be a string containing the asset code");
+			m_failedScript = true;
+			m_execCount = 0;
+			return false;
 
-					m_logger->error("Return from Python convert function is of an incorrect type, it should be a Python DICT object or a string with the asset code and a DICT object with the reading data");
-					Py_CLEAR(pReturn);
-					m_failedScript = true;
-					m_execCount = 0;
-					return NULL;
+		}
+		else if (assetObject == Py_None)
+		{
 
-				}
-				else if (dict == Py_None)
-				{
-					const char *name;
-					if (PyUnicode_Check(assetObject))
-					{
-						name = PyUnicode_AsUTF8(assetObject);
-					}
-					else if (PyBytes_Check(assetObject))
-					{
-						PyBytes_AsString(assetObject);
-					}
-					else
-					{
-						m_logger->error("When the return from the Python convert function is a pair of values the first of these must be a string contianing the asset name");
-						Py_CLEAR(pReturn);
-						m_failedScript = true;
-						m_execCount = 0;
-						return NULL;
-					}
-					asset = name;
-					doc = new Document();
-					auto& alloc = doc->GetAllocator();
-					doc->SetObject();
-					return doc;
-				}
-				else  if (! PyDict_Check(dict))
-				{
+			m_logger->error("The returned asset name was None, either a valid string must be returned or the asset name may be omitted");
+			m_failedScript = true;
+			m_execCount = 0;
+			return false;
 
-					m_logger->error("When the return from the Python convert function is a pair of values the second of these must be a Python DICT");
-					Py_CLEAR(pReturn);
-					m_failedScript = true;
-					m_execCount = 0;
-					return NULL;
-				}
+		}
+		else if (dict == NULL)
+		{
 
-				const char *name;
-			       	if (PyUnicode_Check(assetObject))
-				{
-					name = PyUnicode_AsUTF8(assetObject);
-				}
-				else if (PyBytes_Check(assetObject))
-				{
-					PyBytes_AsString(assetObject);
-				}
-				else
-				{
-					m_logger->error("When the return from the Python convert function is a pair of values the first of these must be a string containing the asset name");
-					Py_CLEAR(pReturn);
-					m_failedScript = true;
-					m_execCount = 0;
-					return NULL;
-				}
-				if (! *name)
-				{
-					m_logger->error("An empty asset name has been returned by the script. Asset names can not be empty");
-					Py_CLEAR(pReturn);
-					m_failedScript = true;
-					m_execCount = 0;
-					return NULL;
-				}
-				asset = name;
-				pValue = dict;
+			m_logger->error("Return from Python convert function is of an incorrect type, it should be a Python DICT object or a string with the asset code and a DICT object with the reading data");
+			m_failedScript = true;
+			m_execCount = 0;
+			return false;
 
+		}
+		else if (dict == Py_None)
+		{
+			const char *name;
+			if (PyUnicode_Check(assetObject))
+			{
+				name = PyUnicode_AsUTF8(assetObject);
 			}
-			else if (!PyDict_Check(pReturn))
+			else if (PyBytes_Check(assetObject))
 			{
-				m_logger->error("Return from Python convert function is of an incorrect type, it should be a Python DICT object or a DICT object and a string");
-				Py_CLEAR(pReturn);
-				m_failedScript = true;
-				m_execCount = 0;
-				return NULL;
+				name = PyBytes_AsString(assetObject);
 			}
 			else
 			{
-				pValue = pReturn;
+				m_logger->error("When the return from the Python convert function is a pair of values the first of these must be a string contianing the asset name");
+				m_failedScript = true;
+				m_execCount = 0;
+				return false;
 			}
+			asset = name;
+			return true;
+		}
+		else  if (! PyDict_Check(dict))
+		{
 
-			doc = new Document();
-			Document::AllocatorType& alloc = doc->GetAllocator();
-			doc->SetObject();
-			PyObject *key = NULL;
-			PyObject *value = NULL;
-			Py_ssize_t pos = 0;
+			m_logger->error("When the return from the Python convert function is a pair of values the second of these must be a Python DICT");
+			m_failedScript = true;
+			m_execCount = 0;
+			return false;
+		}
 
-			while (PyDict_Next(pValue, &pos, &key, &value))
-			{
-				const char *name = PyUnicode_Check(key) ? 
-					PyUnicode_AsUTF8(key)
-					: PyBytes_AsString(key);
-				if (PyLong_Check(value) || PyLong_Check(value))
-				{
-					doc->AddMember(Value(name, alloc), Value((int64_t)PyLong_AsLong(value)), alloc);
-				}
-				else if (PyFloat_Check(value))
-				{
-					doc->AddMember(Value(name, alloc),Value(PyFloat_AS_DOUBLE(value)), alloc);
-				}
-				else if (PyBytes_Check(value))
-				{
-					doc->AddMember(Value(name, alloc),Value(PyBytes_AsString(value), alloc), alloc);
-				}
-				else if (PyUnicode_Check(value))
-				{
-					doc->AddMember(Value(name, alloc),Value(PyUnicode_AsUTF8(value), alloc), alloc);
-				}
-				else if (PyDict_Check(value))
-				{
-					Value child(kObjectType);
-					createJSON(value, child, alloc);
-					doc->AddMember(Value(name, alloc), child, alloc);
-				}
-				else
-				{
-					m_logger->error("Not adding data for '%s', unable to map type", name);
-				}
-			}
-			Py_CLEAR(pReturn);
+		const char *name;
+	       	if (PyUnicode_Check(assetObject))
+		{
+			name = PyUnicode_AsUTF8(assetObject);
+		}
+		else if (PyBytes_Check(assetObject))
+		{
+			name = PyBytes_AsString(assetObject);
 		}
 		else
 		{
-			m_logger->error("The convert function is not callable in the supplied Python script");
+			m_logger->error("When the return from the Python convert function is a pair of values the first of these must be a string containing the asset name");
+			m_failedScript = true;
+			m_execCount = 0;
+			return false;
+		}
+		if (! *name)
+		{
+			m_logger->error("An empty asset name has been returned by the script. Asset names can not be empty");
+			m_failedScript = true;
+			m_execCount = 0;
+			return false;
 		}
+		asset = name;
+		pValue = dict;
+
+	}
+	else if (!PyDict_Check(pReturn))
+	{
+		m_logger->error("Return from Python convert function is of an incorrect type, it should be a Python DICT object or a DICT object and a string");
+		m_failedScript = true;
+		m_execCount = 0;
+		return false;
 	}
 	else
 	{
-		m_logger->fatal("The supplied Python script does not define a valid \"convert\" function");
+		pValue = pReturn;
 	}
 
-	PyGILState_Release(state);
-	return doc;
+	pDict = pValue;
+	return true;
 }
 
 /**
@@ -393,17 +932,17 @@ PyObject *ptype, *pvalue, *ptraceback;
 		PyErr_Fetch(&ptype, &pvalue, &ptraceback);
 		PyErr_NormalizeException(&ptype,&pvalue,&ptraceback);
 
-		char *msg, *file, *text;
-		int line, offset;
-
-		int res = PyArg_ParseTuple(pvalue,"s(siis)",&msg,&file,&line,&offset,&text);
-
+		// Only a syntax error has the line number and text, discard the
+		// error raised if the attributes do not exist as any further
+		// calls would fail whilst it is set
 		PyObject *line_no = PyObject_GetAttrString(pvalue,"lineno");
+		PyErr_Clear();
 		PyObject *line_no_str = PyObject_Str(line_no);
 		PyObject *line_no_unicode = PyUnicode_AsEncodedString(line_no_str,"utf-8", "Error");
 		char *actual_line_no = PyBytes_AsString(line_no_unicode);  // Line number
 
 		PyObject *ptext = PyObject_GetAttrString(pvalue,"text");
+		PyErr_Clear();
 		PyObject *ptext_str = PyObject_Str(ptext);
 		PyObject *ptext_no_unicode = PyUnicode_AsEncodedString(ptext_str,"utf-8", "Error");
 		char *error_line = PyBytes_AsString(ptext_no_unicode);  // Line in error
@@ -490,3 +1029,188 @@ Py_ssize_t pos = 0;
 		}
 	}
 }
+
+/**
+ * Create the readings from a DICT returned by the script, following the
+ * object policy rules regarding collapsing and creating multiple readings.
+ * Must be called with the interpreter lock held.
+ *
+ * @param pDict		The DICT returned by the script
+ * @param asset		The asset name for the reading
+ * @param policy	The object policy
+ * @param readings	The vector to which readings are appended
+ */
+void PythonScript::createReadings(PyObject *pDict, const string& asset, const ObjectPolicy& policy,
+		vector<Reading *>& readings)
+{
+	Scratch<Datapoint *> points(m_pool);
+	UserTimestamp ts;
+
+	if (policy.getPolicy() == ObjectPolicy::Multiple)
+	{
+		PyObject *key = NULL;
+		PyObject *value = NULL;
+		Py_ssize_t pos = 0;
+
+		while (PyDict_Next(pDict, &pos, &key, &value))
+		{
+			if (PyDict_Check(value))
+			{
+				const char *name = PyUnicode_Check(key) ?
+					PyUnicode_AsUTF8(key)
+					: PyBytes_AsString(key);
+				Scratch<Datapoint *> children(m_pool);
+				UserTimestamp child_ts;
+				getValues(value, policy, *children, true, child_ts);
+				if (children->size() > 0)
+				{
+					Reading *reading = new Reading(name, *children);
+					if (child_ts.set)
+						reading->setUserTimestamp(child_ts.tv);
+					readings.push_back(reading);
+				}
+			}
+			else
+			{
+				addValue(key, value, policy, *points, false, ts);
+			}
+		}
+	}
+	else
+	{
+		getValues(pDict, policy, *points, policy.getPolicy() == ObjectPolicy::Collapse, ts);
+	}
+
+	if (points->size() > 0)
+	{
+		Reading *reading = new Reading(asset, *points);
+		if (ts.set)
+			reading->setUserTimestamp(ts.tv);
+		readings.push_back(reading);
+	}
+}
+
+/**
+ * Get the datapoints from the current level of a DICT. If the recurse
+ * flag is set child DICTs are also processed, either being nested or
+ * collapsed into the current level depending upon the object policy.
+ *
+ * @param pDict		The DICT to iterate over
+ * @param policy	The object policy
+ * @param points	The datapoint array
+ * @param recurse	Recurse to nested DICTs
+ * @param user_ts	Set to the converted timestamp if one is found
+ */
+void PythonScript::getValues(PyObject *pDict, const ObjectPolicy& policy, vector<Datapoint *>& points,
+		bool recurse, UserTimestamp& user_ts)
+{
+PyObject *key = NULL;
+PyObject *value = NULL;
+Py_ssize_t pos = 0;
+
+	while (PyDict_Next(pDict, &pos, &key, &value))
+	{
+		addValue(key, value, policy, points, recurse, user_ts);
+	}
+}
+
+/**
+ * Add a single DICT entry to the datapoint array
+ *
+ * @param key		The DICT key
+ * @param value		The DICT value
+ * @param policy	The object policy
+ * @param points	The datapoint array
+ * @param recurse	Recurse to nested DICTs
+ * @param user_ts	Set to the converted timestamp if the entry is the timestamp
+ */
+void PythonScript::addValue(PyObject *key, PyObject *value, const ObjectPolicy& policy,
+		vector<Datapoint *>& points, bool recurse, UserTimestamp& user_ts)
+{
+	const char *name = PyUnicode_Check(key) ?
+		PyUnicode_AsUTF8(key)
+		: PyBytes_AsString(key);
+	if (!name)
+	{
+		PyErr_Clear();
+		return;
+	}
+
+	if (policy.isTimestamp(name))
+	{
+		if (PyUnicode_Check(value))
+		{
+			const char *ts = PyUnicode_AsUTF8(value);
+			if (ts)
+				policy.convertTimestamp(ts, user_ts);
+			else
+				PyErr_Clear();
+		}
+		else if (PyLong_Check(value))
+		{
+			int overflow;
+			long long ts = PyLong_AsLongLongAndOverflow(value, &overflow);
+			if (overflow == 0 && !PyErr_Occurred())
+				policy.convertTimestamp((int64_t)ts, user_ts);
+			else
+				PyErr_Clear();
+		}
+		else if (PyFloat_Check(value))
+		{
+			policy.convertTimestamp(PyFloat_AS_DOUBLE(value), user_ts);
+		}
+	}
+	else if (PyLong_Check(value))
+	{
+		DatapointValue dpv((long)PyLong_AsLong(value));
+		points.push_back(new Datapoint(name, dpv));
+	}
+	else if (PyFloat_Check(value))
+	{
+		DatapointValue dpv(PyFloat_AS_DOUBLE(value));
+		points.push_back(new Datapoint(name, dpv));
+	}
+	else if (PyBytes_Check(value))
+	{
+		DatapointValue dpv(string(PyBytes_AS_STRING(value), PyBytes_GET_SIZE(value)));
+		points.push_back(new Datapoint(name, dpv));
+	}
+	else if (PyUnicode_Check(value))
+	{
+		Py_ssize_t len;
+		const char *str = PyUnicode_AsUTF8AndSize(value, &len);
+		if (str)
+		{
+			DatapointValue dpv(string(str, len));
+			points.push_back(new Datapoint(name, dpv));
+		}
+		else
+		{
+			PyErr_Clear();
+		}
+	}
+	else if (PyDict_Check(value))
+	{
+		if (!recurse)
+		{
+			return;
+		}
+		if (policy.nest())
+		{
+			vector<Datapoint *> *children = new vector<Datapoint *>;
+			UserTimestamp ts;
+			getValues(value, policy, *children, true, ts);
+			DatapointValue dpv(children, true);
+			points.push_back(new Datapoint(name, dpv));
+		}
+		else
+		{
+			UserTimestamp ts;
+			getValues(value, policy, points, true, ts);
+		}
+	}
+	else
+	{
+		m_logger->error("Not adding data for '%s', unable to map type", name);
+	}
+}
@@ -8,39 +8,44 @@
  * Author: Mark Riddoch           
  */
 #include "scripted.h"
+#include <shared_subscription.h>
 #include <logger.h>
 #include <rapidjson/document.h>
-#include "MQTTClient.h"
+#include "MQTTAsync.h"
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <time.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <utils.h>
+#include <fstream>
 
-#define TIMEOUT     10000L
+#define DISCONNECT_TIMEOUT	10000	// Time in milliseconds allowed for a disconnect to complete
 
 using namespace std;
 using namespace rapidjson;
 
 /**
  * Callback when an MQTT message arrives for the topic to which we are subscribed
+ *
+ * The message is placed on the ingress queue for processing by the processing
+ * thread, ownership of the message and topic name passes to the queue. No
+ * conversion work is done on the MQTT client library thread.
  */
-int msgarrvd(void *context, char *topicName, int topicLen, MQTTClient_message *message)
+int msgarrvd(void *context, char *topicName, int topicLen, MQTTAsync_message *message)
 {
-int i;
-char *payloadptr;
-
-	payloadptr = (char *)message->payload;
-	char *buf = (char *)malloc(message->payloadlen + 1);
-	for(i = 0; i < message->payloadlen; i++)
+	ClientContext *client = (ClientContext *)context;
+	MQTTScripted *mqtt = client->plugin;
+	if (!mqtt->acceptMessage(client, topicName, topicLen, message)
+			|| !mqtt->queueMessage(topicName, topicLen, message))
 	{
-        	buf[i] = (*payloadptr++);
+		// A duplicate received whilst the client is being replaced, or
+		// the plugin is shutting down or flow control has discarded it
+		MQTTAsync_freeMessage(&message);
+		MQTTAsync_free(topicName);
 	}
-	buf[message->payloadlen] = 0;
-	MQTTClient_freeMessage(&message);
-	MQTTScripted *mqtt = (MQTTScripted *)context;
-	mqtt->processMessage(topicName, buf);
-	MQTTClient_free(topicName);
-	free(buf);
 	return 1;
 }
 
@@ -48,9 +53,64 @@ char *payloadptr;
  * Callback for when the connection to the MQTT server fails
  */
 void connlost(void *context, char *cause)
+{
+	ClientContext *client = (ClientContext *)context;
+	client->plugin->reconnection(client);
+}
+
+/**
+ * Callback when a connection attempt succeeds
+ */
+void onConnect(void *context, MQTTAsync_successData *response)
+{
+	MQTTScripted *mqtt = (MQTTScripted *)context;
+	mqtt->connected(response && response->alt.connect.sessionPresent);
+}
+
+/**
+ * Callback when a connection attempt fails
+ */
+void onConnectFailure(void *context, MQTTAsync_failureData *response)
+{
+	MQTTScripted *mqtt = (MQTTScripted *)context;
+	mqtt->connectFailed(response ? response->code : MQTTASYNC_FAILURE,
+			response ? response->message : NULL);
+}
+
+/**
+ * Callback when the broker has acknowledged the subscriptions
+ */
+void onSubscribe(void *context, MQTTAsync_successData *response)
+{
+	MQTTScripted *mqtt = (MQTTScripted *)context;
+	mqtt->subscribed(response);
+}
+
+/**
+ * Callback when the subscribe request fails
+ */
+void onSubscribeFailure(void *context, MQTTAsync_failureData *response)
+{
+	MQTTScripted *mqtt = (MQTTScripted *)context;
+	mqtt->subscribeFailed(response ? response->code : MQTTASYNC_FAILURE);
+}
+
+/**
+ * Callback when a disconnect has completed
+ */
+void onDisconnect(void *context, MQTTAsync_successData *response)
 {
 	MQTTScripted *mqtt = (MQTTScripted *)context;
-	mqtt->reconnection();
+	mqtt->disconnected();
+}
+
+/**
+ * Callback when a disconnect fails
+ */
+void onDisconnectFailure(void *context, MQTTAsync_failureData *response)
+{
+	MQTTScripted *mqtt = (MQTTScripted *)context;
+	mqtt->disconnected();
 }
 
 /**
@@ -73,15 +133,46 @@ void reconnect_thread(MQTTScripted *mqtt)
 	mqtt->reconnectRetry();
 }
 
+/**
+ * Thread entry point for the threads that process the messages
+ * that are placed on the ingress queue
+ */
+void process_thread(MQTTScripted *mqtt, unsigned int worker)
+{
+	mqtt->processQueue(worker);
+}
+
+/**
+ * Thread entry point for the thread that loads and validates the script
+ * following a change to the script
+ */
+void script_loader_thread(MQTTScripted *mqtt)
+{
+	mqtt->scriptLoader();
+}
+
 /**
  * Construct an MQTT Scripted south plugin
  *
  * @param config	The configuration category
  */
-MQTTScripted::MQTTScripted(ConfigCategory *config) : m_python(NULL), m_restart(false), m_state(mFailed), m_reconnectThread(NULL), m_reap(false), m_connectFailTime(0)
+MQTTScripted::MQTTScripted(ConfigCategory *config) : m_ingest(NULL), m_ingestMany(NULL),
+	m_retiring(NULL), m_clientContext(0), m_activeClient(0), m_overlap(false), m_clientPersistent(false), m_clientShared(false),
+	m_loaderThread(NULL), m_loaderStopping(false), m_preparedGeneration(0),
+	m_scriptGeneration(0), m_state(mFailed),
+	m_connectPending(false), m_disconnectPending(false), m_connectError(MQTTASYNC_SUCCESS),
+	m_connectionLost(false), m_restart(false), m_stopping(false), m_paused(false),
+	m_persistent(false), m_replaying(false), m_replayed(0),
+	m_reconnectThread(NULL), m_reap(false), m_connectFailTime(0),
+	m_statsTime(0), m_reportedHighWater(0), m_latencyReading(false)
 {
 	m_name = config->getName();
 	m_logger = Logger::getLogger();
+	for (int i = 0; i < 2; i++)
+	{
+		m_contexts[i].plugin = this;
+		m_contexts[i].index = i;
+	}
 	m_asset = config->getValue("asset");
 	m_broker = config->getValue("broker");
 	m_topic = config->getValue("topic");
@@ -91,30 +182,78 @@ MQTTScripted::MQTTScripted(ConfigCategory *config) : m_python(NULL), m_restart(f
 	m_serverCert = config->getValue("serverCert");
 	m_username = config->getValue("username");
 	m_password = config->getValue("password");
-	string policy = config->getValue("policy");
-	processPolicy(policy);
-	m_timestamp = config->getValue("timestamp");
-	m_timeFormat = config->getValue("format");
-	string timezone = config->getValue("timezone");
-	m_offset = strtol(timezone.c_str(), NULL, 10);
-	m_offset *= 60 * 60;
-	long num;
-	auto res = timezone.find_first_of(':');
-	if (res |= string::npos)
-	{
-		string mins = timezone.substr(res + 1);
-		num = strtol(mins.c_str(), NULL, 10);
-		num *= 60;
-		m_offset += num;
-	}
+	m_policy = make_shared<ObjectPolicy>(config->getValue("policy"), config->getValue("timestamp"),
+				config->getValue("format"), config->getValue("timezone"));
+	setPayloadType(*config);
+	setJsonParser(*config);
 	m_script = config->getItemAttribute("script", ConfigCategory::FILE_ATTR);
 	m_content = config->getValue("script");
-	m_clientID = config->getName();
+	m_subscriptions = make_shared<Subscriptions>(*config, m_policy, primaryScript());
+	m_subscriptions->getTopics(m_topics);
+	setMaxInflight(*config);
+	setPersistence(*config);
+	setSharedGroup(*config);
+	setReconfigureMode(*config);
+	m_clientID = clientID();
 	m_qos = 1;
-	m_python = new PythonScript(m_name);
-	if (m_python && m_script.empty() == false && m_content.empty() == false)
+	long depth = DEFAULT_QUEUE_DEPTH;
+	if (config->itemExists("queueDepth"))
+	{
+		depth = strtol(config->getValue("queueDepth").c_str(), NULL, 10);
+		if (depth <= 0)
+		{
+			m_logger->warn("Invalid queue depth %ld, using default of %d", depth, DEFAULT_QUEUE_DEPTH);
+			depth = DEFAULT_QUEUE_DEPTH;
+		}
+	}
+	m_queue = new IngressQueue(depth);
+	m_spillSize = 0;
+	if (config->itemExists("spillSize"))
+	{
+		m_spillSize = strtol(config->getValue("spillSize").c_str(), NULL, 10);
+	}
+	if (m_spillSize > 0)
+	{
+		string dir = stateDirectory();
+		if (dir.empty() || !m_queue->spill(dir + "/spill", (size_t)m_spillSize * 1024 * 1024))
+		{
+			m_logger->error("The spill buffer could not be created, messages will only be queued in memory");
+		}
+	}
+	setBatching(*config);
+	setFlowControl(*config);
+	setStageTimers(*config);
+	setCapture(*config);
+	setValidation(*config);
+	long workers = 1;
+	if (config->itemExists("workers"))
+	{
+		workers = strtol(config->getValue("workers").c_str(), NULL, 10);
+		if (workers < 1)
+		{
+			m_logger->warn("Invalid number of script workers %ld, a single worker will be used", workers);
+			workers = 1;
+		}
+		else if (workers > 1 && !PythonScript::parallelSupported())
+		{
+			m_logger->warn("Parallel script execution requires Python 3.12 or later, a single worker will be used");
+			workers = 1;
+		}
+	}
+	// The first worker uses the main interpreter, any others are
+	// given a sub-interpreter each so they may run in parallel
+	for (long i = 0; i < workers; i++)
 	{
-		m_python->setScript(m_script);
+		PythonScript *python = new PythonScript(m_name, i > 0);
+		if (m_script.empty() == false && m_content.empty() == false)
+		{
+			python->setScript(m_script);
+		}
+		m_pythons.push_back(python);
+		m_candidates.push_back(NULL);
+		m_subscriptionScripts.push_back(ScriptCache());
+		m_subscriptionCandidates.push_back(ScriptCache());
+		m_jsonParsers.push_back(new OnDemandParser());
 	}
 }
 
@@ -125,77 +264,69 @@ MQTTScripted::~MQTTScripted()
 {
 	lock_guard<mutex> guard(m_mutex);
 
-	if (m_python)
-	{
-		delete m_python;
-	}
-}
-
-/**
- * Process the policy string
- *
- * @param policy	The required policy
- */
-void MQTTScripted::processPolicy(const string& policy)
-{
-	if (policy.compare("Single reading from root level") == 0)
+	// The subscription scripts and the scripts loaded to replace the
+	// worker scripts use the interpreters of the worker scripts and
+	// must be destroyed first
+	for (auto python : m_candidates)
 	{
-		m_policy = mPolicyFirstLevel;
-		m_nest = false;
+		delete python;
 	}
-	else if (policy.compare("Single reading & collapse") == 0)
+	for (auto python : m_replacedScripts)
 	{
-		m_policy = mPolicyCollapse;
-		m_nest = false;
+		delete python;
 	}
-	else if (policy.compare("Single reading & nest") == 0)
+	for (auto& scripts : m_subscriptionScripts)
 	{
-		m_policy = mPolicyCollapse;
-		m_nest = true;
+		for (auto& script : scripts)
+		{
+			delete script.second;
+		}
 	}
-	else if (policy.compare("Multiple readings & collapse") == 0)
+	for (auto& scripts : m_subscriptionCandidates)
 	{
-		m_policy = mPolicyMultiple;
-		m_nest = false;
+		for (auto& script : scripts)
+		{
+			delete script.second;
+		}
 	}
-	else if (policy.compare("Multiple readings & nest") == 0)
+	for (auto python : m_pythons)
 	{
-		m_policy = mPolicyMultiple;
-		m_nest = true;
+		delete python;
 	}
-	else
+	for (auto parser : m_jsonParsers)
 	{
-		m_logger->error("Unsupported value for policy configuration '%s'", policy.c_str());
+		delete parser;
 	}
+	delete m_queue;
 }
 
 /**
  * Wrapper that is used to collect trace messages from the MQTT Client library and
  * add them to the logging system of FogLAMP.
  */
-void traceCallback(enum MQTTCLIENT_TRACE_LEVELS level, char* message)
+void traceCallback(enum MQTTASYNC_TRACE_LEVELS level, char* message)
 {
     switch (level) 
 	{
-        case MQTTCLIENT_TRACE_MAXIMUM:
-        case MQTTCLIENT_TRACE_MEDIUM:
-        case MQTTCLIENT_TRACE_MINIMUM:
+        case MQTTASYNC_TRACE_MAXIMUM:
+        case MQTTASYNC_TRACE_MEDIUM:
+        case MQTTASYNC_TRACE_MINIMUM:
             // Ignored: These log levels are not useful for plugin purposes
             break;
 
-        case MQTTCLIENT_TRACE_PROTOCOL:
+        case MQTTASYNC_TRACE_PROTOCOL:
             Logger::getLogger()->debug("Protocol Trace: %s", message);
             break;
 
-        case MQTTCLIENT_TRACE_ERROR:
+        case MQTTASYNC_TRACE_ERROR:
             Logger::getLogger()->error("Error Trace: %s", message);
             break;
 
-        case MQTTCLIENT_TRACE_SEVERE:
+        case MQTTASYNC_TRACE_SEVERE:
             Logger::getLogger()->fatal("Severe Trace: %s", message);
             break;
 
-        case MQTTCLIENT_TRACE_FATAL:
+        case MQTTASYNC_TRACE_FATAL:
             Logger::getLogger()->fatal("Fatal Trace: %s", message);
             break;
 
@@ -207,33 +338,48 @@ void traceCallback(enum MQTTCLIENT_TRACE_LEVELS level, char* message)
 
 /**
  * Called when the plugin is started
- * 
- * This will connect to the MQTT broker and subscribe to the
- * requested topic.
+ *
+ * This will create the MQTT client and start a background thread that
+ * connects to the broker and subscribes to the requested topics.
  */
 bool MQTTScripted::start()
 {
-	lock_guard<mutex> guard(m_mutex);
-	int rc;
-
-	if ((rc = MQTTClient_create(&m_client, m_broker.c_str(), m_clientID.c_str(),
-		MQTTCLIENT_PERSISTENCE_NONE, NULL)) != MQTTCLIENT_SUCCESS)
 	{
-		m_logger->fatal("Failed to create MQTT client, MQTT reports %s\n", MQTTClient_strerror(rc));
-		m_state = mFailed;
-		return false;
-	}
-
-	m_state = mCreated;
+		lock_guard<mutex> guard(m_connectionMutex);
+		m_stopping = false;
 
-	MQTTClient_setTraceCallback(traceCallback);
-	MQTTClient_setTraceLevel(MQTTCLIENT_TRACE_PROTOCOL);
+		MQTTAsync_setTraceCallback(traceCallback);
+		MQTTAsync_setTraceLevel(MQTTASYNC_TRACE_PROTOCOL);
 
-	MQTTClient_setCallbacks(m_client, this, connlost, msgarrvd, NULL);
+		if (!createClient())
+		{
+			m_logger->fatal("Failed to create MQTT client for broker %s", m_broker.c_str());
+			return false;
+		}
+	}
 
+	// Start the threads that process the messages from the ingress queue
+	m_queue->restart();
+	m_flow.restart();
+	if (m_processThreads.empty())
+	{
+		for (unsigned int i = 0; i < m_pythons.size(); i++)
+		{
+			m_processThreads.push_back(new thread(&process_thread, this, i));
+		}
+	}
+	if (!m_loaderThread)
+	{
+		{
+			lock_guard<mutex> guard(m_mutex);
+			m_loaderStopping = false;
+		}
+		m_loaderThread = new thread(&script_loader_thread, this);
+	}
 
 	// Do the actual connection in the background to prevent the
 	// service becoming unresponsive if the broker is not reachable
+	lock_guard<mutex> guard(m_connectionMutex);
 	backgroundReconnect();
 
 	return true;
@@ -245,36 +391,296 @@ bool MQTTScripted::start()
  */
 void MQTTScripted::stop()
 {
-	lock_guard<mutex> guard(m_mutex);
-int rc;
+	thread *reconnectThread;
+	{
+		lock_guard<mutex> guard(m_connectionMutex);
+		m_stopping = true;
+		reconnectThread = m_reconnectThread;
+		m_reconnectThread = NULL;
+		m_reap = false;
+	}
+	m_connectionCond.notify_all();
+	m_flow.shutdown();	// Release a message arrival callback waiting for pressure to ease
+	if (reconnectThread)
+	{
+		reconnectThread->join();
+		delete reconnectThread;
+	}
+
+	{
+		unique_lock<mutex> lck(m_connectionMutex);
+		destroyClient(lck);
+	}
+
+	// Drain the ingress queue and wait for the processing threads to
+	// terminate. This must be done without holding the mutex as the
+	// processing threads require it to process the queued messages.
+	// Messages in the spill buffer are left to be processed on restart.
+	m_queue->shutdown();
+	for (auto processThread : m_processThreads)
+	{
+		processThread->join();
+		delete processThread;
+	}
+	m_processThreads.clear();
+	{
+		// Send any readings left in a partial batch by messages that
+		// were processed outside of the processing threads
+		lock_guard<mutex> guard(m_mutex);
+		flushBatch();
+	}
+	QueueStatistics stats;
+	m_queue->getStatistics(stats);
+	if (stats.spillEntries)
+	{
+		m_logger->info("%lu messages remain in the spill buffer, they will be processed when the service restarts",
+				stats.spillEntries);
+	}
+
+	// A script that is being loaded is loaded before the thread exits,
+	// it will replace the running script if the plugin is restarted
+	{
+		lock_guard<mutex> guard(m_mutex);
+		m_loaderStopping = true;
+	}
+	m_loaderCond.notify_all();
+	if (m_loaderThread)
+	{
+		m_loaderThread->join();
+		delete m_loaderThread;
+		m_loaderThread = NULL;
+	}
+	reportQueueStatistics(true);
+	return;
+}
+
+/**
+ * Create the MQTT client. Must be called holding the connection mutex.
+ *
+ * @return bool	True if the client was created
+ */
+bool MQTTScripted::createClient()
+{
+	int rc;
+
+	if (m_retiring && m_clientID.compare(m_retiringID) == 0)
+	{
+		// The broker disconnects an existing client with the same client ID
+		m_clientID += ALTERNATE_ID_SUFFIX;
+	}
+	m_logger->debug("Create MQTT Client '%s' with clientID '%s'", m_broker.c_str(), m_clientID.c_str());
+	if (m_persistent)
+	{
+		// In flight messages are kept in files so they survive a restart
+		rc = MQTTAsync_create(&m_client, m_broker.c_str(), m_clientID.c_str(),
+			MQTTCLIENT_PERSISTENCE_DEFAULT, (void *)m_persistenceDir.c_str());
+	}
+	else
+	{
+		rc = MQTTAsync_create(&m_client, m_broker.c_str(), m_clientID.c_str(),
+			MQTTCLIENT_PERSISTENCE_NONE, NULL);
+	}
+	if (rc != MQTTASYNC_SUCCESS)
+	{
+		m_logger->error("Failed to create MQTT client, MQTT reports %s", MQTTAsync_strerror(rc));
+		m_state = mFailed;
+		return false;
+	}
+	// A replacement client only feeds the pipeline once it has
+	// subscribed, until then the retiring client continues to do so
+	m_clientContext = m_retiring ? 1 - m_activeClient : (int)m_activeClient;
+	MQTTAsync_setCallbacks(m_client, &m_contexts[m_clientContext], connlost, msgarrvd, NULL);
+	m_clientPersistent = m_persistent;
+	m_clientShared = !m_sharedGroup.empty();
+	m_state = mCreated;
+	return true;
+}
 
+/**
+ * Disconnect from the broker, if connected, and destroy the MQTT client.
+ * The connection mutex is released whilst waiting for the disconnect
+ * to complete.
+ *
+ * @param lck	The lock held on the connection mutex
+ */
+void MQTTScripted::destroyClient(unique_lock<mutex>& lck)
+{
 	if (m_state == mConnected)
 	{
-		if ((rc = MQTTClient_disconnect(m_client, 10000)) != MQTTCLIENT_SUCCESS)
-			m_logger->error("Failed to disconnect, MQTT reports %s", MQTTClient_strerror(rc));
+		disconnectClient(lck, m_client);
 	}
-	if (m_state == mConnected || m_state == mCreated)
+	if (m_state != mFailed)
 	{
-		MQTTClient_destroy(&m_client);
+		MQTTAsync_destroy(&m_client);
 	}
 	m_state = mFailed;
-	return;
+	m_connectPending = false;
+	if (m_retiring)
+	{
+		// The replacement was abandoned, the retiring client is
+		// also destroyed
+		retireClient(lck);
+	}
+}
+
+/**
+ * Disconnect a client from the broker. The disconnect allows the
+ * exchanges for messages in flight to complete, the connection mutex is
+ * released whilst waiting for the disconnect to complete.
+ *
+ * @param lck		The lock held on the connection mutex
+ * @param client	The client to disconnect
+ */
+void MQTTScripted::disconnectClient(unique_lock<mutex>& lck, MQTTAsync client)
+{
+	int rc;
+
+	MQTTAsync_disconnectOptions disc_opts = MQTTAsync_disconnectOptions_initializer;
+	disc_opts.timeout = DISCONNECT_TIMEOUT;
+	disc_opts.onSuccess = onDisconnect;
+	disc_opts.onFailure = onDisconnectFailure;
+	disc_opts.context = this;
+	m_disconnectPending = true;
+	if ((rc = MQTTAsync_disconnect(client, &disc_opts)) == MQTTASYNC_SUCCESS)
+	{
+		m_connectionCond.wait_for(lck, chrono::milliseconds(2 * DISCONNECT_TIMEOUT),
+				[this] { return !m_disconnectPending; });
+	}
+	else
+	{
+		m_logger->error("Failed to disconnect, MQTT reports %s", MQTTAsync_strerror(rc));
+	}
+	m_disconnectPending = false;
+}
+
+/**
+ * Disconnect and destroy the client that has been replaced. The messages
+ * received on the client until the disconnect has completed, including
+ * those in flight, are queued unless they have also been received on
+ * the new client. Must be called holding the connection mutex.
+ *
+ * @param lck	The lock held on the connection mutex
+ */
+void MQTTScripted::retireClient(unique_lock<mutex>& lck)
+{
+	MQTTAsync client = m_retiring;
+	m_retiring = NULL;
+	m_activeClient = m_clientContext;
+	disconnectClient(lck, client);
+	MQTTAsync_destroy(&client);
+	// No more messages are received on the retired client
+	m_overlap.store(false, memory_order_release);
+	m_duplicates.clear();
+}
+
+/**
+ * Keep the current client connected whilst its replacement connects and
+ * subscribes, so there is no gap in the receipt of messages when the
+ * connection settings change. Not possible with a persistent session as
+ * the session belongs to a single client ID. Nor is it possible if either
+ * client is a member of a shared group, the broker gives each message
+ * to only one member of the group and the messages given to the client
+ * that is not active would be lost. Must be called holding the
+ * connection mutex.
+ *
+ * @return bool	True if the current client has been kept
+ */
+bool MQTTScripted::replaceClient()
+{
+	if (!m_makeBeforeBreak || m_state != mConnected || m_persistent || m_clientPersistent
+			|| !m_sharedGroup.empty() || m_clientShared)
+	{
+		return false;
+	}
+	m_duplicates.clear();
+	m_overlap.store(true, memory_order_release);
+	m_retiring = m_client;
+	m_retiringID = m_clientID;
+	m_client = NULL;
+	m_state = mFailed;
+	m_clientID = clientID();
+	return true;
+}
+
+/**
+ * Set how the connection to the broker is replaced when a reconfiguration
+ * changes the connection settings
+ *
+ * @param config	The configuration category
+ */
+void MQTTScripted::setReconfigureMode(const ConfigCategory& config)
+{
+	m_makeBeforeBreak = true;
+	if (config.itemExists("reconfigureMode"))
+	{
+		string mode = config.getValue("reconfigureMode");
+		if (mode.compare("Break before make") == 0)
+		{
+			m_makeBeforeBreak = false;
+		}
+		else if (mode.compare("Make before break"))
+		{
+			m_logger->error("Unsupported value for reconfigure mode '%s', make before break will be used",
+					mode.c_str());
+		}
+	}
 }
 
 /**
- * Reconnect to the MQTT broker on connection failure
+ * Attempt to connect to the MQTT broker. The connect request is issued
+ * and the connection mutex released whilst waiting for the outcome, the
+ * subscriptions are made once the connection has been established.
+ * Must be called holding the connection mutex.
  *
- * @return true if the reconnection succeeded
+ * @param lck	The lock held on the connection mutex
+ * @return true if the connection succeeded
  */
-bool MQTTScripted::reconnect()
+bool MQTTScripted::reconnect(unique_lock<mutex>& lck)
 {
 int rc;
 
-	lock_guard<mutex> guard(m_mutex);
+	if (m_restart)
+	{
+		// The connection settings have changed, start with a new client
+		m_restart = false;
+		if (m_retiring)
+		{
+			// A replacement is already in progress, the client that
+			// was to replace the retiring client is itself replaced
+			MQTTAsync retiring = m_retiring;
+			m_retiring = NULL;
+			destroyClient(lck);
+			m_retiring = retiring;
+			m_clientID = clientID();
+			// The next replacement uses the context of the client
+			// destroyed, its messages must not be matched
+			m_duplicates.clear();
+		}
+		else if (!replaceClient())
+		{
+			destroyClient(lck);
+			m_clientID = clientID();
+		}
+	}
+	if (m_state == mConnected)
+	{
+		return true;
+	}
+	if (m_state == mFailed && !createClient())
+	{
+		return false;
+	}
 
-	MQTTClient_connectOptions conn_opts = MQTTClient_connectOptions_initializer;
-	conn_opts.keepAliveInterval = 20;
-	conn_opts.cleansession = 1;
+	MQTTAsync_connectOptions conn_opts = MQTTAsync_connectOptions_initializer;
+	conn_opts.keepAliveInterval = KEEP_ALIVE_INTERVAL;
+	// Resume the session held by the broker unless the topics have
+	// changed, in which case the old subscriptions must be discarded
+	conn_opts.cleansession = m_persistent && sameSessionTopics() ? 0 : 1;
+	conn_opts.maxInflight = m_maxInflight;
+	conn_opts.connectTimeout = CONNECT_TIMEOUT;
+	conn_opts.onSuccess = onConnect;
+	conn_opts.onFailure = onConnectFailure;
+	conn_opts.context = this;
 
 	if (m_username.length())
 	{
@@ -283,7 +689,7 @@ int rc;
 	}
 
 	// Do we need MQTTS support
-	MQTTClient_SSLOptions sslopts = MQTTClient_SSLOptions_initializer;
+	MQTTAsync_SSLOptions sslopts = MQTTAsync_SSLOptions_initializer;
 	if (m_serverCert.length())
 	{
 		string serverCert = serverCertPath();
@@ -310,26 +716,41 @@ int rc;
 
 		conn_opts.ssl = &sslopts;
 	}
-	rc = MQTTClient_connect(m_client, &conn_opts);
+	m_connectPending = true;
+	m_connectMessage.clear();
+	// The connect options are copied by the client library
+	rc = MQTTAsync_connect(m_client, &conn_opts);
 	if (sslopts.trustStore)
 		free((void *)sslopts.trustStore);
 	if (sslopts.keyStore)
 		free((void *)sslopts.keyStore);
 	if (sslopts.privateKey)
 		free((void *)sslopts.privateKey);
-	if (rc != MQTTCLIENT_SUCCESS)
+	if (rc == MQTTASYNC_SUCCESS)
+	{
+		m_connectionCond.wait_for(lck, chrono::seconds(2 * CONNECT_TIMEOUT),
+				[this] { return !m_connectPending || m_stopping; });
+		rc = m_connectPending ? MQTTASYNC_FAILURE : m_connectError;
+	}
+	m_connectPending = false;
+	if (m_stopping)
+	{
+		return false;
+	}
+	if (m_state != mConnected)
 	{
+		const char *reason = m_connectMessage.empty() ? MQTTAsync_strerror(rc) : m_connectMessage.c_str();
 		// We report the error the first time it occurs and then every
 		// CONNECT_ERROR_INTERVAL seconds until it clears. Once cleared
 		// we will report it immediately it re-occurs
 		if (m_connectFailTime == 0)
 		{
-			m_logger->error("Failed to connect to MQTT broker %s, MQTT reports %s. Check your configuration, the MQTT broker is running and contactable", m_broker.c_str(), MQTTClient_strerror(rc));
+			m_logger->error("Failed to connect to MQTT broker %s, MQTT reports %s. Check your configuration, the MQTT broker is running and contactable", m_broker.c_str(), reason);
 			m_connectFailTime = time(0) + CONNECT_ERROR_INTERVAL;
 		}
 		else if (m_connectFailTime < time(0))
 		{
-			m_logger->error("Still unable to connect to MQTT broker %s, MQTT reports %s", m_broker.c_str(), MQTTClient_strerror(rc));
+			m_logger->error("Still unable to connect to MQTT broker %s, MQTT reports %s", m_broker.c_str(), reason);
 			m_connectFailTime = time(0) + CONNECT_ERROR_INTERVAL;
 		}
 		return false;
@@ -337,221 +758,1773 @@ int rc;
 	else if (m_connectFailTime)
 	{
 		m_logger->warn("Reconnected to the MQTT broker %s, after a period of failed connection", m_broker.c_str());
-	}
-
-	m_state = mConnected;
-	// Subscribe to the topic
-	if ((rc = MQTTClient_subscribe(m_client, m_topic.c_str(), m_qos)) != MQTTCLIENT_SUCCESS)
-	{
-		m_logger->error("Failed to subscribe to topic ''%s', MQTT reports %s\n", m_topic.c_str(), MQTTClient_strerror(rc));
-		return false;
+		m_connectFailTime = 0;
 	}
 	return true;
 }
 
 /**
- * Reconfigure the MQTTScripted delivery plugin
+ * Called by the client library when a connection attempt succeeds.
+ * Subscribes to the topics and wakes the thread waiting for the
+ * connection.
  *
- * @param newConfig	The new configuration
+ * @param sessionPresent	The broker has resumed an existing session
  */
-void MQTTScripted::reconfigure(const ConfigCategory& category)
+void MQTTScripted::connected(bool sessionPresent)
 {
-	lock_guard<mutex> guard(m_mutex);
-
-	m_asset = category.getValue("asset");
-	string broker = category.getValue("broker");
-	bool resubscribe = false;
-	if (broker.compare(m_broker))
+	lock_guard<mutex> guard(m_connectionMutex);
+	if (!m_connectPending)
 	{
-		resubscribe = true;
+		// The attempt has been abandoned
+		return;
 	}
-	m_broker = broker;
-	string topic = category.getValue("topic");
-	if (topic.compare(m_topic))
+	if (m_persistent && sessionPresent)
 	{
-		resubscribe = true;
+		// The broker sends the messages it queued whilst we were
+		// disconnected before it acknowledges the subscriptions
+		m_replayed = 0;
+		m_replaying = true;
 	}
-	m_topic = topic;
+	m_state = mConnected;
+	m_connectError = MQTTASYNC_SUCCESS;
+	m_connectPending = false;
+	subscribe();
+	m_connectionCond.notify_all();
+}
 
-	string key = category.getValue("key");
-	if (key.compare(m_key))
+/**
+ * Called by the client library when a connection attempt fails
+ *
+ * @param code		The error code
+ * @param message	The error message, may be NULL
+ */
+void MQTTScripted::connectFailed(int code, const char *message)
+{
+	lock_guard<mutex> guard(m_connectionMutex);
+	if (!m_connectPending)
 	{
-		resubscribe = true;
+		return;
 	}
-	m_key = key;
-
-	string clientCert = category.getValue("clientCert");
-	if (clientCert.compare(m_clientCert))
+	m_connectError = code;
+	if (message)
 	{
-		resubscribe = true;
+		m_connectMessage = message;
 	}
-	m_clientCert = clientCert;
+	m_connectPending = false;
+	m_connectionCond.notify_all();
+}
 
-	string keyPass = category.getValue("keyPass");
-	if (keyPass.compare(m_keyPass))
-	{
-		resubscribe = true;
+/**
+ * Called by the client library when a disconnect completes
+ */
+void MQTTScripted::disconnected()
+{
+	lock_guard<mutex> guard(m_connectionMutex);
+	m_disconnectPending = false;
+	m_connectionCond.notify_all();
+}
+
+/**
+ * Called when the connection to the broker is lost, starts a background
+ * thread to reconnect
+ */
+void MQTTScripted::reconnection(const ClientContext *context)
+{
+	lock_guard<mutex> guard(m_connectionMutex);
+	if (m_retiring && context->index != m_clientContext)
+	{
+		// The client being replaced, messages are received again
+		// once the replacement has subscribed
+		m_logger->warn("The connection being replaced has been lost");
+		return;
+	}
+	if (m_state == mConnected)
+	{
+		m_state = mCreated;
+		m_connectionLost = true;
+	}
+	backgroundReconnect();
+}
+
+/**
+ * Subscribe to the topics of all of the subscriptions in a single
+ * request to the broker. The outcome is reported to the subscribed
+ * and subscribeFailed methods. Must be called holding the connection
+ * mutex.
+ *
+ * @return bool	True if the subscribe request was sent
+ */
+bool MQTTScripted::subscribe()
+{
+	int count = m_topics.size();
+	vector<string> filters = SharedSubscription::topics(m_sharedGroup, m_topics);
+	vector<char *> topics;
+	vector<int> qos(count, m_qos);
+	for (int i = 0; i < count; i++)
+	{
+		topics.push_back((char *)filters[i].c_str());
+	}
+
+	MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+	opts.onSuccess = onSubscribe;
+	opts.onFailure = onSubscribeFailure;
+	opts.context = this;
+	int rc;
+	if ((rc = MQTTAsync_subscribeMany(m_client, count, topics.data(), qos.data(), &opts)) != MQTTASYNC_SUCCESS)
+	{
+		m_logger->error("Failed to subscribe to %d topics, MQTT reports %s", count, MQTTAsync_strerror(rc));
+		return false;
+	}
+	m_subscribedTopics = filters;
+	return true;
+}
+
+/**
+ * Called by the client library when the broker acknowledges the
+ * subscriptions
+ *
+ * @param response	The response, containing the granted QoS of each topic
+ */
+void MQTTScripted::subscribed(MQTTAsync_successData *response)
+{
+	lock_guard<mutex> guard(m_connectionMutex);
+	size_t count = m_subscribedTopics.size();
+	for (size_t i = 0; i < count; i++)
+	{
+		// The granted QoS is 0x80 if the broker refused the subscription
+		int qos = m_qos;
+		if (response)
+		{
+			qos = count == 1 ? response->alt.qos : response->alt.qosList[i];
+		}
+		if (qos == 0x80)
+		{
+			m_logger->error("The broker refused the subscription to topic '%s'", m_subscribedTopics[i].c_str());
+		}
+		else
+		{
+			m_logger->info("Subscribed to topic '%s' with QoS %d", m_subscribedTopics[i].c_str(), qos);
+		}
+	}
+	if (m_replaying)
+	{
+		m_replaying = false;
+		m_logger->info("Resumed the persistent session, %lu messages queued by the broker were replayed",
+				(unsigned long)m_replayed);
+	}
+	if (m_persistent)
+	{
+		saveSessionTopics();
+	}
+	if (m_retiring)
+	{
+		// The replacement client now feeds the pipeline, the retiring
+		// client is torn down by the reconnection thread
+		m_activeClient = m_clientContext;
+		m_connectionCond.notify_all();
+	}
+}
+
+/**
+ * Called by the client library when the subscribe request fails
+ *
+ * @param code	The error code
+ */
+void MQTTScripted::subscribeFailed(int code)
+{
+	m_logger->error("Failed to subscribe to the topics, MQTT reports %s", MQTTAsync_strerror(code));
+	m_replaying = false;
+	lock_guard<mutex> guard(m_connectionMutex);
+	if (m_retiring)
+	{
+		// The new configuration is used even though the subscription
+		// failed, as is the case when the client is not replaced
+		m_activeClient = m_clientContext;
+		m_connectionCond.notify_all();
+	}
+}
+
+/**
+ * Set the use of a persistent session from the configuration. The
+ * directory used to store the state of the session is created if
+ * required, if it can not be created a clean session is used.
+ *
+ * @param config	The configuration category
+ */
+void MQTTScripted::setPersistence(const ConfigCategory& config)
+{
+	m_persistent = config.itemExists("persistentSession")
+			&& config.getValue("persistentSession").compare("true") == 0;
+	if (m_persistent)
+	{
+		m_persistenceDir = stateDirectory();
+		if (m_persistenceDir.empty())
+		{
+			m_logger->warn("A clean session will be used as the session can not be stored");
+			m_persistent = false;
+		}
+	}
+}
+
+/**
+ * Set the flow control policy and thresholds from the configuration
+ *
+ * @param config	The configuration category
+ */
+void MQTTScripted::setFlowControl(const ConfigCategory& config)
+{
+	FlowControl::Policy policy = FlowControl::Block;
+	if (config.itemExists("flowControl")
+			&& !FlowControl::parsePolicy(config.getValue("flowControl"), policy))
+	{
+		m_logger->error("Unknown flow control policy '%s', messages will be blocked under pressure",
+				config.getValue("flowControl").c_str());
+	}
+	int threshold = DEFAULT_PRESSURE_THRESHOLD;
+	if (config.itemExists("pressureThreshold"))
+	{
+		threshold = strtol(config.getValue("pressureThreshold").c_str(), NULL, 10);
+	}
+	long latency = DEFAULT_MAX_INGEST_LATENCY;
+	if (config.itemExists("maxIngestLatency"))
+	{
+		latency = strtol(config.getValue("maxIngestLatency").c_str(), NULL, 10);
+	}
+	if (policy == FlowControl::Pause && !m_persistent)
+	{
+		m_logger->warn("Flow control will pause without a persistent session, messages published whilst paused will be lost");
+	}
+	m_flow.configure(policy, threshold, latency);
+}
+
+/**
+ * Return the directory used to store the persistent session and spill
+ * buffer of the plugin, creating it if it does not exist
+ *
+ * @return string	The directory or an empty string if it could not be created
+ */
+string MQTTScripted::stateDirectory()
+{
+	string dir = getDataDir() + "/mqtt";
+	mkdir(dir.c_str(), 0755);
+	string name = m_name;
+	for (auto& c : name)
+	{
+		if (c == '/')
+			c = '_';
+	}
+	dir += "/" + name;
+	if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+	{
+		m_logger->error("Unable to create the directory %s: %s",
+				dir.c_str(), strerror(errno));
+		return "";
+	}
+	return dir;
+}
+
+/**
+ * Check if the topics subscribed to in the stored session are the
+ * topics the plugin will subscribe to. Must be called holding the
+ * connection mutex.
+ *
+ * @return bool	True if the topics are the same
+ */
+bool MQTTScripted::sameSessionTopics()
+{
+	vector<string> topics = SharedSubscription::topics(m_sharedGroup, m_topics);
+
+	ifstream in(m_persistenceDir + "/topics");
+	if (!in)
+	{
+		return false;
+	}
+	string line;
+	size_t count = 0;
+	while (getline(in, line))
+	{
+		if (count >= topics.size() || line.compare(topics[count]))
+		{
+			return false;
+		}
+		count++;
+	}
+	return count == topics.size();
+}
+
+/**
+ * Store the topics subscribed to in the session so that a change can
+ * be detected when the plugin next connects. Must be called holding
+ * the connection mutex.
+ */
+void MQTTScripted::saveSessionTopics()
+{
+	string path = m_persistenceDir + "/topics";
+	ofstream out(path, ios::trunc);
+	for (auto& topic : m_subscribedTopics)
+	{
+		out << topic << "\n";
+	}
+	if (!out)
+	{
+		m_logger->warn("Unable to store the session topics in %s", path.c_str());
+	}
+}
+
+/**
+ * Set the shared subscription group from the configuration. An invalid
+ * group name is reported and the subscriptions are not shared.
+ *
+ * @param config	The configuration category
+ */
+void MQTTScripted::setSharedGroup(const ConfigCategory& config)
+{
+	m_sharedGroup.clear();
+	if (config.itemExists("sharedGroup"))
+	{
+		string group = config.getValue("sharedGroup");
+		if (group.empty() || SharedSubscription::validGroup(group))
+			m_sharedGroup = group;
+		else
+			m_logger->error("The shared subscription group '%s' may not contain '/', '+' or '#', the subscriptions will not be shared",
+					group.c_str());
+	}
+}
+
+/**
+ * Return the client ID used to connect to the broker. The service name
+ * is used unless the plugin is a member of a shared subscription group,
+ * in which case each instance is given its own ID so that the members
+ * of the group do not disconnect each other.
+ *
+ * @return string	The client ID
+ */
+string MQTTScripted::clientID() const
+{
+	return SharedSubscription::clientID(m_name, m_sharedGroup, m_persistent ? m_persistenceDir : "");
+}
+
+/**
+ * Set the maximum number of messages in flight from the configuration
+ *
+ * @param config	The configuration category
+ */
+void MQTTScripted::setMaxInflight(const ConfigCategory& config)
+{
+	m_maxInflight = DEFAULT_MAX_INFLIGHT;
+	if (config.itemExists("maxInflight"))
+	{
+		long inflight = strtol(config.getValue("maxInflight").c_str(), NULL, 10);
+		if (inflight > 0)
+			m_maxInflight = inflight;
+		else
+			m_logger->warn("Invalid maximum in flight messages %ld, using default of %d", inflight, DEFAULT_MAX_INFLIGHT);
+	}
+}
+
+/**
+ * Return the script of the primary subscription
+ *
+ * @return string	The script file, or an empty string if there is no script
+ */
+string MQTTScripted::primaryScript() const
+{
+	if (m_script.compare("\"\"") == 0)
+	{
+		return "";
+	}
+	return m_script;
+}
+
+/**
+ * Reconfigure the MQTTScripted delivery plugin
+ *
+ * @param newConfig	The new configuration
+ */
+void MQTTScripted::reconfigure(const ConfigCategory& category)
+{
+	lock_guard<mutex> guard(m_mutex);
+	// The connection settings are protected by the connection mutex
+	lock_guard<mutex> connectionGuard(m_connectionMutex);
+
+	m_asset = category.getValue("asset");
+	string broker = category.getValue("broker");
+	bool resubscribe = false;
+	if (broker.compare(m_broker))
+	{
+		resubscribe = true;
+	}
+	m_broker = broker;
+	string topic = category.getValue("topic");
+	if (topic.compare(m_topic))
+	{
+		resubscribe = true;
+	}
+	m_topic = topic;
+
+	string key = category.getValue("key");
+	if (key.compare(m_key))
+	{
+		resubscribe = true;
+	}
+	m_key = key;
+
+	string clientCert = category.getValue("clientCert");
+	if (clientCert.compare(m_clientCert))
+	{
+		resubscribe = true;
+	}
+	m_clientCert = clientCert;
+
+	string keyPass = category.getValue("keyPass");
+	if (keyPass.compare(m_keyPass))
+	{
+		resubscribe = true;
+	}
+	m_keyPass = keyPass;
+
+	string serverCert = category.getValue("serverCert");
+	if (serverCert.compare(m_serverCert))
+	{
+		resubscribe = true;
+	}
+	m_serverCert = serverCert;
+
+	string username = category.getValue("username");
+	if (username.compare(m_username))
+	{
+		resubscribe = true;
+	}
+	m_username = username;
+
+	string password = category.getValue("password");
+	if (password.compare(m_password))
+	{
+		resubscribe = true;
+	}
+	m_password = password;
+
+	m_policy = make_shared<ObjectPolicy>(category.getValue("policy"), category.getValue("timestamp"),
+				category.getValue("format"), category.getValue("timezone"));
+	setPayloadType(category);
+	setJsonParser(category);
+	m_planCache.clear();	// The plans depend upon the policy
+
+	m_script = category.getItemAttribute("script", ConfigCategory::FILE_ATTR);
+	shared_ptr<Subscriptions> subscriptions = make_shared<Subscriptions>(category, m_policy, primaryScript());
+	if (!subscriptions->sameTopics(*m_subscriptions))
+	{
+		resubscribe = true;
+	}
+	m_subscriptions = subscriptions;
+	m_subscriptions->getTopics(m_topics);
+	m_loaderCond.notify_all();	// Load any changed subscription scripts
+
+	int maxInflight = m_maxInflight;
+	setMaxInflight(category);
+	if (maxInflight != m_maxInflight)
+	{
+		resubscribe = true;
+	}
+
+	bool persistent = m_persistent;
+	setPersistence(category);
+	if (persistent != m_persistent)
+	{
+		resubscribe = true;
+	}
+
+	setReconfigureMode(category);
+
+	string sharedGroup = m_sharedGroup;
+	setSharedGroup(category);
+	if (sharedGroup.compare(m_sharedGroup))
+	{
+		// Joining or leaving a group changes the client ID, the
+		// new client is given its ID when it is created
+		resubscribe = true;
+	}
+
+	setBatching(category);
+
+	if (category.itemExists("spillSize")
+			&& strtol(category.getValue("spillSize").c_str(), NULL, 10) != m_spillSize)
+	{
+		m_logger->warn("A change to the spill buffer size will take effect when the service is restarted");
+	}
+
+	setStageTimers(category);
+	setCapture(category);
+	setValidation(category);
+
+	// The new flow control settings start without pressure applied
+	setFlowControl(category);
+	if (m_paused)
+	{
+		m_paused = false;
+		m_connectionCond.notify_all();
+	}
+
+	if (category.itemExists("queueDepth"))
+	{
+		long depth = strtol(category.getValue("queueDepth").c_str(), NULL, 10);
+		if (depth > 0)
+		{
+			m_queue->resize(depth);
+		}
+		else
+		{
+			m_logger->warn("Invalid queue depth %ld, the queue depth has not been changed", depth);
+		}
+	}
+
+	if (resubscribe)
+	{
+		// The connection is replaced by the reconnection thread, the
+		// processing of messages is not blocked whilst it does so. If
+		// the current connection is kept until the new connection has
+		// subscribed there is no gap in the receipt of messages
+		m_logger->info("Resubscribing to MQTT broker %s following reconfiguration", m_broker.c_str());
+		m_restart = true;
+		backgroundReconnect();
+	}
+
+	string content = category.getValue("script");
+	if (m_content.compare(content))	// Script content has changed
+	{
+		m_logger->info("Reconfiguration has changed the Python script");
+		m_scriptGeneration++;
+		m_content = content;
+		m_loaderCond.notify_all();
+	}
+}
+
+/**
+ * Add the message removed from the ingress queue to the payloads to be
+ * processed, the payload takes ownership of the message
+ *
+ * @param payloads	The payloads to process
+ * @param entry		The entry removed from the queue
+ */
+static inline void addPayload(vector<MQTTPayload>& payloads, QueueEntry& entry)
+{
+	if (entry.message)
+	{
+		payloads.emplace_back(entry.topicName, entry.topicLen, entry.message);
+	}
+	else
+	{
+		// Read back from the spill buffer
+		payloads.emplace_back(entry.topicName, (size_t)entry.topicLen, entry.payloadLen);
+	}
+}
+
+/**
+ * Check if a message received from the broker should be queued. Whilst a
+ * client is being replaced both clients receive the messages, from the
+ * time the new client subscribes until the old client has disconnected.
+ * The messages of both clients are queued during this time, other than
+ * the second copy of a message received on both clients, so the messages
+ * in flight on the old client are not lost. Called on the MQTT client
+ * library thread.
+ *
+ * @param context	The context of the client the message was received on
+ * @param topicName	The topic the message was received on
+ * @param topicLen	The topic length as reported by the MQTT client library
+ * @param message	The MQTT message
+ * @return bool		False if the message should be discarded
+ */
+bool MQTTScripted::acceptMessage(const ClientContext *context, const char *topicName, int topicLen,
+		const MQTTAsync_message *message)
+{
+	if (!m_overlap.load(memory_order_acquire))
+	{
+		return activeClient(context);
+	}
+	size_t length = topicLen > 0 ? topicLen : strlen(topicName);
+	return !m_duplicates.duplicate(context->index, topicName, length, message->payload, message->payloadlen);
+}
+
+/**
+ * Place a message received from the broker on the ingress queue,
+ * applying the flow control policy if the ingest pipeline is under
+ * pressure. Called on the MQTT client library thread.
+ *
+ * @param topicName	The topic the message was received on
+ * @param topicLen	The topic length as reported by the MQTT client library
+ * @param message	The MQTT message
+ * @return bool		False if the message was not queued and should be discarded
+ */
+bool MQTTScripted::queueMessage(char *topicName, int topicLen, MQTTAsync_message *message)
+{
+	if (m_replaying)
+	{
+		m_replayed++;
+	}
+	if (m_flow.underPressure())
+	{
+		switch (m_flow.getPolicy())
+		{
+			case FlowControl::Block:
+				block();
+				break;
+			case FlowControl::Discard:
+				m_flow.discarded();
+				return false;
+			case FlowControl::Pause:
+				// Messages in flight when the pause began are kept
+				break;
+		}
+	}
+	if (!m_queue->push(topicName, topicLen, message))
+	{
+		return false;
+	}
+	flowUpdate();
+	return true;
+}
+
+/**
+ * Hold the MQTT client library thread in the message arrival callback
+ * until the pressure is released, so that no further messages are
+ * received. The message being delivered has already been acknowledged
+ * if it was sent with QoS 1, the broker stops sending once the QoS 1
+ * and QoS 2 messages in flight reach the maximum. Whilst the thread is
+ * held the keep alive can not be answered, rather than allow the broker
+ * to drop the connection the plugin falls back to pausing the
+ * connection after one keep alive interval.
+ */
+void MQTTScripted::block()
+{
+	{
+		lock_guard<mutex> guard(m_connectionMutex);
+		if (m_paused)
+		{
+			// Already fallen back to a pause
+			return;
+		}
+	}
+	long waited = 0;
+	while (!m_flow.wait(FLOW_CHECK_INTERVAL))
+	{
+		flowUpdate();
+		waited += FLOW_CHECK_INTERVAL;
+		if (waited >= KEEP_ALIVE_INTERVAL * 1000 && m_flow.underPressure())
+		{
+			m_logger->warn("Messages have been blocked for %d seconds, pausing the connection to the MQTT broker",
+					KEEP_ALIVE_INTERVAL);
+			lock_guard<mutex> guard(m_connectionMutex);
+			if (!m_paused)
+			{
+				m_paused = true;
+				backgroundReconnect();
+				m_connectionCond.notify_all();
+			}
+			return;
+		}
+	}
+}
+
+/**
+ * Report the occupancy of the ingress queue to the flow control
+ */
+void MQTTScripted::flowUpdate()
+{
+	size_t count, depth;
+	m_queue->occupancy(count, depth);
+	flowTransition(m_flow.queued(count, depth));
+}
+
+/**
+ * Act upon a change in the pressure on the ingest pipeline. May be
+ * called holding the mutex but not the connection mutex.
+ *
+ * @param transition	The change reported by the flow control
+ */
+void MQTTScripted::flowTransition(FlowControl::Transition transition)
+{
+	if (transition == FlowControl::Pressure)
+	{
+		FlowControl::Policy policy = m_flow.getPolicy();
+		m_logger->warn("Applying back pressure to the MQTT broker as %s, messages will be %s",
+				m_flow.getReason().c_str(),
+				policy == FlowControl::Block ? "blocked" :
+				policy == FlowControl::Pause ? "paused" : "discarded");
+		if (policy == FlowControl::Pause)
+		{
+			lock_guard<mutex> guard(m_connectionMutex);
+			m_paused = true;
+			backgroundReconnect();
+			m_connectionCond.notify_all();
+		}
+	}
+	else if (transition == FlowControl::Relieved)
+	{
+		unsigned long discarded = m_flow.getDiscarded();
+		if (discarded)
+		{
+			m_logger->warn("Back pressure released, %lu messages were discarded", discarded);
+		}
+		else
+		{
+			m_logger->info("Back pressure released");
+		}
+		lock_guard<mutex> guard(m_connectionMutex);
+		if (m_paused)
+		{
+			m_paused = false;
+			m_connectionCond.notify_all();
+		}
+	}
+}
+
+/**
+ * Process the messages placed on the ingress queue by the MQTT message
+ * arrival callback. This runs on one or more dedicated threads and returns
+ * once the queue has been shutdown and drained.
+ *
+ * @param worker	The index of the worker, used to select the script instance
+ */
+void MQTTScripted::processQueue(unsigned int worker)
+{
+	QueueEntry entry;
+	vector<MQTTPayload> payloads;
+
+	payloads.reserve(MAX_SCRIPT_BATCH);
+
+	while (true)
+	{
+		long timeout;
+		size_t batch;
+		{
+			lock_guard<mutex> guard(m_mutex);
+			timeout = batchTimeout();
+			batch = batchConvert(worker) ? MAX_SCRIPT_BATCH : 1;
+		}
+		if (m_queue->pop(entry, timeout))
+		{
+			// Collect any other messages that are already queued
+			// so they may be passed to the script in a single call,
+			// otherwise leave them for the other workers
+			addPayload(payloads, entry);
+			while (payloads.size() < batch && m_queue->pop(entry, 0))
+			{
+				addPayload(payloads, entry);
+			}
+			processMessages(payloads, worker);
+			payloads.clear();
+			flowUpdate();
+		}
+		else if (m_queue->drained())
+		{
+			break;
+		}
+		{
+			lock_guard<mutex> guard(m_mutex);
+			if (batchTimeout() == 0)
+			{
+				flushBatch();
+			}
+		}
+		if (worker == 0)
+		{
+			reportQueueStatistics(false);
+		}
+	}
+	lock_guard<mutex> guard(m_mutex);
+	flushBatch();
+}
+
+/**
+ * Report the ingress queue statistics. The statistics are reported
+ * periodically if the high water mark of the queue has increased since
+ * the last report.
+ *
+ * @param force	Report the statistics regardless of the interval
+ */
+void MQTTScripted::reportQueueStatistics(bool force)
+{
+	time_t now = time(0);
+	if (!force && now < m_statsTime)
+	{
+		return;
+	}
+	m_statsTime = now + QUEUE_STATS_INTERVAL;
+
+	QueueStatistics stats;
+	m_queue->getStatistics(stats);
+	if (force || stats.highWater > m_reportedHighWater)
+	{
+		m_logger->info("Ingress queue high water mark is %lu of %lu, %lu messages queued, longest queue time %.3f seconds",
+				stats.highWater, stats.depth, stats.queued, (double)stats.maxWait / 1000000);
+		m_reportedHighWater = stats.highWater;
+	}
+	if (stats.spillSize && (force || stats.spillEntries))
+	{
+		m_logger->info("Spill buffer holds %lu messages using %.1f of %.1f MB, %lu messages spilled",
+				stats.spillEntries, (double)stats.spillUsed / (1024 * 1024),
+				(double)stats.spillSize / (1024 * 1024), stats.spilled);
+	}
+	reportPoolStatistics(force);
+	reportStageTimers(!force);	// Readings can not be ingested once stopped
+}
+
+/**
+ * Report the latency of each stage of the processing of messages since
+ * the last report, if timing is enabled. The percentiles are logged and,
+ * if the latency reading is enabled, ingested as a reading so that they
+ * may be monitored over time.
+ *
+ * @param ingestReading	Ingest the percentiles as a reading, if enabled
+ */
+void MQTTScripted::reportStageTimers(bool ingestReading)
+{
+	if (!StageTimers::enabled())
+	{
+		return;
+	}
+	{
+		lock_guard<mutex> guard(m_mutex);
+		ingestReading = ingestReading && m_latencyReading;
+	}
+	vector<Datapoint *> points;
+	for (int i = 0; i < StageTimers::STAGES; i++)
+	{
+		StageTimers::Stage stage = (StageTimers::Stage)i;
+		LatencyHistogram::Summary summary;
+		StageTimers::collect(stage, summary, true);
+		if (summary.count == 0)
+		{
+			continue;
+		}
+		const char *name = StageTimers::name(stage);
+		m_logger->info("Latency of %s: %lu samples, p50 %.1fus, p99 %.1fus, p99.9 %.1fus, max %.1fus",
+				name, (unsigned long)summary.count, summary.p50 / 1000.0,
+				summary.p99 / 1000.0, summary.p999 / 1000.0, summary.max / 1000.0);
+		if (!ingestReading)
+		{
+			continue;
+		}
+		DatapointValue count((long)summary.count);
+		points.push_back(new Datapoint(string(name) + "_count", count));
+		DatapointValue p50(summary.p50 / 1000.0);
+		points.push_back(new Datapoint(string(name) + "_p50_us", p50));
+		DatapointValue p99(summary.p99 / 1000.0);
+		points.push_back(new Datapoint(string(name) + "_p99_us", p99));
+		DatapointValue p999(summary.p999 / 1000.0);
+		points.push_back(new Datapoint(string(name) + "_p999_us", p999));
+	}
+	if (points.empty())
+	{
+		return;
+	}
+	lock_guard<mutex> guard(m_mutex);
+	ingest(new Reading(m_name + LATENCY_ASSET_SUFFIX, points));
+}
+
+/**
+ * Enable the timing of the stages of processing from the configuration
+ *
+ * @param config	The configuration category
+ */
+void MQTTScripted::setStageTimers(const ConfigCategory& config)
+{
+	bool enabled = config.itemExists("stageTimers") && config.getValue("stageTimers").compare("true") == 0;
+	if (enabled && !StageTimers::compiled())
+	{
+		m_logger->warn("Latency statistics are not available in this build of the plugin");
+	}
+	StageTimers::setEnabled(enabled);
+	m_latencyReading = config.itemExists("latencyReading")
+			&& config.getValue("latencyReading").compare("true") == 0;
+}
+
+/**
+ * Set the number of recent messages held in the capture ring
+ *
+ * @param config	The configuration category
+ */
+void MQTTScripted::setCapture(const ConfigCategory& config)
+{
+	long size = DEFAULT_CAPTURE_SIZE;
+	if (config.itemExists("captureSize"))
+	{
+		size = strtol(config.getValue("captureSize").c_str(), NULL, 10);
+		if (size < 0)
+		{
+			m_logger->warn("Invalid capture buffer size %ld, using default of %d", size, DEFAULT_CAPTURE_SIZE);
+			size = DEFAULT_CAPTURE_SIZE;
+		}
+	}
+	m_capture.resize(size);
+}
+
+/**
+ * Perform an action on the capture ring, requested via the control
+ * entry points of the plugin
+ *
+ * @param action	The action, "dump" or "clear"
+ * @return bool		False if the action is not supported
+ */
+bool MQTTScripted::capture(const string& action)
+{
+	if (action.compare("dump") == 0)
+	{
+		dumpCapture();
+		return true;
+	}
+	else if (action.compare("clear") == 0)
+	{
+		m_capture.clear();
+		return true;
+	}
+	m_logger->error("Unsupported capture action '%s', the action should be dump or clear", action.c_str());
+	return false;
+}
+
+/**
+ * Dump the messages held in the capture ring to the log, one message
+ * per line, and to the file capture.json in the state directory of the
+ * plugin.
+ */
+void MQTTScripted::dumpCapture()
+{
+	if (!m_capture.enabled())
+	{
+		m_logger->warn("Message capture is disabled, set the capture buffer size to enable it");
+		return;
+	}
+	vector<string> entries;
+	m_capture.dump(entries);
+	m_logger->info("Dumping the %lu most recent messages", entries.size());
+	for (auto& entry : entries)
+	{
+		m_logger->info("Captured message %s", entry.c_str());
+	}
+
+	string dir = stateDirectory();
+	if (dir.empty())
+	{
+		return;
+	}
+	string path = dir + "/capture.json";
+	ofstream out(path.c_str(), ios::trunc);
+	out << "[\n";
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		out << "  " << entries[i] << (i + 1 < entries.size() ? ",\n" : "\n");
+	}
+	out << "]\n";
+	if (!out)
+	{
+		m_logger->error("Unable to write the captured messages to %s", path.c_str());
+	}
+}
+
+/**
+ * Report the rate at which the scratch vectors used to collect datapoints
+ * are reused rather than allocated, across all of the workers.
+ *
+ * @param force	Report the statistics at info rather than debug level
+ */
+void MQTTScripted::reportPoolStatistics(bool force)
+{
+	unsigned long acquired = m_documentPool.acquired();
+	unsigned long reused = m_documentPool.reused();
+	for (auto parser : m_jsonParsers)
+	{
+		acquired += parser->datapointPool().acquired();
+		reused += parser->datapointPool().reused();
+	}
+	for (auto python : m_pythons)
+	{
+		acquired += python->datapointPool().acquired();
+		reused += python->datapointPool().reused();
+	}
+	if (acquired == 0)
+	{
+		return;
+	}
+	double rate = (100.0 * reused) / acquired;
+	if (force)
+		m_logger->info("Datapoint scratch pool reuse rate %.1f%%, %lu of %lu", rate, reused, acquired);
+	else
+		m_logger->debug("Datapoint scratch pool reuse rate %.1f%%, %lu of %lu", rate, reused, acquired);
+}
+
+/**
+ * Return the script instance for a worker, replacing the script if a
+ * new script has been loaded and validated since the worker last
+ * used it and applying the configured payload type. Must be called
+ * holding the mutex.
+ *
+ * @param worker	The worker index
+ * @return PythonScript*	The script instance of the worker
+ */
+PythonScript *MQTTScripted::workerScript(unsigned int worker)
+{
+	PythonScript *python = m_pythons[worker];
+
+	if (m_candidates[worker])
+	{
+		// Only the references to the module and functions are
+		// exchanged, the replaced script is released by the script
+		// loader thread as this requires the interpreter lock
+		python->swapScript(*m_candidates[worker]);
+		m_replacedScripts.push_back(m_candidates[worker]);
+		m_candidates[worker] = NULL;
+		m_loaderCond.notify_all();
+		m_logger->info("Worker %u is now using the new script", worker);
+	}
+	python->setPayloadType(m_payloadType);
+	return python;
+}
+
+/**
+ * Set the number of captured messages a new script must convert before
+ * it replaces the running script
+ *
+ * @param config	The configuration category
+ */
+void MQTTScripted::setValidation(const ConfigCategory& config)
+{
+	long count = DEFAULT_VALIDATION_MESSAGES;
+	if (config.itemExists("validationMessages"))
+	{
+		count = strtol(config.getValue("validationMessages").c_str(), NULL, 10);
+		if (count < 0)
+		{
+			m_logger->warn("Invalid number of script validation messages %ld, using default of %d",
+					count, DEFAULT_VALIDATION_MESSAGES);
+			count = DEFAULT_VALIDATION_MESSAGES;
+		}
+	}
+	m_validationMessages = count;
+}
+
+/**
+ * Load the script following a change to its content. The script is
+ * loaded into the interpreter of each worker and given the most recent
+ * of the captured messages that the running script converted. The
+ * running script continues to convert messages whilst this is done and
+ * is only replaced if the new script loads and converts the messages
+ * without error. The scripts of the additional subscriptions are loaded
+ * in the same way following a reconfiguration. Runs on the script
+ * loader thread until the plugin is stopped.
+ */
+void MQTTScripted::scriptLoader()
+{
+	unique_lock<mutex> lck(m_mutex);
+	while (!m_loaderStopping)
+	{
+		if (!m_replacedScripts.empty())
+		{
+			vector<PythonScript *> replaced;
+			replaced.swap(m_replacedScripts);
+			lck.unlock();
+			for (auto python : replaced)
+			{
+				delete python;
+			}
+			lck.lock();
+			continue;
+		}
+		if (m_preparedSubscriptions != m_subscriptions)
+		{
+			shared_ptr<Subscriptions> subscriptions = m_subscriptions;
+			PythonScript::PayloadType payloadType = m_payloadType;
+			unsigned int count = m_validationMessages;
+			lck.unlock();
+			prepareSubscriptionScripts(*subscriptions, payloadType, count);
+			lck.lock();
+			m_preparedSubscriptions = subscriptions;
+			continue;
+		}
+		if (m_preparedGeneration == m_scriptGeneration)
+		{
+			m_loaderCond.wait(lck);
+			continue;
+		}
+		unsigned long generation = m_scriptGeneration;
+		string script = m_content.empty() ? "" : primaryScript();
+		PythonScript::PayloadType payloadType = m_payloadType;
+		shared_ptr<Subscriptions> subscriptions = m_subscriptions;
+		unsigned int count = m_validationMessages;
+		lck.unlock();
+
+		// The worker scripts are only used by the primary subscription,
+		// there is nothing to load if it does not have a script
+		vector<PythonScript *> scripts;
+		bool valid = false;
+		if (!script.empty())
+		{
+			m_logger->info("Loading the new Python script %s", script.c_str());
+			valid = prepareScripts(script, payloadType, scripts)
+				&& validateScript(scripts[0], script, *subscriptions, count);
+		}
+
+		lck.lock();
+		m_preparedGeneration = generation;
+		if (valid && generation == m_scriptGeneration)
+		{
+			m_logger->info("The new Python script has been validated and will replace the running script");
+			for (size_t i = 0; i < scripts.size(); i++)
+			{
+				if (m_candidates[i])	// Not yet used by the worker
+				{
+					m_replacedScripts.push_back(m_candidates[i]);
+				}
+				m_candidates[i] = scripts[i];
+			}
+		}
+		else
+		{
+			if (!script.empty() && generation == m_scriptGeneration)
+			{
+				m_logger->error("The new Python script %s is not valid, the previous script will continue to be used",
+						script.c_str());
+			}
+			m_replacedScripts.insert(m_replacedScripts.end(), scripts.begin(), scripts.end());
+		}
+	}
+}
+
+/**
+ * Load a script into the interpreter of each worker, without replacing
+ * the script the worker is running. Called without the mutex held.
+ *
+ * @param script	The script to load
+ * @param payloadType	The type of object used to pass the payload to the script
+ * @param scripts	The script instances loaded for each worker
+ * @return bool		True if the script was loaded for every worker
+ */
+bool MQTTScripted::prepareScripts(const string& script, PythonScript::PayloadType payloadType,
+		vector<PythonScript *>& scripts)
+{
+	// The worker script instances are created with the plugin and are
+	// not changed until it is destroyed
+	for (auto python : m_pythons)
+	{
+		PythonScript *candidate = new PythonScript(m_name, python);
+		candidate->setPayloadType(payloadType);
+		scripts.push_back(candidate);
+		if (!candidate->loadScript(script))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Check a newly loaded script converts the most recent of the captured
+ * messages that were received on the subscriptions that use the script
+ * and converted by the running script. The readings created are
+ * discarded. Called without the mutex held.
+ *
+ * @param python	The newly loaded script
+ * @param script	The name of the script
+ * @param subscriptions	The subscriptions
+ * @param count		The maximum number of messages to convert
+ * @return bool		False if the script failed to convert a message
+ */
+bool MQTTScripted::validateScript(PythonScript *python, const string& script,
+		const Subscriptions& subscriptions, unsigned int count)
+{
+	vector<pair<string, string> > messages;
+	if (count > 0)
+	{
+		m_capture.scriptMessages(messages);
+	}
+	unsigned int converted = 0;
+	for (auto it = messages.rbegin(); it != messages.rend() && converted < count; ++it)
+	{
+		const string& topic = it->second;
+		const Subscription& subscription = subscriptions[subscriptions.match(topic.c_str(), topic.length())];
+		if (subscription.getScript().compare(script))
+		{
+			continue;
+		}
+		MQTTPayload payload(it->first, topic);
+		string asset;
+		vector<Reading *> readings;
+		bool success = python->execute(payload, *subscription.getPolicy(), asset, readings);
+		for (auto reading : readings)
+		{
+			delete reading;
+		}
+		if (!success)
+		{
+			m_logger->error("The new Python script %s failed to convert the message '%.*s' received on topic %s",
+					script.c_str(), (int)it->first.length(), it->first.c_str(), topic.c_str());
+			return false;
+		}
+		converted++;
+	}
+	if (converted)
+	{
+		m_logger->info("The new Python script %s converted %u of the captured messages",
+				script.c_str(), converted);
+	}
+	else
+	{
+		// Only the load of the script has been checked
+		m_logger->warn("The new Python script %s has not been tested with any messages as %s",
+				script.c_str(),
+				count == 0 ? "the number of script validation messages is 0"
+				: !m_capture.enabled() ? "the capture buffer is disabled"
+				: "no messages converted by the previous script have been captured");
+	}
+	return true;
+}
+
+/**
+ * Return the script instance a worker uses for a subscription. The
+ * primary subscription uses the script instance of the worker. The
+ * scripts of other subscriptions are loaded by the script loader thread
+ * and replace the script the worker is using once they have been
+ * validated. A script the loader has not yet loaded is loaded by the
+ * worker when it is first used, as there is no running script to keep.
+ * Must be called holding the mutex.
+ *
+ * @param worker	The worker index
+ * @param index		The index of the subscription
+ * @param subscription	The subscription
+ * @return PythonScript*	The script instance
+ */
+PythonScript *MQTTScripted::workerScript(unsigned int worker, size_t index, const Subscription& subscription)
+{
+	if (index == Subscriptions::PRIMARY)
+	{
+		return workerScript(worker);
+	}
+
+	ScriptCache& scripts = m_subscriptionScripts[worker];
+	ScriptCache& candidates = m_subscriptionCandidates[worker];
+	const string& name = subscription.getScript();
+	auto it = scripts.find(name);
+	auto candidate = candidates.find(name);
+	if (candidate != candidates.end())
+	{
+		if (it == scripts.end())
+		{
+			it = scripts.insert(*candidate).first;
+		}
+		else
+		{
+			// The replaced script is released by the script loader
+			it->second->swapScript(*candidate->second);
+			m_replacedScripts.push_back(candidate->second);
+			m_loaderCond.notify_all();
+			m_logger->info("Worker %u is now using the new script %s", worker, name.c_str());
+		}
+		candidates.erase(candidate);
+	}
+	else if (it == scripts.end())
+	{
+		PythonScript *python = new PythonScript(m_name, m_pythons[worker]);
+		python->loadScript(name);
+		it = scripts.insert(make_pair(name, python)).first;
+	}
+	PythonScript *python = it->second;
+	python->setPayloadType(m_payloadType);
+	return python;
+}
+
+/**
+ * Load the scripts used by the additional subscriptions that are new or
+ * whose source has changed since they were last loaded. Each script is
+ * loaded into the interpreter of each worker and checked against the
+ * captured messages received on the subscriptions that use it, only if
+ * it is valid is it passed to the workers. A script that is not valid is
+ * loaded again following the next reconfiguration. Called on the script
+ * loader thread without the mutex held.
+ *
+ * @param subscriptions	The subscriptions
+ * @param payloadType	The type of object used to pass the payload to the script
+ * @param count		The maximum number of captured messages to convert
+ */
+void MQTTScripted::prepareSubscriptionScripts(const Subscriptions& subscriptions,
+		PythonScript::PayloadType payloadType, unsigned int count)
+{
+	ScriptSources sources;
+	for (size_t i = 0; i < subscriptions.size(); i++)
+	{
+		const string& name = subscriptions[i].getScript();
+		if (i == Subscriptions::PRIMARY || name.empty() || sources.count(name))
+		{
+			continue;
+		}
+		string path, source;
+		PythonScript::readScript(name, path, source);
+		auto it = m_scriptSources.find(name);
+		if (it != m_scriptSources.end() && it->second.compare(source) == 0)
+		{
+			sources.insert(*it);
+			continue;
+		}
+
+		m_logger->info("Loading the new Python script %s", name.c_str());
+		vector<PythonScript *> scripts;
+		bool valid = prepareScripts(name, payloadType, scripts)
+				&& validateScript(scripts[0], name, subscriptions, count);
+
+		lock_guard<mutex> guard(m_mutex);
+		if (valid)
+		{
+			sources.insert(make_pair(name, source));
+			for (size_t worker = 0; worker < scripts.size(); worker++)
+			{
+				PythonScript *&candidate = m_subscriptionCandidates[worker][name];
+				if (candidate)	// Not yet used by the worker
+				{
+					m_replacedScripts.push_back(candidate);
+				}
+				candidate = scripts[worker];
+			}
+		}
+		else
+		{
+			m_logger->error("The new Python script %s is not valid, the previous script will continue to be used",
+					name.c_str());
+			m_replacedScripts.insert(m_replacedScripts.end(), scripts.begin(), scripts.end());
+		}
 	}
-	m_keyPass = keyPass;
+	m_scriptSources.swap(sources);
+}
 
-	string serverCert = category.getValue("serverCert");
-	if (serverCert.compare(m_serverCert))
+/**
+ * Check if any of the scripts a worker uses define a convert_batch
+ * function, in which case the worker takes batches of messages from
+ * the ingress queue. Must be called holding the mutex.
+ *
+ * @param worker	The worker index
+ * @return bool		True if messages may be converted in batches
+ */
+bool MQTTScripted::batchConvert(unsigned int worker)
+{
+	if (workerScript(worker)->hasBatch())
 	{
-		resubscribe = true;
+		return true;
 	}
-	m_serverCert = serverCert;
-
-	string username = category.getValue("username");
-	if (username.compare(m_username))
+	for (auto& script : m_subscriptionScripts[worker])
 	{
-		resubscribe = true;
+		if (script.second->hasBatch())
+		{
+			return true;
+		}
 	}
-	m_username = username;
+	return false;
+}
 
-	string password = category.getValue("password");
-	if (password.compare(m_password))
+/**
+ * Process a set of messages taken from the ingress queue. The messages
+ * are processed in runs of consecutive messages that were received on
+ * the same subscription, preserving the order of the messages. If the
+ * asset name of the subscription depends upon the topic the messages
+ * in a run must also have been received on the same topic.
+ *
+ * @param payloads	The MQTT message payloads
+ * @param worker	The worker whose script instance should be used
+ */
+void MQTTScripted::processMessages(const vector<MQTTPayload>& payloads, unsigned int worker)
+{
+	unique_lock<mutex> lck(m_mutex);
+	shared_ptr<Subscriptions> subscriptions = m_subscriptions;
+	lck.unlock();
+
+	size_t start = 0;
+	while (start < payloads.size())
 	{
-		resubscribe = true;
+		const MQTTPayload& first = payloads[start];
+		size_t index = subscriptions->match(first.topic(), first.topicLength());
+		bool perTopic = (*subscriptions)[index].assetPerTopic();
+		size_t end = start + 1;
+		while (end < payloads.size()
+				&& subscriptions->match(payloads[end].topic(), payloads[end].topicLength()) == index
+				&& (!perTopic || (payloads[end].topicLength() == first.topicLength()
+					&& memcmp(payloads[end].topic(), first.topic(), first.topicLength()) == 0)))
+		{
+			end++;
+		}
+		processMessages(payloads, start, end, *subscriptions, index, worker);
+		start = end;
 	}
-	m_password = password;
+}
 
-	string policy = category.getValue("policy");
-	processPolicy(policy);
+/**
+ * Process a run of messages that were received on the same subscription.
+ * If the script of the subscription defines a convert_batch function the
+ * messages are passed to the script in a single call, otherwise each
+ * message is processed individually.
+ *
+ * @param payloads	The MQTT message payloads
+ * @param start		The index of the first message of the run
+ * @param end		The index after the last message of the run
+ * @param subscriptions	The subscriptions
+ * @param index		The index of the subscription the messages were received on
+ * @param worker	The worker whose script instance should be used
+ */
+void MQTTScripted::processMessages(const vector<MQTTPayload>& payloads, size_t start, size_t end,
+		const Subscriptions& subscriptions, size_t index, unsigned int worker)
+{
+	const Subscription& subscription = subscriptions[index];
 
-	m_timestamp = category.getValue("timestamp");
-	m_timeFormat = category.getValue("format");
+	unique_lock<mutex> lck(m_mutex);
 
-	string timezone = category.getValue("timezone");
-	m_offset = strtol(timezone.c_str(), NULL, 10);
-	m_offset *= 60 * 60;
-	long num;
-	auto res = timezone.find_first_of(':');
-	if (res |= string::npos)
+	PythonScript *python = NULL;
+	if (subscription.hasScript())
 	{
-		string mins = timezone.substr(res + 1);
-		num = strtol(mins.c_str(), NULL, 10);
-		num *= 60;
-		m_offset += num;
+		python = workerScript(worker, index, subscription);
 	}
 
-	if (resubscribe)
+	if (end - start == 1 || !python || !python->hasBatch())
 	{
-		m_logger->info("Resubscribing to MQTT broker %s following reconfiguration", m_broker.c_str());
-		// The MQTT broker has changed
-		(void)MQTTClient_disconnect(m_client, 10000);
-		MQTTClient_destroy(&m_client);
-
-
-		// Connect to the new MQTT broker
-		MQTTClient_connectOptions conn_opts = MQTTClient_connectOptions_initializer;
-		MQTTClient_deliveryToken token;
-		int rc;
-
-		m_logger->debug("Create MQTT Client '%s' with clientID '%s'", m_broker.c_str(), m_clientID.c_str());
-		if ((rc = MQTTClient_create(&m_client, m_broker.c_str(), m_clientID.c_str(),
-			MQTTCLIENT_PERSISTENCE_NONE, NULL)) != MQTTCLIENT_SUCCESS)
+		lck.unlock();
+		for (size_t i = start; i < end; i++)
 		{
-			m_logger->error("Failed to create client, MQTT reports %s", MQTTClient_strerror(rc));
+			processMessage(payloads[i], subscription, index, worker);
 		}
-		else
+		return;
+	}
+	string buffer;
+	string asset = subscription.getAsset(payloads[start].topic(), payloads[start].topicLength(), buffer);
+	lck.unlock();
+
+	vector<Reading *> readings;
+	bool converted;
+	uint64_t captureStart = m_capture.enabled() ? StageTimers::now() : 0;
+	StageTimer timer(StageTimers::Script);
+	if (start == 0 && end == payloads.size())
+	{
+		converted = python->executeBatch(payloads, *subscription.getPolicy(), asset, readings);
+	}
+	else
+	{
+		// Pass the script views of the messages in the run
+		vector<MQTTPayload> run;
+		run.reserve(end - start);
+		for (size_t i = start; i < end; i++)
 		{
-			MQTTClient_setCallbacks(m_client, this, connlost, msgarrvd, NULL);
-			// Start a background thread to attempt the reconnection
-			backgroundReconnect();
+			run.emplace_back(payloads[i].data(), payloads[i].length(),
+					payloads[i].topic(), payloads[i].topicLength());
 		}
+		converted = python->executeBatch(run, *subscription.getPolicy(), asset, readings);
 	}
-
-	m_script = category.getItemAttribute("script", ConfigCategory::FILE_ATTR);
-	string content = category.getValue("script");
-	if (m_content.compare(content))	// Script content has changed
+	timer.stop();
+	if (captureStart)
 	{
-		m_logger->info("Reconfiguration has changed the Python script");
-		m_restart = true;
-		m_content = content;
+		// The readings and time of the whole batch are recorded
+		// against each message of the batch
+		uint64_t elapsed = StageTimers::now() - captureStart;
+		uint64_t stages[StageTimers::STAGES] = { 0 };
+		for (size_t i = start; i < end; i++)
+		{
+			m_capture.record(payloads[i], converted ? CaptureRing::ScriptBatch : CaptureRing::Failed,
+					readings.size(), elapsed, stages);
+		}
+	}
+	if (converted)
+	{
+		lck.lock();
+		for (auto reading : readings)
+		{
+			ingest(reading);
+		}
 	}
 }
 
 /**
  * Called when a message is delivered from the MQTT broker
  *
- * @param topic	The MQTT topic
- * @param message	The MQTT message
+ * @param payload	The MQTT message payload and the topic it was received on
+ * @param worker	The worker whose script instance should be used
+ */
+void MQTTScripted::processMessage(const MQTTPayload& payload, unsigned int worker)
+{
+	unique_lock<mutex> lck(m_mutex);
+	shared_ptr<Subscriptions> subscriptions = m_subscriptions;
+	lck.unlock();
+
+	size_t index = subscriptions->match(payload.topic(), payload.topicLength());
+	processMessage(payload, (*subscriptions)[index], index, worker);
+}
+
+/**
+ * Process a message using the asset name, object policy and script of
+ * the subscription it was received on
+ *
+ * The mutex is released whilst the script is executing, allowing
+ * workers that run the script in separate sub-interpreters to
+ * execute in parallel.
+ *
+ * @param payload	The MQTT message payload and the topic it was received on
+ * @param subscription	The subscription the message was received on
+ * @param index		The index of the subscription
+ * @param worker	The worker whose script instance should be used
  */
-void MQTTScripted::processMessage(const string& topic,const  string& message)
+void MQTTScripted::processMessage(const MQTTPayload& payload, const Subscription& subscription,
+		size_t index, unsigned int worker)
 {
 Document doc;
 
-	lock_guard<mutex> guard(m_mutex);
+	// Declared before the lock so the message is recorded once the
+	// mutex has been released
+	Capture capture(m_capture, payload);
+	unique_lock<mutex> lck(m_mutex);
 
-	if (m_reap)	// Reap the reconnection thread if required
-	{
-		m_reconnectThread->join();
-		m_reconnectThread = NULL;
-		m_reap = false;
-	}
+	const char *message = payload.data();
+	size_t length = payload.length();
+	// The expansion of the asset name is cached by the subscription, the
+	// buffer is only used if the cache is full
+	string buffer;
+	const string& asset = subscription.getAsset(payload.topic(), payload.topicLength(), buffer);
 
-	m_logger->debug("Processing MQTT message: %s with script %s", message.c_str(), m_script.c_str());
-	if (m_script.empty() || m_script.compare("\"\"") == 0)
+	if (!subscription.hasScript())
 	{
-		// Message should be JSON
-		doc.Parse(message.c_str());
-		if (doc.HasParseError() == false && doc.IsObject())
-		{
-			m_logger->debug("Message is JSON");
-			processDocument(doc, m_asset);
-		}
-		else
+		// Only a payload that starts with an opening brace can be a
+		// JSON object, anything else is treated as simple values
+		if (SimpleValue::isObject(message, length))
 		{
-			m_logger->debug("Message is assumed to be simple value");
-			// Maybe it is a simple value
-			int i;
-			bool nonNumeric = false;
-			for (i = 0; i < message.length(); i++)
-				if (message[i] != '.' && (message[i] < '0' || message[i] > '9') && message[i] != '-')
-					nonNumeric = true;
-			if (!nonNumeric)
+			if (m_onDemand)
 			{
-				double d = strtod(message.c_str(), NULL);
-				DatapointValue dpv(d);
-				Reading reading(m_asset, new Datapoint(m_topic, dpv));
-				(*m_ingest)(m_data, reading);
+				// The on demand parser creates the readings directly from
+				// the payload and does not need the mutex to be held
+				lck.unlock();
+				vector<Reading *> readings;
+				StageTimer timer(StageTimers::Parse);
+				bool parsed = m_jsonParsers[worker]->parse(payload, *subscription.getPolicy(),
+						asset, readings);
+				timer.stop();
+				lck.lock();
+				if (parsed)
+				{
+					capture.result(CaptureRing::JSON, readings.size());
+					for (auto reading : readings)
+					{
+						ingest(reading);
+					}
+					return;
+				}
 			}
-			else
+
+			// Message should be JSON
+			StageTimer parseTimer(StageTimers::Parse);
+			doc.Parse(message, length);
+			parseTimer.stop();
+			if (doc.HasParseError() == false && doc.IsObject())
 			{
-				m_logger->warn("Unable to process message '%s' expecting a simple value",
-						message.c_str());
+				StageTimer documentTimer(StageTimers::Document);
+				size_t count = processDocument(doc, *subscription.getPolicy(), asset, payload.topicStr());
+				capture.result(CaptureRing::JSON, count);
+				return;
 			}
 		}
+
+		Scratch<Datapoint *> points(m_documentPool);
+		string nameBuffer;
+		const string& name = subscription.getDatapoint(payload.topic(), payload.topicLength(), nameBuffer);
+		StageTimer timer(StageTimers::Parse);
+		bool parsed = SimpleValue::parse(message, length, name, *points);
+		timer.stop();
+		if (parsed)
+		{
+			capture.result(CaptureRing::SimpleValue, 1);
+			ingest(new Reading(asset, *points));
+		}
+		else
+		{
+			capture.result(CaptureRing::Rejected, 0);
+			m_logger->warn("Unable to process message '%.*s' expecting a simple value",
+					(int)length, message);
+		}
 	}
 	else
 	{
-		string asset;
-
-		if (m_restart)
+		PythonScript *python = workerScript(worker, index, subscription);
+		// The subscription holds a reference to the policy, a
+		// reconfiguration may replace the subscriptions whilst the
+		// script is executing without the mutex held
+		string scriptAsset = asset;
+		lck.unlock();
+
+		// Give the message to the script to process, the DICT returned
+		// by the script is converted directly into readings
+		vector<Reading *> readings;
+		StageTimer timer(StageTimers::Script);
+		bool converted = python->execute(payload, *subscription.getPolicy(), scriptAsset, readings);
+		timer.stop();
+		if (converted)
 		{
-			m_logger->info("Script content has changed, reloading");
-			if (m_python && m_script.empty() == false)
+			capture.result(CaptureRing::Script, readings.size());
+			lck.lock();
+			for (auto reading : readings)
 			{
-				m_python->setScript(m_script);
+				ingest(reading);
 			}
-			m_restart = false;
 		}
-		// Give the message to the script to process
-		Document *d = m_python->execute(message, topic, asset);
+	}
+}
+
+/**
+ * Set the type of object used to pass the payload to the script
+ *
+ * @param config	The configuration category
+ */
+void MQTTScripted::setPayloadType(const ConfigCategory& config)
+{
+	m_payloadType = PythonScript::PayloadString;
+	if (config.itemExists("payloadType"))
+	{
+		string type = config.getValue("payloadType");
+		if (type.compare("Bytes") == 0)
+		{
+			m_payloadType = PythonScript::PayloadBytes;
+		}
+		else if (type.compare("Memory View") == 0)
+		{
+			m_payloadType = PythonScript::PayloadMemoryView;
+		}
+		else if (type.compare("String"))
+		{
+			m_logger->error("Unsupported value for payload type '%s', payloads will be passed as strings", type.c_str());
+		}
+	}
+}
 
-		if (d)
+/**
+ * Set the parser used for JSON payloads when no script is configured
+ *
+ * @param config	The configuration category
+ */
+void MQTTScripted::setJsonParser(const ConfigCategory& config)
+{
+	m_onDemand = OnDemandParser::available();
+	if (config.itemExists("jsonParser"))
+	{
+		string parser = config.getValue("jsonParser");
+		if (parser.compare("Document") == 0)
+		{
+			m_onDemand = false;
+		}
+		else if (parser.compare("On Demand") == 0)
 		{
-			if (asset.empty())
+			if (!m_onDemand)
 			{
-				asset = m_asset;
+				m_logger->warn("The on demand JSON parser is not available in this build, the document parser will be used");
 			}
-			processDocument(*d, asset);
+		}
+		else
+		{
+			m_logger->error("Unsupported value for JSON parser '%s'", parser.c_str());
+		}
+	}
+}
+
+/**
+ * Set the batching parameters from the configuration
+ *
+ * @param config	The configuration category
+ */
+void MQTTScripted::setBatching(const ConfigCategory& config)
+{
+	m_batchSize = DEFAULT_BATCH_SIZE;
+	m_batchLatency = DEFAULT_BATCH_LATENCY;
+	if (config.itemExists("batchSize"))
+	{
+		long size = strtol(config.getValue("batchSize").c_str(), NULL, 10);
+		if (size > 0)
+			m_batchSize = size;
+		else
+			m_logger->warn("Invalid batch size %ld, using default of %d", size, DEFAULT_BATCH_SIZE);
+	}
+	if (config.itemExists("batchLatency"))
+	{
+		long latency = strtol(config.getValue("batchLatency").c_str(), NULL, 10);
+		if (latency >= 0)
+			m_batchLatency = latency;
+		else
+			m_logger->warn("Invalid batch latency %ld, using default of %d", latency, DEFAULT_BATCH_LATENCY);
+	}
+	m_batch.reserve(m_batchSize);
+}
 
-			m_logger->debug("%s - message :%s: topic :%s: asset :%s: ", __FUNCTION__ , message.c_str(), topic.c_str(), asset.c_str() );
+/**
+ * Add a reading to the current batch of readings to be ingested. The
+ * batch is sent once it reaches the configured size. Must be called
+ * holding the mutex.
+ *
+ * @param reading	The reading to ingest, ownership passes to the batch
+ */
+void MQTTScripted::ingest(Reading *reading)
+{
+	if (m_batch.empty())
+	{
+		gettimeofday(&m_batchStart, NULL);
+	}
+	m_batch.push_back(reading);
+	if (m_batch.size() >= m_batchSize)
+	{
+		flushBatch();
+	}
+}
 
-			delete d;
+/**
+ * Send the current batch of readings to the south service. If the
+ * service has registered the multiple reading ingest callback the
+ * batch is sent in a single call, otherwise each reading is sent using
+ * the single reading callback. Must be called holding the mutex.
+ */
+void MQTTScripted::flushBatch()
+{
+	if (m_batch.empty())
+	{
+		return;
+	}
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+	if (m_ingestMany)
+	{
+		// The south service takes ownership of the readings
+		(*m_ingestMany)(m_data, &m_batch);
+	}
+	else
+	{
+		for (auto reading : m_batch)
+		{
+			if (m_ingest)
+				(*m_ingest)(m_data, *reading);
+			delete reading;
 		}
 	}
+	m_batch.clear();
+	gettimeofday(&end, NULL);
+	long elapsed = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
+	StageTimers::record(StageTimers::Ingest, (uint64_t)elapsed * 1000);
+	flowTransition(m_flow.ingested(elapsed / 1000));
+}
+
+/**
+ * Return the time in milliseconds until the current batch must be sent.
+ * Must be called holding the mutex.
+ *
+ * @return long	The timeout, -1 if there is no batch pending
+ */
+long MQTTScripted::batchTimeout()
+{
+	if (m_batch.empty())
+	{
+		return -1;
+	}
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	long elapsed = (now.tv_sec - m_batchStart.tv_sec) * 1000
+			+ (now.tv_usec - m_batchStart.tv_usec) / 1000;
+	if (elapsed >= m_batchLatency)
+	{
+		return 0;
+	}
+	return m_batchLatency - elapsed;
 }
 
 /**
@@ -635,231 +2608,140 @@ string MQTTScripted::serverCertPath()
 
 /**
  * Process the JSON document following the rules regarding collapsing and creating
- * multiple readings.
+ * multiple readings. The rules are applied using a plan compiled for the shape
+ * of the documents received on the topic. Must be called holding the mutex.
  *
  * @param doc	The JSON document to process into readings
+ * @param policy	The object policy
+ * @param asset	The asset name for the reading
+ * @param topic	The topic the document was received on
+ * @return size_t	The number of readings created
  */
-void MQTTScripted::processDocument(Document& doc, const string& asset)
+size_t MQTTScripted::processDocument(Document& doc, const ObjectPolicy& policy, const string& asset,
+		const string& topic)
 {
-	if (m_policy == mPolicyFirstLevel)
-	{
-		m_logger->debug("Policy is to take data from the first level only");
-		vector<Datapoint *> points;
-		string ts;
-		getValues(doc.GetObject(), points, false, ts);
-		if (points.size() > 0)
-		{
-			Reading reading(asset, points);
-			if (!ts.empty())
-				reading.setUserTimestamp(ts);
-			(*m_ingest)(m_data, reading);
-		}
-	}
-	else if (m_policy == mPolicyCollapse)
+	const DocumentPlan *plan = m_planCache.getPlan(topic, doc, policy);
+	vector<Reading *> readings;
+	plan->createReadings(doc, policy, asset, readings, m_documentPool);
+	for (auto reading : readings)
 	{
-		m_logger->debug("Policy is to collapse data into a single reading");
-		vector<Datapoint *> points;
-		string ts;
-		getValues(doc.GetObject(), points, true, ts);
-		if (points.size() > 0)
-		{
-			Reading reading(asset, points);
-			if (!ts.empty())
-				reading.setUserTimestamp(ts);
-			(*m_ingest)(m_data, reading);
-		}
-	}
-	else if (m_policy == mPolicyMultiple)
-	{
-		m_logger->debug("Policy is to create multiple readings");
-		string user_ts;
-		vector<Datapoint *> points;
-		for (auto& m : doc.GetObject())
-		{
-			if (!strcmp(m.name.GetString(), m_timestamp.c_str()))
-			{
-				if (m.value.IsString())
-				{
-					user_ts = m.value.GetString();
-					convertTimestamp(user_ts);
-				}
-			}
-			else if (m.value.IsInt64())
-			{
-				long v = m.value.GetInt64();
-				DatapointValue dpv(v);
-				points.push_back(new Datapoint( m.name.GetString(), dpv));
-			}
-			else if (m.value.IsDouble())
-			{
-				double d = m.value.GetDouble();
-				DatapointValue dpv(d);
-				points.push_back(new Datapoint( m.name.GetString(), dpv));
-			}
-			else if (m.value.IsString())
-			{
-				const char *s = m.value.GetString();
-				DatapointValue dpv(s);
-				points.push_back(new Datapoint( m.name.GetString(), dpv));
-			}
-			else if (m.value.IsObject()) 
-			{
-				string ts;
-				vector<Datapoint *> children;
-				getValues(m.value, children, true, ts);
-				if (children.size() > 0)
-				{
-					Reading reading(m.name.GetString(), children);
-					if (!ts.empty())
-						reading.setUserTimestamp(ts);
-					(*m_ingest)(m_data, reading);
-				}
-			}
-		}
-		if (points.size() > 0)
-		{
-			Reading reading(asset, points);
-			if (!user_ts.empty())
-				reading.setUserTimestamp(user_ts);
-			(*m_ingest)(m_data, reading);
-		}
+		ingest(reading);
 	}
+	return readings.size();
 }
 
 /**
- * Get the values from the current level of the JSON document.
- * If the recuse flag is set we will recurse into child objects
- * and extract the data from those objects also.
- *
- * @param object	The object to iterate over
- * @param points	The datapoint array
- * @param recurse	Recusrse to nested objects
+ * Start a background thread to perform reconnection to the MQTT broker,
+ * unless one is already running. Must be called holding the connection
+ * mutex.
  */
-void MQTTScripted::getValues(const Value& object, vector<Datapoint *>& points, bool recurse, string& user_ts)
+void MQTTScripted::backgroundReconnect()
 {
-	// Iterate the document
-	for (auto& m : object.GetObject())
+	if (m_reap)	// Reap the previous reconnection thread
 	{
-		if (!strcmp(m.name.GetString(), m_timestamp.c_str()))
-		{
-			if (m.value.IsString())
-			{
-				user_ts = m.value.GetString();
-				convertTimestamp(user_ts);
-			}
-		}
-		else if (m.value.IsInt64())
-		{
-			long v = m.value.GetInt64();
-			DatapointValue dpv(v);
-			points.push_back(new Datapoint( m.name.GetString(), dpv));
-		}
-		else if (m.value.IsDouble())
-		{
-			double d = m.value.GetDouble();
-			DatapointValue dpv(d);
-			points.push_back(new Datapoint( m.name.GetString(), dpv));
-		}
-		else if (m.value.IsString())
-		{
-			const char *s = m.value.GetString();
-			DatapointValue dpv(s);
-			points.push_back(new Datapoint( m.name.GetString(), dpv));
-		}
-		else if (m.value.IsObject() && recurse)
-		{
-			if (m_nest)
-			{
-				vector<Datapoint *> *children = new vector<Datapoint *>;
-				string ts;
-				getValues(m.value, *children, true, ts);
-				DatapointValue	dpv(children, true);
-				points.push_back(new Datapoint( m.name.GetString(), dpv));
-			}
-			else
-			{
-				string ts;
-				getValues(m.value, points, true, ts);
-			}
-		}
+		m_reconnectThread->join();
+		delete m_reconnectThread;
+		m_reconnectThread = NULL;
+		m_reap = false;
 	}
-}
-
-
-
-/**
- * Convert some common timestamp formats to formats required by FogLAMP
- *
- * @param ts	Timestamp to convert
- */
-void MQTTScripted::convertTimestamp(string& ts)
-{
-struct tm tm;
-char	buf[200];
-double  fraction = 0;
 
-	size_t pos = ts.find_first_of(".");
-	if (pos != string::npos)
+	if (!m_reconnectThread && !m_stopping)
 	{
-		fraction = strtod(ts.substr(pos).c_str(), NULL);
+		m_reconnectThread = new thread(&reconnect_thread, this);
 	}
-	strptime(ts.c_str(), m_timeFormat.c_str(), &tm);
-	// Now adjust for the timezone
-	time_t tim = mktime(&tm);
-	tim += m_offset;
-	gmtime_r(&tim, &tm);
-	strftime(buf, sizeof(buf), DEFAULT_DATE_TIME_FORMAT, &tm);
-	ts = buf;
-	snprintf(buf, sizeof(buf), "%1.6f", fraction);
-	ts += &buf[1];
 }
 
 /**
- * Start a background thread to perform reconnection to the MQTT broker, must be called
- * holding the mutex, must be called
- * holding the mutex
+ * Disconnect from the broker whilst flow control has paused the receipt
+ * of messages and wait for the pause to end. Must be called holding the
+ * connection mutex, which is released whilst waiting.
+ *
+ * @param lck	The lock held on the connection mutex
  */
-void MQTTScripted::backgroundReconnect()
+void MQTTScripted::pause(unique_lock<mutex>& lck)
 {
-	if (m_reap)
+	m_logger->warn("Disconnecting from the MQTT broker until the ingest pipeline has caught up");
+	destroyClient(lck);
+	while (!m_connectionCond.wait_for(lck, chrono::milliseconds(FLOW_CHECK_INTERVAL),
+				[this] { return m_stopping || !m_paused; }))
 	{
-		m_reconnectThread->join();
-		m_reconnectThread = NULL;
-		m_reap = false;
+		// Recheck the queue in case the last report of its
+		// occupancy was overtaken by an earlier one
+		lck.unlock();
+		flowUpdate();
+		lck.lock();
 	}
-
-	if (!m_reconnectThread)
+	if (!m_stopping)
 	{
-		m_reconnectThread = new thread(&reconnect_thread, this);
+		m_logger->info("Reconnecting to the MQTT broker as the ingest pipeline has caught up");
 	}
 }
 
 /**
  * Background thread used to reconnect to the MQTT broker. The thread will terminate once
- * the connection is established.
+ * the connection is established or the plugin is stopped. The connection mutex is only
+ * held by the thread whilst it is not waiting.
  */
 void MQTTScripted::reconnectRetry()
 {
 	int waitfor = INITIAL_RECONNECT_WAIT;
-	bool logConnection = false;
-	
-	if (m_state == mConnected)	// Only log if we were previously connected
+
+	unique_lock<mutex> lck(m_connectionMutex);
+	bool logConnection = m_connectionLost;	// Only log if we were previously connected
+	if (logConnection)
 	{
-		m_logger->getLogger()->warn("Attempting to reconnect to the MQTT Broker");
-		logConnection = true;
+		m_logger->warn("Attempting to reconnect to the MQTT Broker");
+		m_connectionLost = false;
 	}
-	bool connected = false;
-	do {
-		this_thread::sleep_for(std::chrono::milliseconds(waitfor));
-		connected = reconnect();
+	while (true)
+	{
+		m_connectionCond.wait_for(lck, chrono::milliseconds(waitfor), [this] { return m_stopping || m_paused; });
+		if (m_stopping)
+		{
+			break;
+		}
+		if (m_paused)
+		{
+			pause(lck);
+			waitfor = INITIAL_RECONNECT_WAIT;
+			continue;
+		}
+		// A reconfiguration may have requested a new connection, or flow
+		// control a pause, whilst connecting
+		if (reconnect(lck) && !m_restart && !m_paused)
+		{
+			if (m_retiring)
+			{
+				// Tear down the replaced client once its replacement
+				// is feeding the pipeline
+				if (!m_connectionCond.wait_for(lck, chrono::seconds(CONNECT_TIMEOUT),
+						[this] { return m_stopping || m_activeClient == m_clientContext; }))
+				{
+					m_logger->warn("The subscriptions of the new connection have not been acknowledged, the previous connection will be closed");
+				}
+				if (m_stopping)
+				{
+					break;
+				}
+				retireClient(lck);
+				m_logger->info("Replaced the connection to the MQTT broker %s", m_broker.c_str());
+				if (m_state != mConnected)
+				{
+					// The new connection was lost whilst the
+					// old connection was being closed
+					continue;
+				}
+			}
+			if (logConnection)
+			{
+				m_logger->warn("Connected to the MQTT Broker %s", m_broker.c_str());
+			}
+			break;
+		}
 		if (waitfor < MAX_RECONNECT_WAIT)
 		{
 			waitfor *= 10;
 		}
-	} while (!connected);
-	if (logConnection)
-	{
-		m_logger->getLogger()->warn("Connected to the MQTT Broker %s", m_broker.c_str());
 	}
 	m_reap = true;
 }
@@ -0,0 +1,140 @@
+/*
+ * FogLAMP "MQTTScripted" shared subscriptions.
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <shared_subscription.h>
+#include <logger.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <random>
+#include <fstream>
+
+using namespace std;
+
+/**
+ * Check a share group name is valid. The name must not be empty and
+ * must not contain the topic level separator or the wildcards.
+ *
+ * @param group		The share group name
+ * @return bool		True if the name is valid
+ */
+bool SharedSubscription::validGroup(const string& group)
+{
+	return !group.empty() && group.find_first_of("/+#") == string::npos;
+}
+
+/**
+ * Return the topic filter used to subscribe to a topic as a member of
+ * a share group
+ *
+ * @param group		The share group, if empty the subscription is not shared
+ * @param filter	The topic filter
+ * @return string	The topic filter to subscribe to
+ */
+string SharedSubscription::topic(const string& group, const string& filter)
+{
+	if (group.empty())
+	{
+		return filter;
+	}
+	return SHARED_PREFIX + group + "/" + filter;
+}
+
+/**
+ * Return the topic filters used to subscribe to a set of topics as a
+ * member of a share group
+ *
+ * @param group		The share group, if empty the subscriptions are not shared
+ * @param filters	The topic filters
+ * @return vector	The topic filters to subscribe to
+ */
+vector<string> SharedSubscription::topics(const string& group, const vector<string>& filters)
+{
+	vector<string> topics;
+	for (auto& filter : filters)
+	{
+		topics.push_back(topic(group, filter));
+	}
+	return topics;
+}
+
+/**
+ * Generate a client ID that is unique to this instance of the plugin.
+ * The ID contains the service name and host name, to make it possible
+ * to identify the instance in the broker, and a random suffix that
+ * distinguishes instances with the same service name on the same host.
+ *
+ * @param name		The name of the south service
+ * @return string	The client ID
+ */
+string SharedSubscription::clientID(const string& name)
+{
+	char host[256];
+	if (gethostname(host, sizeof(host)) != 0)
+	{
+		host[0] = 0;
+	}
+	host[sizeof(host) - 1] = 0;
+
+	random_device rd;
+	char suffix[16];
+	snprintf(suffix, sizeof(suffix), "%08x", (unsigned int)rd());
+
+	string id = name;
+	if (host[0])
+	{
+		id += "-";
+		id += host;
+	}
+	id += "-";
+	id += suffix;
+	return id;
+}
+
+/**
+ * Return the client ID a plugin connects to the broker with. The service
+ * name is used unless the plugin is a member of a shared subscription
+ * group, in which case each instance is given its own ID so that the
+ * members of the group do not disconnect each other.
+ *
+ * @param name		The name of the south service
+ * @param group		The share group, if empty the subscriptions are not shared
+ * @param sessionDir	The directory holding the persistent session, empty
+ *			if the session is not persistent
+ * @return string	The client ID
+ */
+string SharedSubscription::clientID(const string& name, const string& group, const string& sessionDir)
+{
+	if (group.empty())
+	{
+		return name;
+	}
+	if (sessionDir.empty())
+	{
+		return clientID(name);
+	}
+
+	// A persistent session is identified by the client ID, so the
+	// generated ID is stored and reused when the plugin restarts
+	string path = sessionDir + "/clientid";
+	string id;
+	ifstream in(path);
+	if (in && getline(in, id) && id.compare(0, name.length() + 1, name + "-") == 0)
+	{
+		return id;
+	}
+	id = clientID(name);
+	ofstream out(path, ios::trunc);
+	out << id << "\n";
+	if (!out)
+	{
+		Logger::getLogger()->warn("Unable to store the client ID in %s, the session will not be resumed after a restart",
+				path.c_str());
+	}
+	return id;
+}
@@ -0,0 +1,362 @@
+/*
+ * FogLAMP "MQTTScripted" simple value parser.
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <simple_value.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+#define MAX_FAST_DIGITS		19	// Significant digits that fit in a uint64_t
+#define MAX_EXACT_MANTISSA	(1ULL << 53)
+#define MAX_EXACT_POWER		22	// Largest power of 10 exactly representable as a double
+
+/**
+ * Powers of 10 that are exactly representable as doubles
+ */
+static const double powersOf10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static inline bool isSpace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static inline bool isDigit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+/**
+ * Return true if the character may appear in a payload of numeric values
+ */
+static inline bool isNumericChar(char c)
+{
+	return isDigit(c) || c == '.' || c == '-' || c == '+' || c == 'e' || c == 'E'
+		|| c == ',' || isSpace(c);
+}
+
+/**
+ * Classify the payload, returning true if it only contains characters
+ * that may appear in a list of numbers. This allows the common case of
+ * numeric payloads to be parsed without considering keywords. Where SSE2
+ * is available 16 bytes of the payload are classified at a time.
+ *
+ * @param data		The payload
+ * @param length	The length of the payload
+ * @return bool		True if the payload only contains numeric characters
+ */
+bool SimpleValue::isNumeric(const char *data, size_t length)
+{
+	size_t i = 0;
+#if defined(__SSE2__)
+	const __m128i below = _mm_set1_epi8('0' - 1);
+	const __m128i above = _mm_set1_epi8('9' + 1);
+	const __m128i dot = _mm_set1_epi8('.');
+	const __m128i minus = _mm_set1_epi8('-');
+	const __m128i plus = _mm_set1_epi8('+');
+	const __m128i lower = _mm_set1_epi8('e');
+	const __m128i upper = _mm_set1_epi8('E');
+	const __m128i comma = _mm_set1_epi8(',');
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i tab = _mm_set1_epi8('\t');
+	const __m128i cr = _mm_set1_epi8('\r');
+	const __m128i nl = _mm_set1_epi8('\n');
+	for (; i + 16 <= length; i += 16)
+	{
+		__m128i c = _mm_loadu_si128((const __m128i *)(data + i));
+		__m128i ok = _mm_and_si128(_mm_cmpgt_epi8(c, below), _mm_cmplt_epi8(c, above));
+		ok = _mm_or_si128(ok, _mm_or_si128(_mm_cmpeq_epi8(c, dot), _mm_cmpeq_epi8(c, minus)));
+		ok = _mm_or_si128(ok, _mm_or_si128(_mm_cmpeq_epi8(c, plus), _mm_cmpeq_epi8(c, comma)));
+		ok = _mm_or_si128(ok, _mm_or_si128(_mm_cmpeq_epi8(c, lower), _mm_cmpeq_epi8(c, upper)));
+		ok = _mm_or_si128(ok, _mm_or_si128(_mm_cmpeq_epi8(c, space), _mm_cmpeq_epi8(c, tab)));
+		ok = _mm_or_si128(ok, _mm_or_si128(_mm_cmpeq_epi8(c, cr), _mm_cmpeq_epi8(c, nl)));
+		if (_mm_movemask_epi8(ok) != 0xFFFF)
+		{
+			return false;
+		}
+	}
+#endif
+	for (; i < length; i++)
+	{
+		if (!isNumericChar(data[i]))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Return true if the payload may be a JSON object, i.e. the first
+ * character other than whitespace is an opening brace.
+ *
+ * @param data		The payload
+ * @param length	The length of the payload
+ * @return bool		True if the payload may be a JSON object
+ */
+bool SimpleValue::isObject(const char *data, size_t length)
+{
+	for (size_t i = 0; i < length; i++)
+	{
+		if (!isSpace(data[i]))
+		{
+			return data[i] == '{';
+		}
+	}
+	return false;
+}
+
+/**
+ * Parse a number. Numbers with no more than 19 significant digits and
+ * a small exponent are converted exactly using the mantissa and a power
+ * of 10, any other numbers are converted using strtod.
+ *
+ * @param start		The first character of the number
+ * @param end		The character after the number
+ * @param value		The parsed value
+ * @return bool		True if the characters form a valid number
+ */
+bool SimpleValue::parseNumber(const char *start, const char *end, double& value)
+{
+	const char *p = start;
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+	{
+		negative = *p == '-';
+		p++;
+	}
+
+	uint64_t mantissa = 0;
+	int digits = 0;
+	int exponent = 0;
+	bool any = false;
+	bool truncated = false;
+	for (; p < end && isDigit(*p); p++)
+	{
+		any = true;
+		if (digits < MAX_FAST_DIGITS)
+		{
+			mantissa = mantissa * 10 + (*p - '0');
+			if (mantissa)
+				digits++;
+		}
+		else
+		{
+			exponent++;
+			truncated |= *p != '0';
+		}
+	}
+	if (p < end && *p == '.')
+	{
+		for (p++; p < end && isDigit(*p); p++)
+		{
+			any = true;
+			if (digits < MAX_FAST_DIGITS)
+			{
+				mantissa = mantissa * 10 + (*p - '0');
+				if (mantissa)
+					digits++;
+				exponent--;
+			}
+			else
+			{
+				truncated |= *p != '0';
+			}
+		}
+	}
+	if (!any)
+	{
+		return false;
+	}
+	if (p < end && (*p == 'e' || *p == 'E'))
+	{
+		p++;
+		bool negExp = false;
+		if (p < end && (*p == '-' || *p == '+'))
+		{
+			negExp = *p == '-';
+			p++;
+		}
+		if (p == end || !isDigit(*p))
+		{
+			return false;
+		}
+		int exp = 0;
+		for (; p < end && isDigit(*p); p++)
+		{
+			if (exp < 100000)
+				exp = exp * 10 + (*p - '0');
+		}
+		exponent += negExp ? -exp : exp;
+	}
+	if (p != end)
+	{
+		return false;
+	}
+
+	if (!truncated && mantissa <= MAX_EXACT_MANTISSA
+			&& exponent >= -MAX_EXACT_POWER && exponent <= MAX_EXACT_POWER)
+	{
+		value = (double)mantissa;
+		if (exponent < 0)
+			value /= powersOf10[-exponent];
+		else
+			value *= powersOf10[exponent];
+		if (negative)
+			value = -value;
+		return true;
+	}
+
+	// Slow path, the number is not NULL terminated so copy it for strtod
+	string number(start, end - start);
+	value = strtod(number.c_str(), NULL);
+	return true;
+}
+
+/**
+ * Parse one of the keywords true, false, nan or inf. The comparison
+ * is case insensitive and nan and inf may be signed.
+ *
+ * @param start		The first character of the keyword
+ * @param end		The character after the keyword
+ * @param value		The value of the keyword
+ * @param boolean	Set true if the keyword is a boolean
+ * @return bool		True if the characters are a valid keyword
+ */
+bool SimpleValue::parseKeyword(const char *start, const char *end, double& value, bool& boolean)
+{
+	size_t len = end - start;
+	boolean = false;
+	if (len == 4 && strncasecmp(start, "true", 4) == 0)
+	{
+		boolean = true;
+		value = 1;
+		return true;
+	}
+	if (len == 5 && strncasecmp(start, "false", 5) == 0)
+	{
+		boolean = true;
+		value = 0;
+		return true;
+	}
+	bool negative = false;
+	if (len > 0 && (*start == '-' || *start == '+'))
+	{
+		negative = *start == '-';
+		start++;
+		len--;
+	}
+	if (len == 3 && strncasecmp(start, "nan", 3) == 0)
+	{
+		value = negative ? -NAN : NAN;
+		return true;
+	}
+	if ((len == 3 && strncasecmp(start, "inf", 3) == 0)
+			|| (len == 8 && strncasecmp(start, "infinity", 8) == 0))
+	{
+		value = negative ? -INFINITY : INFINITY;
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Parse a payload of one or more simple values into datapoints
+ *
+ * @param data		The payload
+ * @param length	The length of the payload
+ * @param name		The datapoint name
+ * @param points	The vector to which datapoints are appended
+ * @return bool		True if the payload was parsed, no datapoints are added otherwise
+ */
+bool SimpleValue::parse(const char *data, size_t length, const string& name,
+		vector<Datapoint *>& points)
+{
+	const char *p = data;
+	const char *end = data + length;
+
+	while (p < end && isSpace(*p))
+		p++;
+	while (end > p && isSpace(end[-1]))
+		end--;
+	if (p == end)
+	{
+		return false;
+	}
+
+	bool numeric = isNumeric(p, end - p);
+	bool commas = memchr(p, ',', end - p) != NULL;
+	vector<double> values;
+	vector<bool> booleans;
+	while (true)
+	{
+		const char *token = p;
+		while (p < end && *p != ',' && !isSpace(*p))
+			p++;
+		double value;
+		bool boolean = false;
+		if (!parseNumber(token, p, value)
+				&& (numeric || !parseKeyword(token, p, value, boolean)))
+		{
+			return false;
+		}
+		values.push_back(value);
+		booleans.push_back(boolean);
+
+		while (p < end && isSpace(*p))
+			p++;
+		if (p == end)
+		{
+			break;
+		}
+		if (commas)
+		{
+			if (*p != ',')
+			{
+				return false;
+			}
+			p++;
+			while (p < end && isSpace(*p))
+				p++;
+			if (p == end)
+			{
+				return false;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < values.size(); i++)
+	{
+		string dpname = name;
+		if (values.size() > 1)
+		{
+			dpname += "_" + to_string(i);
+		}
+		if (booleans[i])
+		{
+			DatapointValue dpv((long)values[i]);
+			points.push_back(new Datapoint(dpname, dpv));
+		}
+		else
+		{
+			DatapointValue dpv(values[i]);
+			points.push_back(new Datapoint(dpname, dpv));
+		}
+	}
+	return true;
+}
@@ -0,0 +1,308 @@
+/*
+ * FogLAMP "MQTTScripted" spill buffer.
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <spill_buffer.h>
+#include <logger.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <atomic>
+
+using namespace std;
+
+/**
+ * Construct a spill buffer, the buffer must be opened before use
+ */
+SpillBuffer::SpillBuffer() : m_header(NULL), m_data(NULL), m_size(0), m_mapSize(0),
+	m_fd(-1), m_entries(0)
+{
+}
+
+/**
+ * Destructor for the spill buffer. Any records that have not been read
+ * remain in the file.
+ */
+SpillBuffer::~SpillBuffer()
+{
+	close();
+}
+
+/**
+ * Open the file that holds the buffer. If the file already holds records
+ * that have not been read they are recovered, and the existing size of
+ * the buffer is kept until the file is next opened after they have been
+ * read. Otherwise the file is created, or recreated, with the requested
+ * size. The disk space for the file is reserved when it is opened.
+ *
+ * @param path		The path of the file
+ * @param size		The size of the data area in bytes
+ * @return bool		False if the file could not be opened
+ */
+bool SpillBuffer::open(const string& path, size_t size)
+{
+	Logger *logger = Logger::getLogger();
+
+	close();
+	size = (size + 7) & ~(size_t)7;
+	if ((m_fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644)) == -1)
+	{
+		logger->error("Unable to open the spill file %s: %s", path.c_str(), strerror(errno));
+		return false;
+	}
+
+	Header header;
+	struct stat statb;
+	bool pending = false;
+	if (fstat(m_fd, &statb) == 0 && pread(m_fd, &header, sizeof(header), 0) == sizeof(header)
+			&& header.magic == SPILL_MAGIC && header.version == SPILL_VERSION
+			&& (uint64_t)statb.st_size == SPILL_HEADER_SIZE + header.size
+			&& header.head != header.tail)
+	{
+		pending = true;
+		if (header.size != size)
+		{
+			logger->warn("The spill file %s holds messages that have not been processed, the new size of the spill buffer will be used when the service is restarted after they have been",
+					path.c_str());
+		}
+		size = header.size;
+	}
+	else if (ftruncate(m_fd, 0) != 0)
+	{
+		logger->error("Unable to size the spill file %s: %s", path.c_str(), strerror(errno));
+		close();
+		return false;
+	}
+
+	// Reserve the disk space for the whole file. Writing to a page of a
+	// sparse file that can not be allocated as the disk is full would
+	// raise SIGBUS in the thread appending the message.
+	int rc = posix_fallocate(m_fd, 0, SPILL_HEADER_SIZE + size);
+	if (rc != 0)
+	{
+		logger->error("Unable to reserve %lu bytes on disk for the spill file %s: %s",
+				(unsigned long)(SPILL_HEADER_SIZE + size), path.c_str(), strerror(rc));
+		close();
+		return false;
+	}
+
+	m_mapSize = SPILL_HEADER_SIZE + size;
+	void *map = mmap(NULL, m_mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+	if (map == MAP_FAILED)
+	{
+		logger->error("Unable to map the spill file %s: %s", path.c_str(), strerror(errno));
+		close();
+		return false;
+	}
+	m_header = (Header *)map;
+	m_data = (char *)map + SPILL_HEADER_SIZE;
+	m_size = size;
+
+	if (!pending)
+	{
+		m_header->magic = SPILL_MAGIC;
+		m_header->version = SPILL_VERSION;
+		m_header->size = size;
+		m_header->head = 0;
+		m_header->tail = 0;
+	}
+	else if (!recover())
+	{
+		logger->warn("The spill file %s was damaged, some messages may have been lost", path.c_str());
+	}
+	if (m_entries)
+	{
+		logger->warn("Recovered %lu messages from the spill file %s", m_entries, path.c_str());
+	}
+	return true;
+}
+
+/**
+ * Unmap and close the file
+ */
+void SpillBuffer::close()
+{
+	if (m_header)
+	{
+		munmap(m_header, m_mapSize);
+		m_header = NULL;
+		m_data = NULL;
+	}
+	if (m_fd != -1)
+	{
+		::close(m_fd);
+		m_fd = -1;
+	}
+	m_size = 0;
+	m_entries = 0;
+}
+
+/**
+ * Return the space a record occupies in the data area
+ *
+ * @param topicLength	The length of the topic
+ * @param payloadLength	The length of the payload
+ * @return size_t	The size of the record
+ */
+size_t SpillBuffer::recordSize(size_t topicLength, size_t payloadLength)
+{
+	return (sizeof(Record) + topicLength + payloadLength + 7) & ~(size_t)7;
+}
+
+/**
+ * Check if a message is small enough to ever be held in the buffer
+ *
+ * @param topicLength	The length of the topic
+ * @param payloadLength	The length of the payload
+ * @return bool		True if the message fits in an empty buffer
+ */
+bool SpillBuffer::fits(size_t topicLength, size_t payloadLength) const
+{
+	return recordSize(topicLength, payloadLength) <= m_size;
+}
+
+/**
+ * Walk the records that have not been read, counting them. If a damaged
+ * record is found the records from that point on are discarded.
+ *
+ * @return bool		False if the buffer was damaged
+ */
+bool SpillBuffer::recover()
+{
+	uint64_t head = m_header->head, tail = m_header->tail;
+	if (head > tail || tail - head > m_size)
+	{
+		// A crash whilst the offsets were being reset leaves the
+		// head beyond the tail, the buffer was empty
+		m_header->head = 0;
+		m_header->tail = 0;
+		return head > tail;
+	}
+	uint64_t offset = head;
+	while (offset < tail)
+	{
+		size_t pos = offset % m_size;
+		size_t remaining = m_size - pos;
+		Record *record = (Record *)(m_data + pos);
+		if (remaining < sizeof(Record) || record->magic == SPILL_WRAP)
+		{
+			offset += remaining;
+			continue;
+		}
+		if (record->magic != SPILL_RECORD
+				|| recordSize(record->topicLength, record->payloadLength) > remaining)
+		{
+			break;
+		}
+		offset += recordSize(record->topicLength, record->payloadLength);
+		m_entries++;
+	}
+	if (offset != tail)
+	{
+		m_header->tail = offset > tail ? tail : offset;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Append a message to the buffer
+ *
+ * @param topic		The topic the message was received on
+ * @param topicLength	The length of the topic
+ * @param payload	The payload of the message
+ * @param payloadLength	The length of the payload
+ * @param received	The time the message was received
+ * @return bool		False if there is not enough space in the buffer
+ */
+bool SpillBuffer::append(const char *topic, size_t topicLength, const void *payload, size_t payloadLength,
+		const struct timeval& received)
+{
+	size_t length = recordSize(topicLength, payloadLength);
+	uint64_t tail = m_header->tail;
+	size_t pos = tail % m_size;
+	size_t remaining = m_size - pos;
+	size_t skip = remaining < length ? remaining : 0;
+	if (used() + skip + length > m_size)
+	{
+		return false;
+	}
+	if (skip && remaining >= sizeof(Record))
+	{
+		((Record *)(m_data + pos))->magic = SPILL_WRAP;
+	}
+
+	char *dest = m_data + (tail + skip) % m_size;
+	Record *record = (Record *)dest;
+	record->magic = SPILL_RECORD;
+	record->topicLength = topicLength;
+	record->payloadLength = payloadLength;
+	record->reserved = 0;
+	record->seconds = received.tv_sec;
+	record->microseconds = received.tv_usec;
+	memcpy(dest + sizeof(Record), topic, topicLength);
+	memcpy(dest + sizeof(Record) + topicLength, payload, payloadLength);
+
+	// The record must be complete before it is made visible
+	atomic_thread_fence(memory_order_release);
+	m_header->tail = tail + skip + length;
+	m_entries++;
+	return true;
+}
+
+/**
+ * Remove the oldest message from the buffer. The topic and payload are
+ * copied into a single allocated buffer, topic first, which the caller
+ * must free.
+ *
+ * @param buffer	Set to the allocated buffer
+ * @param topicLength	Set to the length of the topic
+ * @param payloadLength	Set to the length of the payload
+ * @param received	Set to the time the message was received
+ * @return bool		False if the buffer is empty
+ */
+bool SpillBuffer::read(char **buffer, size_t& topicLength, size_t& payloadLength, struct timeval& received)
+{
+	if (empty())
+	{
+		return false;
+	}
+	uint64_t head = m_header->head;
+	size_t pos = head % m_size;
+	size_t remaining = m_size - pos;
+	if (remaining < sizeof(Record) || ((Record *)(m_data + pos))->magic == SPILL_WRAP)
+	{
+		head += remaining;
+		pos = 0;
+	}
+	Record *record = (Record *)(m_data + pos);
+	topicLength = record->topicLength;
+	payloadLength = record->payloadLength;
+	received.tv_sec = record->seconds;
+	received.tv_usec = record->microseconds;
+	*buffer = (char *)malloc(topicLength + payloadLength + 1);
+	memcpy(*buffer, m_data + pos + sizeof(Record), topicLength + payloadLength);
+	(*buffer)[topicLength + payloadLength] = 0;
+
+	head += recordSize(topicLength, payloadLength);
+	m_header->head = head;
+	if (head == m_header->tail)
+	{
+		// Start again at the beginning of the data area when empty.
+		// The tail is reset first, a crash between the two leaves the
+		// head beyond the tail which is recovered as an empty buffer
+		m_header->tail = 0;
+		m_header->head = 0;
+	}
+	m_entries--;
+	return true;
+}
@@ -0,0 +1,157 @@
+/*
+ * FogLAMP "MQTTScripted" stage latency timers.
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <stage_timer.h>
+
+using namespace std;
+
+const int LatencyHistogram::SUB_BUCKETS;
+const int LatencyHistogram::BUCKETS;
+
+atomic<bool> StageTimers::m_enabled(false);
+LatencyHistogram StageTimers::m_histograms[StageTimers::STAGES];
+thread_local uint64_t *StageTimers::m_capture = NULL;
+
+/**
+ * Construct an empty histogram
+ */
+LatencyHistogram::LatencyHistogram() : m_max(0)
+{
+	for (int i = 0; i < BUCKETS; i++)
+	{
+		m_buckets[i].store(0, memory_order_relaxed);
+	}
+}
+
+/**
+ * Return the largest value that is counted in a bucket
+ *
+ * @param bucket	The bucket
+ * @return uint64_t	The largest value of the bucket
+ */
+uint64_t LatencyHistogram::upperBound(int bucket)
+{
+	if (bucket < SUB_BUCKETS)
+	{
+		return bucket;
+	}
+	int shift = bucket / SUB_BUCKETS - 1;
+	uint64_t lower = (uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+	return lower + ((uint64_t)1 << shift) - 1;
+}
+
+/**
+ * Summarise the values recorded in the histogram. The percentiles are
+ * reported as the largest value of the bucket in which they fall.
+ *
+ * @param summary	The summary to populate
+ * @param reset		Clear the histogram once it has been summarised
+ */
+void LatencyHistogram::collect(Summary& summary, bool reset)
+{
+	uint64_t counts[BUCKETS];
+	summary.count = 0;
+	for (int i = 0; i < BUCKETS; i++)
+	{
+		counts[i] = reset ? m_buckets[i].exchange(0, memory_order_relaxed)
+				: m_buckets[i].load(memory_order_relaxed);
+		summary.count += counts[i];
+	}
+	summary.max = reset ? m_max.exchange(0, memory_order_relaxed) : m_max.load(memory_order_relaxed);
+	summary.p50 = summary.p99 = summary.p999 = 0;
+	if (summary.count == 0)
+	{
+		return;
+	}
+
+	// The rank of each percentile, rounded up
+	uint64_t r50 = (summary.count * 500 + 999) / 1000;
+	uint64_t r99 = (summary.count * 990 + 999) / 1000;
+	uint64_t r999 = (summary.count * 999 + 999) / 1000;
+	uint64_t seen = 0;
+	for (int i = 0; i < BUCKETS && seen < r999; i++)
+	{
+		if (counts[i] == 0)
+		{
+			continue;
+		}
+		seen += counts[i];
+		uint64_t value = upperBound(i);
+		if (value > summary.max)
+		{
+			value = summary.max;
+		}
+		if (summary.p50 == 0 && seen >= r50)
+			summary.p50 = value;
+		if (summary.p99 == 0 && seen >= r99)
+			summary.p99 = value;
+		if (seen >= r999)
+			summary.p999 = value;
+	}
+}
+
+/**
+ * Return if the timers have been built into the plugin
+ *
+ * @return bool	True if the timers are available
+ */
+bool StageTimers::compiled()
+{
+#ifdef STAGE_TIMERS
+	return true;
+#else
+	return false;
+#endif
+}
+
+/**
+ * Enable or disable the timing of the stages. The histograms are cleared
+ * when timing is enabled.
+ *
+ * @param enabled	True to enable timing
+ */
+void StageTimers::setEnabled(bool enabled)
+{
+	if (enabled && !m_enabled)
+	{
+		LatencyHistogram::Summary summary;
+		for (int i = 0; i < STAGES; i++)
+		{
+			m_histograms[i].collect(summary, true);
+		}
+	}
+	m_enabled = enabled && compiled();
+}
+
+/**
+ * Return the name of a stage
+ *
+ * @param stage		The stage
+ * @return const char*	The name of the stage
+ */
+const char *StageTimers::name(Stage stage)
+{
+	switch (stage)
+	{
+		case Queue:
+			return "queue";
+		case Parse:
+			return "parse";
+		case Script:
+			return "script";
+		case Timestamp:
+			return "timestamp";
+		case Document:
+			return "document";
+		case Ingest:
+			return "ingest";
+		default:
+			return "unknown";
+	}
+}
@@ -0,0 +1,184 @@
+/*
+ * FogLAMP "MQTTScripted" topic subscriptions.
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <subscription.h>
+#include <rapidjson/document.h>
+
+using namespace std;
+using namespace rapidjson;
+
+/**
+ * Return a string member of a subscription, or a default value if the
+ * member is not present
+ *
+ * @param entry		The subscription object
+ * @param name		The name of the member
+ * @param def		The default value
+ * @return string	The value of the member
+ */
+static string member(const Value& entry, const char *name, const string& def)
+{
+	if (entry.HasMember(name) && entry[name].IsString())
+	{
+		return entry[name].GetString();
+	}
+	return def;
+}
+
+/**
+ * Create the set of subscriptions from the configuration
+ *
+ * @param config	The configuration category
+ * @param policy	The object policy of the primary subscription
+ * @param script	The script of the primary subscription, empty if there is none
+ */
+Subscriptions::Subscriptions(const ConfigCategory& config, shared_ptr<ObjectPolicy> policy,
+		const string& script)
+{
+	m_logger = Logger::getLogger();
+	string topic = config.getValue("topic");
+	string datapoint;
+	if (config.itemExists("datapoint"))
+	{
+		datapoint = config.getValue("datapoint");
+	}
+	m_subscriptions.emplace_back(topic, config.getValue("asset"), datapoint, policy, script);
+	if (!m_matcher.add(topic, PRIMARY))
+	{
+		m_logger->error("The topic '%s' is not a valid MQTT topic filter", topic.c_str());
+	}
+	if (config.itemExists("subscriptions"))
+	{
+		addSubscriptions(config, policy, datapoint);
+	}
+}
+
+/**
+ * Add the subscriptions defined in the subscriptions configuration item.
+ * Any of the asset name, datapoint name, object policy and timestamp
+ * settings that are not given for a subscription are taken from the
+ * primary subscription.
+ *
+ * @param config	The configuration category
+ * @param policy	The object policy of the primary subscription
+ * @param datapoint	The datapoint name of the primary subscription
+ */
+void Subscriptions::addSubscriptions(const ConfigCategory& config, shared_ptr<ObjectPolicy> policy,
+		const string& datapoint)
+{
+	Document doc;
+	doc.Parse(config.getValue("subscriptions").c_str());
+	if (doc.HasParseError() || !doc.IsObject())
+	{
+		m_logger->error("The subscriptions configuration is not a valid JSON object");
+		return;
+	}
+	if (!doc.HasMember("subscriptions"))
+	{
+		return;
+	}
+	const Value& list = doc["subscriptions"];
+	if (!list.IsArray())
+	{
+		m_logger->error("The subscriptions configuration should contain an array called 'subscriptions'");
+		return;
+	}
+	for (auto& entry : list.GetArray())
+	{
+		if (!entry.IsObject() || !entry.HasMember("topic") || !entry["topic"].IsString())
+		{
+			m_logger->error("Each subscription must be an object with a topic, the subscription will be ignored");
+			continue;
+		}
+		string topic = entry["topic"].GetString();
+		bool duplicate = false;
+		for (auto& subscription : m_subscriptions)
+		{
+			if (subscription.getTopic().compare(topic) == 0)
+				duplicate = true;
+		}
+		if (duplicate)
+		{
+			m_logger->warn("Topic '%s' is subscribed to more than once, only the first subscription will be used",
+					topic.c_str());
+			continue;
+		}
+		if (!m_matcher.add(topic, m_subscriptions.size()))
+		{
+			m_logger->error("The topic '%s' is not a valid MQTT topic filter, the subscription will be ignored",
+					topic.c_str());
+			continue;
+		}
+
+		shared_ptr<ObjectPolicy> subscriptionPolicy = policy;
+		if (entry.HasMember("policy") || entry.HasMember("timestamp")
+				|| entry.HasMember("format") || entry.HasMember("timezone"))
+		{
+			subscriptionPolicy = make_shared<ObjectPolicy>(
+					member(entry, "policy", config.getValue("policy")),
+					member(entry, "timestamp", config.getValue("timestamp")),
+					member(entry, "format", config.getValue("format")),
+					member(entry, "timezone", config.getValue("timezone")));
+		}
+		m_subscriptions.emplace_back(topic, member(entry, "asset", config.getValue("asset")),
+				member(entry, "datapoint", datapoint), subscriptionPolicy,
+				member(entry, "script", ""));
+	}
+}
+
+/**
+ * Return the subscription a message was received on. If a topic matches
+ * more than one subscription the first one is used, messages that do not
+ * match any subscription are processed by the primary subscription.
+ *
+ * @param topic		The topic name of the message
+ * @param length	The length of the topic name
+ * @return size_t	The index of the subscription
+ */
+size_t Subscriptions::match(const char *topic, size_t length) const
+{
+	int index = m_matcher.match(topic, length);
+	return index < 0 ? PRIMARY : (size_t)index;
+}
+
+/**
+ * Check if another set of subscriptions subscribes to the same topics
+ *
+ * @param other		The other set of subscriptions
+ * @return bool		True if the topics are the same
+ */
+bool Subscriptions::sameTopics(const Subscriptions& other) const
+{
+	if (m_subscriptions.size() != other.m_subscriptions.size())
+	{
+		return false;
+	}
+	for (size_t i = 0; i < m_subscriptions.size(); i++)
+	{
+		if (m_subscriptions[i].getTopic().compare(other.m_subscriptions[i].getTopic()))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Return the topics of the subscriptions
+ *
+ * @param topics	The vector to populate with the topics
+ */
+void Subscriptions::getTopics(vector<string>& topics) const
+{
+	topics.clear();
+	for (auto& subscription : m_subscriptions)
+	{
+		topics.push_back(subscription.getTopic());
+	}
+}
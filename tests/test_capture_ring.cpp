@@ -0,0 +1,91 @@
+#include <gtest/gtest.h>
+#include <capture_ring.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+TEST(MQTTScripted, CaptureRingWraps)
+{
+	CaptureRing ring;
+	ASSERT_EQ(ring.enabled(), false);
+	ring.resize(3);
+	ASSERT_EQ(ring.enabled(), true);
+
+	uint64_t stages[StageTimers::STAGES] = { 0 };
+	string topic = "sensor/temperature";
+	for (int i = 0; i < 5; i++)
+	{
+		string payload = to_string(i);
+		MQTTPayload message(payload, topic);
+		ring.record(message, CaptureRing::SimpleValue, 1, 1000, stages);
+	}
+
+	// Only the three most recent messages are held, oldest first
+	vector<string> entries;
+	ring.dump(entries);
+	ASSERT_EQ(entries.size(), 3U);
+	ASSERT_NE(entries[0].find("\"payload\" : \"2\""), string::npos);
+	ASSERT_NE(entries[2].find("\"payload\" : \"4\""), string::npos);
+	ASSERT_NE(entries[2].find("\"topic\" : \"sensor/temperature\""), string::npos);
+	ASSERT_NE(entries[2].find("\"result\" : \"simple value\""), string::npos);
+	ASSERT_NE(entries[2].find("\"elapsed\" : 1.0"), string::npos);
+
+	ring.clear();
+	entries.clear();
+	ring.dump(entries);
+	ASSERT_EQ(entries.size(), 0U);
+}
+
+TEST(MQTTScripted, CaptureRingTruncates)
+{
+	CaptureRing ring;
+	ring.resize(1);
+	string payload(CAPTURE_PAYLOAD_SIZE + 100, 'x');
+	payload[0] = '"';
+	payload[1] = '\n';
+	uint64_t stages[StageTimers::STAGES] = { 0 };
+	stages[StageTimers::Script] = 2500;
+	string topic = "topic";
+	MQTTPayload message(payload, topic);
+	ring.record(message, CaptureRing::Script, 2, 5000, stages);
+
+	vector<string> entries;
+	ring.dump(entries);
+	ASSERT_EQ(entries.size(), 1U);
+	// The payload is escaped and truncated, the original length is kept
+	string expected = "\"payload\" : \"\\\"\\u000a" + string(CAPTURE_PAYLOAD_SIZE - 2, 'x') + "\"";
+	ASSERT_NE(entries[0].find(expected), string::npos);
+	ASSERT_NE(entries[0].find("\"length\" : " + to_string(CAPTURE_PAYLOAD_SIZE + 100)), string::npos);
+	ASSERT_NE(entries[0].find("\"stages\" : { \"script\" : 2.5 }"), string::npos);
+
+	ring.resize(0);
+	ASSERT_EQ(ring.enabled(), false);
+	ring.record(message, CaptureRing::Script, 2, 5000, stages);
+	entries.clear();
+	ring.dump(entries);
+	ASSERT_EQ(entries.size(), 0U);
+}
+
+TEST(MQTTScripted, CaptureRingScriptMessages)
+{
+	CaptureRing ring;
+	ring.resize(4);
+	uint64_t stages[StageTimers::STAGES] = { 0 };
+	string topic = "sensor";
+	string converted = "converted", rejected = "rejected";
+	string truncated(CAPTURE_PAYLOAD_SIZE + 1, 'x');
+	MQTTPayload message1(converted, topic), message2(rejected, topic), message3(truncated, topic);
+	ring.record(message1, CaptureRing::Script, 1, 1000, stages);
+	ring.record(message2, CaptureRing::Failed, 0, 1000, stages);
+	ring.record(message3, CaptureRing::ScriptBatch, 1, 1000, stages);
+	ring.record(message1, CaptureRing::ScriptBatch, 1, 1000, stages);
+
+	// Only the complete messages converted by a script are returned
+	vector<pair<string, string> > messages;
+	ring.scriptMessages(messages);
+	ASSERT_EQ(messages.size(), 2U);
+	ASSERT_EQ(messages[0].first, converted);
+	ASSERT_EQ(messages[0].second, topic);
+	ASSERT_EQ(messages[1].first, converted);
+}
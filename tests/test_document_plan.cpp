@@ -0,0 +1,50 @@
+#include <gtest/gtest.h>
+#include <string>
+#include <document_plan.h>
+
+using namespace std;
+using namespace rapidjson;
+
+TEST(MQTTScripted, DocumentPlanShape)
+{
+	ObjectPolicy policy("Multiple readings & collapse", "ts", "", "+00:00");
+	PlanCache cache;
+	Document doc1, doc2, doc3;
+	doc1.Parse("{ \"a\" : 1, \"ts\" : 1622550645, \"motor\" : { \"speed\" : 2.5, \"current\" : 3 } }");
+	doc2.Parse("{ \"a\" : 7, \"ts\" : 1622550646, \"motor\" : { \"speed\" : 1.5, \"current\" : 4 } }");
+	doc3.Parse("{ \"a\" : 7, \"b\" : \"text\" }");
+
+	const DocumentPlan *plan = cache.getPlan("sensor", doc1, policy);
+	ASSERT_EQ(cache.misses(), 1);
+	ASSERT_EQ(plan->matches(doc2), true);
+	ASSERT_EQ(plan->matches(doc3), false);
+	ASSERT_EQ(cache.getPlan("sensor", doc2, policy), plan);
+	ASSERT_EQ(cache.hits(), 1);
+
+	DatapointPool pool;
+	vector<Reading *> readings;
+	plan->createReadings(doc2, policy, "test", readings, pool);
+	ASSERT_EQ(readings.size(), 2);
+	ASSERT_EQ(readings[0]->getAssetName(), "motor");
+	ASSERT_EQ(readings[0]->getDatapointCount(), 2);
+	ASSERT_EQ(readings[1]->getAssetName(), "test");
+	ASSERT_EQ(readings[1]->getDatapointCount(), 1);
+	struct timeval tv;
+	readings[1]->getUserTimestamp(&tv);
+	ASSERT_EQ(tv.tv_sec, 1622550646);
+	for (auto reading : readings)
+		delete reading;
+
+	// The scratch vectors are reused for the next document
+	readings.clear();
+	plan->createReadings(doc1, policy, "test", readings, pool);
+	ASSERT_EQ(readings.size(), 2);
+	ASSERT_EQ(pool.acquired(), 4);
+	ASSERT_GT(pool.reused(), 0);
+	for (auto reading : readings)
+		delete reading;
+
+	// A change of shape compiles a new plan
+	ASSERT_NE(cache.getPlan("sensor", doc3, policy), plan);
+	ASSERT_EQ(cache.misses(), 2);
+}
@@ -0,0 +1,46 @@
+#include <gtest/gtest.h>
+#include <duplicate_filter.h>
+#include <string.h>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+static bool received(DuplicateFilter& filter, int client, const string& topic, const string& payload)
+{
+	return filter.duplicate(client, topic.c_str(), topic.length(), payload.c_str(), payload.length());
+}
+
+TEST(MQTTScripted, DuplicateBothClients)
+{
+	DuplicateFilter filter;
+	// Each message delivered to both clients is only accepted once,
+	// whichever client receives it first
+	ASSERT_EQ(received(filter, 0, "site/1/power", "{\"kw\":1}"), false);
+	ASSERT_EQ(received(filter, 1, "site/2/power", "{\"kw\":2}"), false);
+	ASSERT_EQ(received(filter, 1, "site/1/power", "{\"kw\":1}"), true);
+	ASSERT_EQ(received(filter, 0, "site/2/power", "{\"kw\":2}"), true);
+	// The same payload on another topic is a different message
+	ASSERT_EQ(received(filter, 1, "site/3/power", "{\"kw\":1}"), false);
+}
+
+TEST(MQTTScripted, DuplicateRepeatedMessages)
+{
+	DuplicateFilter filter;
+	// A message published twice is accepted twice
+	ASSERT_EQ(received(filter, 0, "state", "on"), false);
+	ASSERT_EQ(received(filter, 0, "state", "on"), false);
+	ASSERT_EQ(received(filter, 1, "state", "on"), true);
+	ASSERT_EQ(received(filter, 1, "state", "on"), true);
+	ASSERT_EQ(received(filter, 1, "state", "on"), false);
+}
+
+TEST(MQTTScripted, DuplicateWindow)
+{
+	DuplicateFilter filter(50);
+	ASSERT_EQ(received(filter, 0, "state", "on"), false);
+	this_thread::sleep_for(chrono::milliseconds(100));
+	ASSERT_EQ(received(filter, 1, "state", "on"), false);
+	filter.clear();
+	ASSERT_EQ(received(filter, 0, "state", "on"), false);
+}
@@ -0,0 +1,56 @@
+#include <gtest/gtest.h>
+#include <flow_control.h>
+#include <thread>
+
+using namespace std;
+
+TEST(MQTTScripted, FlowControlQueue)
+{
+	FlowControl flow;
+	flow.configure(FlowControl::Block, 80, 0);
+	ASSERT_EQ(flow.queued(79, 100), FlowControl::Unchanged);
+	ASSERT_EQ(flow.underPressure(), false);
+	ASSERT_EQ(flow.queued(80, 100), FlowControl::Pressure);
+	ASSERT_EQ(flow.underPressure(), true);
+	ASSERT_EQ(flow.queued(90, 100), FlowControl::Unchanged);
+	ASSERT_EQ(flow.queued(41, 100), FlowControl::Unchanged);
+	ASSERT_EQ(flow.underPressure(), true);
+	ASSERT_EQ(flow.queued(40, 100), FlowControl::Relieved);
+	ASSERT_EQ(flow.underPressure(), false);
+}
+
+TEST(MQTTScripted, FlowControlLatency)
+{
+	FlowControl flow;
+	flow.configure(FlowControl::Discard, 80, 100);
+	// A slow ingest with nothing queued does not apply pressure
+	ASSERT_EQ(flow.ingested(500), FlowControl::Unchanged);
+	ASSERT_EQ(flow.queued(1, 100), FlowControl::Pressure);
+	ASSERT_EQ(flow.ingested(60), FlowControl::Unchanged);
+	ASSERT_EQ(flow.ingested(50), FlowControl::Relieved);
+	ASSERT_EQ(flow.ingested(500), FlowControl::Pressure);
+	ASSERT_EQ(flow.queued(0, 100), FlowControl::Relieved);
+	flow.discarded();
+	flow.discarded();
+	ASSERT_EQ(flow.getDiscarded(), 2UL);
+	ASSERT_EQ(flow.getDiscarded(), 0UL);
+}
+
+TEST(MQTTScripted, FlowControlWait)
+{
+	FlowControl flow;
+	flow.configure(FlowControl::Block, 50, 0);
+	ASSERT_EQ(flow.queued(5, 10), FlowControl::Pressure);
+	ASSERT_EQ(flow.wait(10), false);
+	thread drain([&flow] { flow.queued(0, 10); });
+	ASSERT_EQ(flow.wait(10000), true);
+	drain.join();
+	ASSERT_EQ(flow.queued(5, 10), FlowControl::Pressure);
+	flow.shutdown();
+	ASSERT_EQ(flow.wait(10000), true);
+
+	FlowControl::Policy policy;
+	ASSERT_EQ(FlowControl::parsePolicy("Pause", policy), true);
+	ASSERT_EQ(policy, FlowControl::Pause);
+	ASSERT_EQ(FlowControl::parsePolicy("Stop", policy), false);
+}
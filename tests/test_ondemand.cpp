@@ -0,0 +1,41 @@
+#include <gtest/gtest.h>
+#include <string.h>
+#include <string>
+#include <ondemand_parser.h>
+
+using namespace std;
+
+TEST(MQTTScripted, OnDemandCollapse)
+{
+	if (!OnDemandParser::available())
+		return;
+	OnDemandParser parser;
+	ObjectPolicy policy("Single reading & collapse", "timestamp", "", "+00:00");
+	string message = "{ \"a\" : 1, \"b\" : 2.5, \"c\" : \"text\", \"d\" : { \"e\" : 3 }, \"timestamp\" : 1622550645 }";
+	string topic = "unittest";
+	MQTTPayload payload(message, topic);
+	vector<Reading *> readings;
+	ASSERT_EQ(parser.parse(payload, policy, "test", readings), true);
+	ASSERT_EQ(readings.size(), 1);
+	ASSERT_EQ(readings[0]->getDatapointCount(), 4);
+	struct timeval tv;
+	readings[0]->getUserTimestamp(&tv);
+	ASSERT_EQ(tv.tv_sec, 1622550645);
+	delete readings[0];
+}
+
+TEST(MQTTScripted, OnDemandInvalid)
+{
+	if (!OnDemandParser::available())
+		return;
+	OnDemandParser parser;
+	ObjectPolicy policy("Multiple readings & collapse", "", "", "+00:00");
+	const char *messages[] = { "42", "{ \"a\" : { \"b\" : 1 }, \"c\" : }", "{ \"a\" : 1 } trailing" };
+	for (auto message : messages)
+	{
+		MQTTPayload payload(message, strlen(message), "unittest", 8);
+		vector<Reading *> readings;
+		ASSERT_EQ(parser.parse(payload, policy, "test", readings), false);
+		ASSERT_EQ(readings.size(), 0);
+	}
+}
@@ -3,6 +3,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
 #include <python_script.h>
 #include <rapidjson/document.h>
 
@@ -149,3 +152,311 @@ TEST(MQTTScripted, NoFile)
 	ASSERT_EQ(doc, (Document *)0);
 }
 
+
+TEST(MQTTScripted, EmbeddedNull)
+{
+	PythonScript python("Test1");
+	const char *fname = "embedded.py";
+	FILE *fp = fopen(fname, "w");
+	fprintf(fp, "def convert(message, topic):\n");
+	fprintf(fp, "    return { \"length\" : len(message) }\n");
+	fclose(fp);
+	ASSERT_EQ(python.setScript(fname), true);
+	string message("a\0b\xff", 4);
+	string topic = "unittest";
+	string asset = "test1";
+	Document *doc = python.execute(message, topic, asset);
+	ASSERT_NE(doc, (Document *)0);
+	ASSERT_EQ(doc->HasMember("length"), true);
+	ASSERT_EQ((*doc)["length"].GetInt(), 4);
+	delete doc;
+	unlink(fname);
+}
+
+TEST(MQTTScripted, DirectReadings)
+{
+	PythonScript python("Test1");
+	const char *fname = "direct.py";
+	FILE *fp = fopen(fname, "w");
+	fprintf(fp, "def convert(message, topic):\n");
+	fprintf(fp, "    return { \"a\" : 1, \"b\" : 2.5, \"motor\" : { \"speed\" : 100, \"state\" : \"on\" } }\n");
+	fclose(fp);
+	ASSERT_EQ(python.setScript(fname), true);
+	string message = "{ \"a\" : \"b\" }";
+	string topic = "unittest";
+	MQTTPayload payload(message, topic);
+
+	ObjectPolicy collapse("Single reading & collapse", "", "", "+00:00");
+	string asset = "test1";
+	vector<Reading *> readings;
+	ASSERT_EQ(python.execute(payload, collapse, asset, readings), true);
+	ASSERT_EQ(readings.size(), 1);
+	ASSERT_EQ(readings[0]->getDatapointCount(), 4);
+	ASSERT_STREQ(readings[0]->getAssetName().c_str(), "test1");
+	for (auto reading : readings)
+		delete reading;
+	readings.clear();
+
+	ObjectPolicy multiple("Multiple readings & collapse", "", "", "+00:00");
+	ASSERT_EQ(python.execute(payload, multiple, asset, readings), true);
+	ASSERT_EQ(readings.size(), 2);
+	ASSERT_STREQ(readings[0]->getAssetName().c_str(), "motor");
+	ASSERT_EQ(readings[0]->getDatapointCount(), 2);
+	ASSERT_STREQ(readings[1]->getAssetName().c_str(), "test1");
+	ASSERT_EQ(readings[1]->getDatapointCount(), 2);
+	for (auto reading : readings)
+		delete reading;
+	unlink(fname);
+}
+
+TEST(MQTTScripted, BatchConvert)
+{
+	PythonScript python("Test1");
+	const char *fname = "batch.py";
+	FILE *fp = fopen(fname, "w");
+	fprintf(fp, "def convert(message, topic):\n");
+	fprintf(fp, "    return { \"length\" : len(message) }\n");
+	fprintf(fp, "def convert_batch(messages, topics):\n");
+	fprintf(fp, "    return [ (t, { \"length\" : len(m) }) for m, t in zip(messages, topics) ]\n");
+	fclose(fp);
+	ASSERT_EQ(python.setScript(fname), true);
+	ASSERT_EQ(python.hasBatch(), true);
+	vector<MQTTPayload> payloads;
+	payloads.emplace_back("1", 1, "first", 5);
+	payloads.emplace_back("22", 2, "second", 6);
+	payloads.emplace_back("333", 3, "third", 5);
+
+	ObjectPolicy policy("Single reading from root level", "", "", "+00:00");
+	vector<Reading *> readings;
+	ASSERT_EQ(python.executeBatch(payloads, policy, "test1", readings), true);
+	ASSERT_EQ(readings.size(), 3);
+	ASSERT_STREQ(readings[0]->getAssetName().c_str(), "first");
+	ASSERT_STREQ(readings[2]->getAssetName().c_str(), "third");
+	for (auto reading : readings)
+		delete reading;
+	unlink(fname);
+}
+
+TEST(MQTTScripted, BatchMemoryViewReleased)
+{
+	PythonScript python("Test1");
+	const char *fname = "batchview.py";
+	FILE *fp = fopen(fname, "w");
+	fprintf(fp, "_kept = []\n");
+	fprintf(fp, "def convert(message, topic):\n");
+	fprintf(fp, "    try:\n");
+	fprintf(fp, "        bytes(_kept[0])\n");
+	fprintf(fp, "        return { \"released\" : 0 }\n");
+	fprintf(fp, "    except ValueError:\n");
+	fprintf(fp, "        return { \"released\" : 1 }\n");
+	fprintf(fp, "def convert_batch(messages, topics):\n");
+	fprintf(fp, "    _kept.append(messages.pop(0))\n");
+	fprintf(fp, "    return [ { \"length\" : len(m) } for m in messages ]\n");
+	fclose(fp);
+	ASSERT_EQ(python.setScript(fname), true);
+	python.setPayloadType(PythonScript::PayloadMemoryView);
+	vector<MQTTPayload> payloads;
+	payloads.emplace_back("1", 1, "first", 5);
+	payloads.emplace_back("22", 2, "second", 6);
+
+	ObjectPolicy policy("Single reading from root level", "", "", "+00:00");
+	vector<Reading *> readings;
+	ASSERT_EQ(python.executeBatch(payloads, policy, "test1", readings), true);
+	for (auto reading : readings)
+		delete reading;
+	readings.clear();
+
+	// The view the script removed from the list and kept has been released
+	string message = "1";
+	string topic = "unittest";
+	string asset = "test1";
+	MQTTPayload payload(message, topic);
+	ASSERT_EQ(python.execute(payload, policy, asset, readings), true);
+	ASSERT_EQ(readings.size(), 1);
+	ASSERT_EQ(readings[0]->getReadingData()[0]->getData().toInt(), 1);
+	for (auto reading : readings)
+		delete reading;
+	unlink(fname);
+}
+
+TEST(MQTTScripted, MemoryViewPayload)
+{
+	PythonScript python("Test1");
+	const char *fname = "memview.py";
+	FILE *fp = fopen(fname, "w");
+	fprintf(fp, "import struct\n");
+	fprintf(fp, "def convert(message, topic):\n");
+	fprintf(fp, "    (value,) = struct.unpack_from('<i', message)\n");
+	fprintf(fp, "    return { \"value\" : value, \"type\" : type(message).__name__ }\n");
+	fclose(fp);
+	ASSERT_EQ(python.setScript(fname), true);
+	python.setPayloadType(PythonScript::PayloadMemoryView);
+	string message("\x2a\x00\x00\x00", 4);
+	string topic = "unittest";
+	string asset = "test1";
+	Document *doc = python.execute(message, topic, asset);
+	ASSERT_NE(doc, (Document *)0);
+	ASSERT_EQ((*doc)["value"].GetInt(), 42);
+	ASSERT_STREQ((*doc)["type"].GetString(), "memoryview");
+	delete doc;
+
+	python.setPayloadType(PythonScript::PayloadBytes);
+	doc = python.execute(message, topic, asset);
+	ASSERT_NE(doc, (Document *)0);
+	ASSERT_EQ((*doc)["value"].GetInt(), 42);
+	ASSERT_STREQ((*doc)["type"].GetString(), "bytes");
+	delete doc;
+	unlink(fname);
+}
+
+TEST(MQTTScripted, SwapScript)
+{
+	PythonScript python("Test1");
+	const char *fname = "swap.py";
+	FILE *fp = fopen(fname, "w");
+	fprintf(fp, "def convert(message, topic):\n");
+	fprintf(fp, "    return { \"version\" : 1 }\n");
+	fclose(fp);
+	ASSERT_EQ(python.setScript(fname), true);
+
+	// A script that fails to compile is not loaded
+	fp = fopen(fname, "w");
+	fprintf(fp, "def convert(message, topic)\n");
+	fprintf(fp, "    return { \"version\" : 2 }\n");
+	fclose(fp);
+	PythonScript *broken = new PythonScript("Test1", &python);
+	ASSERT_EQ(broken->loadScript(fname), false);
+	delete broken;
+
+	fp = fopen(fname, "w");
+	fprintf(fp, "def convert(message, topic):\n");
+	fprintf(fp, "    return { \"version\" : 2 }\n");
+	fclose(fp);
+	PythonScript *candidate = new PythonScript("Test1", &python);
+	ASSERT_EQ(candidate->loadScript(fname), true);
+
+	// The running script is not replaced until the scripts are swapped
+	string message = "{}";
+	string topic = "unittest";
+	string asset = "test1";
+	Document *doc = python.execute(message, topic, asset);
+	ASSERT_NE(doc, (Document *)0);
+	ASSERT_EQ((*doc)["version"].GetInt(), 1);
+	delete doc;
+	doc = candidate->execute(message, topic, asset);
+	ASSERT_NE(doc, (Document *)0);
+	ASSERT_EQ((*doc)["version"].GetInt(), 2);
+	delete doc;
+
+	python.swapScript(*candidate);
+	delete candidate;
+	doc = python.execute(message, topic, asset);
+	ASSERT_NE(doc, (Document *)0);
+	ASSERT_EQ((*doc)["version"].GetInt(), 2);
+	delete doc;
+	unlink(fname);
+}
+
+/**
+ * Convert a message with a script and return the number of readings
+ * created, or -1 if the script failed
+ */
+static int convertMessage(PythonScript *python, const ObjectPolicy& policy)
+{
+	string message = "42";
+	string topic = "unittest";
+	string asset = "test1";
+	MQTTPayload payload(message, topic);
+	vector<Reading *> readings;
+	bool converted = python->execute(payload, policy, asset, readings);
+	for (auto reading : readings)
+		delete reading;
+	return converted ? (int)readings.size() : -1;
+}
+
+TEST(MQTTScripted, WorkerInterpreters)
+{
+	const char *fname = "workers.py";
+	FILE *fp = fopen(fname, "w");
+	fprintf(fp, "def convert(message, topic):\n");
+	fprintf(fp, "    return { \"value\" : int(message) }\n");
+	fclose(fp);
+
+	// The first worker uses the main interpreter, the others are given
+	// a sub-interpreter each if the Python version supports them
+	ObjectPolicy policy("Single reading & collapse", "", "", "+00:00");
+	vector<PythonScript *> workers;
+	for (int i = 0; i < 3; i++)
+	{
+		PythonScript *python = new PythonScript("Test1", i > 0);
+		ASSERT_EQ(python->setScript(fname), true);
+		workers.push_back(python);
+	}
+
+	// Use each interpreter from this thread and from a worker thread so
+	// the interpreters have more than one thread state when destroyed
+	atomic<int> converted(0);
+	vector<thread> threads;
+	for (auto python : workers)
+	{
+		ASSERT_EQ(convertMessage(python, policy), 1);
+		threads.push_back(thread([python, &policy, &converted]() {
+			if (convertMessage(python, policy) == 1)
+				converted++;
+		}));
+	}
+	for (auto& t : threads)
+		t.join();
+	ASSERT_EQ(converted.load(), 3);
+
+	for (auto python : workers)
+		delete python;
+	unlink(fname);
+}
+
+#ifdef PYTHON_SUBINTERPRETERS
+TEST(MQTTScripted, MainInterpreterAfterSubInterpreter)
+{
+	const char *fname = "interpreter.py";
+	FILE *fp = fopen(fname, "w");
+	fprintf(fp, "try:\n");
+	fprintf(fp, "    import _interpreters\n");
+	fprintf(fp, "except ImportError:\n");
+	fprintf(fp, "    import _xxsubinterpreters as _interpreters\n");
+	fprintf(fp, "def convert(message, topic):\n");
+	fprintf(fp, "    current = _interpreters.get_current()\n");
+	fprintf(fp, "    return { \"id\" : int(current[0] if isinstance(current, tuple) else current) }\n");
+	fclose(fp);
+	PythonScript primary("Test1");
+	PythonScript sub("Test1", true);
+	ASSERT_EQ(primary.setScript(fname), true);
+	ASSERT_EQ(sub.setScript(fname), true);
+
+	// A thread that has used a sub-interpreter, as the script loader
+	// does, must still run the script of the main interpreter in the
+	// main interpreter
+	long ids[2] = { -1, -1 };
+	thread t([&primary, &sub, &ids]() {
+		ObjectPolicy policy("Single reading & collapse", "", "", "+00:00");
+		PythonScript *scripts[2] = { &sub, &primary };
+		for (int i = 0; i < 2; i++)
+		{
+			string message = "1";
+			string topic = "unittest";
+			string asset = "test1";
+			MQTTPayload payload(message, topic);
+			vector<Reading *> readings;
+			if (scripts[i]->execute(payload, policy, asset, readings) && readings.size() == 1)
+			{
+				ids[i] = readings[0]->getReadingData()[0]->getData().toInt();
+			}
+			for (auto reading : readings)
+				delete reading;
+		}
+	});
+	t.join();
+	ASSERT_NE(ids[0], 0);
+	ASSERT_EQ(ids[1], 0);
+	unlink(fname);
+}
+#endif
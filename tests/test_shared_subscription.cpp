@@ -0,0 +1,79 @@
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+#include <set>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <shared_subscription.h>
+
+using namespace std;
+
+TEST(MQTTScripted, SharedTopic)
+{
+	ASSERT_EQ(SharedSubscription::topic("", "site/+/power"), "site/+/power");
+	ASSERT_EQ(SharedSubscription::topic("south", "site/+/power"), "$share/south/site/+/power");
+	ASSERT_EQ(SharedSubscription::validGroup("south"), true);
+	ASSERT_EQ(SharedSubscription::validGroup(""), false);
+	ASSERT_EQ(SharedSubscription::validGroup("a/b"), false);
+	ASSERT_EQ(SharedSubscription::validGroup("a+"), false);
+	ASSERT_EQ(SharedSubscription::validGroup("#"), false);
+}
+
+TEST(MQTTScripted, SharedClientID)
+{
+	set<string> ids;
+	for (int i = 0; i < 10; i++)
+	{
+		string id = SharedSubscription::clientID("mqtt");
+		ASSERT_EQ(id.compare(0, 5, "mqtt-"), 0);
+		ids.insert(id);
+	}
+	ASSERT_EQ(ids.size(), (size_t)10);
+}
+
+TEST(MQTTScripted, SharedMembers)
+{
+	const int members = 4;
+	vector<string> topics = { "site/+/power", "site/1/meter" };
+	set<string> ids;
+	for (int i = 0; i < members; i++)
+	{
+		// Each member of the group subscribes to the prefixed filters
+		vector<string> filters = SharedSubscription::topics("south", topics);
+		ASSERT_EQ(filters.size(), topics.size());
+		ASSERT_EQ(filters[0], "$share/south/site/+/power");
+		ASSERT_EQ(filters[1], "$share/south/site/1/meter");
+
+		string id = SharedSubscription::clientID("mqtt", "south", "");
+		ASSERT_EQ(id.compare(0, 5, "mqtt-"), 0);
+		ids.insert(id);
+	}
+	// No two members of the group connect with the same client ID
+	ASSERT_EQ(ids.size(), (size_t)members);
+
+	// Outside a group the topics and service name are used unchanged
+	ASSERT_EQ(SharedSubscription::topics("", topics), topics);
+	ASSERT_EQ(SharedSubscription::clientID("mqtt", "", ""), "mqtt");
+}
+
+TEST(MQTTScripted, SharedPersistentMembers)
+{
+	string base = "/tmp/test_shared_" + to_string(getpid());
+	string dirs[2] = { base + "-0", base + "-1" };
+	for (auto& dir : dirs)
+	{
+		mkdir(dir.c_str(), 0700);
+	}
+	// Members with a persistent session keep their ID across restarts
+	string first = SharedSubscription::clientID("mqtt", "south", dirs[0]);
+	string second = SharedSubscription::clientID("mqtt", "south", dirs[1]);
+	ASSERT_EQ(first.compare(0, 5, "mqtt-"), 0);
+	ASSERT_NE(first, second);
+	ASSERT_EQ(SharedSubscription::clientID("mqtt", "south", dirs[0]), first);
+	ASSERT_EQ(SharedSubscription::clientID("mqtt", "south", dirs[1]), second);
+	for (auto& dir : dirs)
+	{
+		unlink((dir + "/clientid").c_str());
+		rmdir(dir.c_str());
+	}
+}
@@ -0,0 +1,67 @@
+#include <gtest/gtest.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <simple_value.h>
+
+using namespace std;
+
+static bool parseValues(const char *payload, vector<Datapoint *>& points)
+{
+	return SimpleValue::parse(payload, strlen(payload), "value", points);
+}
+
+TEST(MQTTScripted, SimpleValueNumbers)
+{
+	const char *payloads[] = { "42", "  -3.5\r\n", "1.25e3", "+7E-2", ".5" };
+	double expected[] = { 42, -3.5, 1250, 0.07, 0.5 };
+	for (int i = 0; i < 5; i++)
+	{
+		vector<Datapoint *> points;
+		ASSERT_EQ(parseValues(payloads[i], points), true);
+		ASSERT_EQ(points.size(), 1);
+		ASSERT_EQ(points[0]->getName(), "value");
+		ASSERT_DOUBLE_EQ(points[0]->getData().toDouble(), expected[i]);
+		delete points[0];
+	}
+}
+
+TEST(MQTTScripted, SimpleValueKeywords)
+{
+	vector<Datapoint *> points;
+	ASSERT_EQ(parseValues("true", points), true);
+	ASSERT_EQ(points[0]->getData().getType(), DatapointValue::T_INTEGER);
+	ASSERT_EQ(points[0]->getData().toInt(), 1);
+	delete points[0];
+	points.clear();
+	ASSERT_EQ(parseValues("NaN", points), true);
+	ASSERT_EQ(isnan(points[0]->getData().toDouble()), true);
+	delete points[0];
+	points.clear();
+	ASSERT_EQ(parseValues("-inf", points), true);
+	ASSERT_EQ(isinf(points[0]->getData().toDouble()), true);
+	delete points[0];
+}
+
+TEST(MQTTScripted, SimpleValueList)
+{
+	vector<Datapoint *> points;
+	ASSERT_EQ(parseValues("1.5, 2.5,3", points), true);
+	ASSERT_EQ(points.size(), 3);
+	ASSERT_EQ(points[2]->getName(), "value_2");
+	ASSERT_DOUBLE_EQ(points[2]->getData().toDouble(), 3);
+	for (auto dp : points)
+		delete dp;
+	points.clear();
+	ASSERT_EQ(parseValues("1 2\t3 4", points), true);
+	ASSERT_EQ(points.size(), 4);
+	for (auto dp : points)
+		delete dp;
+	points.clear();
+	const char *invalid[] = { "", "1,,2", "1,", "1-2", "abc", "{ \"a\" : 1 }", "1 2,3" };
+	for (auto payload : invalid)
+	{
+		ASSERT_EQ(parseValues(payload, points), false);
+		ASSERT_EQ(points.size(), 0);
+	}
+}
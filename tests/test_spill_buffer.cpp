@@ -0,0 +1,131 @@
+#include <gtest/gtest.h>
+#include <spill_buffer.h>
+#include <string>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+static string spillPath()
+{
+	return "/tmp/test_spill_" + to_string(getpid());
+}
+
+static bool readMessage(SpillBuffer& spill, string& topic, string& payload)
+{
+	char *buffer;
+	size_t topicLength, payloadLength;
+	struct timeval received;
+	if (!spill.read(&buffer, topicLength, payloadLength, received))
+		return false;
+	topic.assign(buffer, topicLength);
+	payload.assign(buffer + topicLength, payloadLength);
+	free(buffer);
+	return true;
+}
+
+TEST(MQTTScripted, SpillBufferOrder)
+{
+	string path = spillPath();
+	SpillBuffer spill;
+	ASSERT_EQ(spill.open(path, 4096), true);
+	ASSERT_EQ(spill.empty(), true);
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	// Write and read enough messages for the buffer to wrap several times
+	int written = 0, read = 0;
+	string topic, payload;
+	for (int i = 0; i < 200; i++)
+	{
+		string t = "sensor/" + to_string(i), p = "{\"value\":" + to_string(i * 3) + "}";
+		while (!spill.append(t.c_str(), t.length(), p.c_str(), p.length(), now))
+		{
+			ASSERT_EQ(readMessage(spill, topic, payload), true);
+			ASSERT_EQ(topic, "sensor/" + to_string(read));
+			ASSERT_EQ(payload, "{\"value\":" + to_string(read * 3) + "}");
+			read++;
+		}
+		written++;
+	}
+	while (readMessage(spill, topic, payload))
+	{
+		ASSERT_EQ(topic, "sensor/" + to_string(read));
+		read++;
+	}
+	ASSERT_EQ(read, written);
+	ASSERT_EQ(spill.empty(), true);
+	ASSERT_EQ(spill.used(), 0U);
+	spill.close();
+	unlink(path.c_str());
+}
+
+TEST(MQTTScripted, SpillBufferFull)
+{
+	string path = spillPath();
+	SpillBuffer spill;
+	ASSERT_EQ(spill.open(path, 1024), true);
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	string payload(200, 'x');
+	int count = 0;
+	while (spill.append("t", 1, payload.c_str(), payload.length(), now))
+		count++;
+	ASSERT_EQ(count, 4);
+	ASSERT_EQ(spill.entries(), 4UL);
+	string big(2000, 'y');
+	ASSERT_EQ(spill.fits(1, big.length()), false);
+	ASSERT_EQ(spill.fits(1, payload.length()), true);
+	spill.close();
+	unlink(path.c_str());
+}
+
+TEST(MQTTScripted, SpillBufferReserved)
+{
+	string path = spillPath();
+	SpillBuffer spill;
+	ASSERT_EQ(spill.open(path, 65536), true);
+	// The file is not sparse, so writing to it can not fail
+	struct stat statb;
+	ASSERT_EQ(stat(path.c_str(), &statb), 0);
+	ASSERT_GE((size_t)statb.st_blocks * 512, (size_t)statb.st_size);
+	spill.close();
+	unlink(path.c_str());
+}
+
+TEST(MQTTScripted, SpillBufferRecovery)
+{
+	string path = spillPath();
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	{
+		SpillBuffer spill;
+		ASSERT_EQ(spill.open(path, 8192), true);
+		for (int i = 0; i < 10; i++)
+		{
+			string p = to_string(i);
+			ASSERT_EQ(spill.append("topic", 5, p.c_str(), p.length(), now), true);
+		}
+		string topic, payload;
+		ASSERT_EQ(readMessage(spill, topic, payload), true);
+		ASSERT_EQ(payload, "0");
+		// Closing without reading the rest leaves them in the file
+	}
+	SpillBuffer spill;
+	ASSERT_EQ(spill.open(path, 65536), true);
+	ASSERT_EQ(spill.entries(), 9UL);
+	ASSERT_EQ(spill.capacity(), 8192U);	// Kept until the messages are read
+	string topic, payload;
+	for (int i = 1; i < 10; i++)
+	{
+		ASSERT_EQ(readMessage(spill, topic, payload), true);
+		ASSERT_EQ(topic, "topic");
+		ASSERT_EQ(payload, to_string(i));
+	}
+	ASSERT_EQ(readMessage(spill, topic, payload), false);
+	spill.close();
+	ASSERT_EQ(spill.open(path, 65536), true);
+	ASSERT_EQ(spill.capacity(), 65536U);
+	spill.close();
+	unlink(path.c_str());
+}
@@ -0,0 +1,66 @@
+#include <gtest/gtest.h>
+#include <stage_timer.h>
+
+using namespace std;
+
+TEST(MQTTScripted, HistogramBuckets)
+{
+	// Every value falls within the bounds of its bucket
+	uint64_t values[] = { 0, 1, 7, 8, 9, 15, 16, 17, 1000, 123456789, 0xffffffffffffffffULL };
+	for (auto value : values)
+	{
+		int bucket = LatencyHistogram::bucket(value);
+		ASSERT_LT(bucket, LatencyHistogram::BUCKETS);
+		ASSERT_LE(value, LatencyHistogram::upperBound(bucket));
+		if (bucket > 0)
+		{
+			ASSERT_GT(value, LatencyHistogram::upperBound(bucket - 1));
+		}
+	}
+}
+
+TEST(MQTTScripted, HistogramPercentiles)
+{
+	LatencyHistogram histogram;
+	for (uint64_t i = 1; i <= 10000; i++)
+	{
+		histogram.record(i * 1000);
+	}
+	LatencyHistogram::Summary summary;
+	histogram.collect(summary, true);
+	ASSERT_EQ(summary.count, 10000U);
+	ASSERT_EQ(summary.max, 10000000U);
+	ASSERT_GE(summary.p50, 5000000U);
+	ASSERT_LE(summary.p50, 5000000U * 1.125);
+	ASSERT_GE(summary.p99, 9900000U);
+	ASSERT_LE(summary.p99, 10000000U);
+	ASSERT_GE(summary.p999, 9990000U);
+	ASSERT_LE(summary.p999, 10000000U);
+
+	histogram.collect(summary, false);
+	ASSERT_EQ(summary.count, 0U);
+	ASSERT_EQ(summary.p50, 0U);
+}
+
+#ifdef STAGE_TIMERS
+TEST(MQTTScripted, StageTimerEnable)
+{
+	LatencyHistogram::Summary summary;
+	StageTimers::setEnabled(false);
+	{
+		StageTimer timer(StageTimers::Parse);
+	}
+	StageTimers::collect(StageTimers::Parse, summary, false);
+	ASSERT_EQ(summary.count, 0U);
+
+	StageTimers::setEnabled(true);
+	{
+		StageTimer timer(StageTimers::Parse);
+	}
+	StageTimer stopped(StageTimers::Parse);
+	stopped.stop();
+	StageTimers::collect(StageTimers::Parse, summary, true);
+	ASSERT_EQ(summary.count, 2U);
+	StageTimers::setEnabled(false);
+}
+#endif
@@ -0,0 +1,77 @@
+#include <gtest/gtest.h>
+#include <string.h>
+#include <string>
+#include <timestamp_parser.h>
+
+using namespace std;
+
+// 2021-06-01 12:30:45 UTC
+#define TEST_EPOCH	1622550645
+
+TEST(MQTTScripted, TimestampISO)
+{
+	TimestampParser parser("%Y-%m-%dT%H:%M:%S", 0);
+	struct timeval tv;
+	ASSERT_EQ(parser.parse("2021-06-01T12:30:45", tv), true);
+	ASSERT_EQ(tv.tv_sec, TEST_EPOCH);
+	ASSERT_EQ(tv.tv_usec, 0);
+	ASSERT_EQ(parser.parse("2021-06-01 12:30:45.25Z", tv), true);
+	ASSERT_EQ(tv.tv_sec, TEST_EPOCH);
+	ASSERT_EQ(tv.tv_usec, 250000);
+	ASSERT_EQ(parser.parse("2021-06-01T14:30:45+02:00", tv), true);
+	ASSERT_EQ(tv.tv_sec, TEST_EPOCH);
+	ASSERT_EQ(parser.parse("2021-06-01T12:30", tv), false);
+}
+
+TEST(MQTTScripted, TimestampTimezone)
+{
+	// Timestamps without a zone designator are in the configured timezone
+	TimestampParser parser("%Y-%m-%d %H:%M:%S", -8 * 60 * 60);
+	struct timeval tv;
+	ASSERT_EQ(parser.parse("2021-06-01 04:30:45", tv), true);
+	ASSERT_EQ(tv.tv_sec, TEST_EPOCH);
+	ASSERT_EQ(parser.parse("2021-06-01 12:30:45Z", tv), true);
+	ASSERT_EQ(tv.tv_sec, TEST_EPOCH);
+}
+
+TEST(MQTTScripted, TimestampStrptime)
+{
+	TimestampParser parser("%d/%m/%Y %H:%M:%S", 0);
+	struct timeval tv;
+	ASSERT_EQ(parser.parse("01/06/2021 12:30:45.5", tv), true);
+	ASSERT_EQ(tv.tv_sec, TEST_EPOCH);
+	ASSERT_EQ(tv.tv_usec, 500000);
+}
+
+TEST(MQTTScripted, TimestampStrptimeDottedDate)
+{
+	// The '.' separating the date fields is not a fraction of a second
+	TimestampParser parser("%d.%m.%Y %H:%M:%S", 0);
+	struct timeval tv;
+	ASSERT_EQ(parser.parse("01.06.2021 12:30:45", tv), true);
+	ASSERT_EQ(tv.tv_sec, TEST_EPOCH);
+	ASSERT_EQ(tv.tv_usec, 0);
+	ASSERT_EQ(parser.parse("01.06.2021 12:30:45.125", tv), true);
+	ASSERT_EQ(tv.tv_sec, TEST_EPOCH);
+	ASSERT_EQ(tv.tv_usec, 125000);
+}
+
+TEST(MQTTScripted, TimestampEpoch)
+{
+	TimestampParser inferred("", 0);
+	struct timeval tv;
+	ASSERT_EQ(inferred.fromInteger(TEST_EPOCH, tv), true);
+	ASSERT_EQ(tv.tv_sec, TEST_EPOCH);
+	ASSERT_EQ(inferred.fromInteger(TEST_EPOCH * 1000LL + 123, tv), true);
+	ASSERT_EQ(tv.tv_sec, TEST_EPOCH);
+	ASSERT_EQ(tv.tv_usec, 123000);
+	ASSERT_EQ(inferred.fromDouble(TEST_EPOCH + 0.5, tv), true);
+	ASSERT_EQ(tv.tv_sec, TEST_EPOCH);
+	ASSERT_EQ(tv.tv_usec, 500000);
+
+	TimestampParser micros("epoch_us", 0);
+	ASSERT_EQ(micros.parse("1622550645000001", tv), true);
+	ASSERT_EQ(tv.tv_sec, TEST_EPOCH);
+	ASSERT_EQ(tv.tv_usec, 1);
+	ASSERT_EQ(micros.parse("abc", tv), false);
+}
@@ -0,0 +1,49 @@
+#include <gtest/gtest.h>
+#include <string>
+#include <topic_matcher.h>
+
+using namespace std;
+
+TEST(MQTTScripted, TopicMatcherExact)
+{
+	TopicMatcher matcher;
+	ASSERT_EQ(matcher.add("sensor/temperature", 0), true);
+	ASSERT_EQ(matcher.add("sensor/humidity", 1), true);
+	ASSERT_EQ(matcher.match("sensor/temperature"), 0);
+	ASSERT_EQ(matcher.match("sensor/humidity"), 1);
+	ASSERT_EQ(matcher.match("sensor"), -1);
+	ASSERT_EQ(matcher.match("sensor/temperature/1"), -1);
+}
+
+TEST(MQTTScripted, TopicMatcherWildcards)
+{
+	TopicMatcher matcher;
+	ASSERT_EQ(matcher.add("site/+/power", 0), true);
+	ASSERT_EQ(matcher.add("site/#", 1), true);
+	ASSERT_EQ(matcher.add("+/+/meter/+", 2), true);
+	ASSERT_EQ(matcher.match("site/a/power"), 0);
+	ASSERT_EQ(matcher.match("site/a/power/phase1"), 1);
+	ASSERT_EQ(matcher.match("site"), 1);
+	ASSERT_EQ(matcher.match("site/b/meter/3"), 1);
+	ASSERT_EQ(matcher.match("plant/b/meter/3"), 2);
+	ASSERT_EQ(matcher.match("plant/b/meter"), -1);
+	ASSERT_EQ(matcher.match("site//power"), 0);
+}
+
+TEST(MQTTScripted, TopicMatcherOrder)
+{
+	TopicMatcher matcher;
+	ASSERT_EQ(matcher.add("#", 0), true);
+	ASSERT_EQ(matcher.add("a/b", 1), true);
+	ASSERT_EQ(matcher.match("a/b"), 0);
+	ASSERT_EQ(matcher.match("$SYS/broker"), -1);
+}
+
+TEST(MQTTScripted, TopicMatcherInvalid)
+{
+	ASSERT_EQ(TopicMatcher::valid("a/b+"), false);
+	ASSERT_EQ(TopicMatcher::valid("a/#/b"), false);
+	ASSERT_EQ(TopicMatcher::valid("a#"), false);
+	ASSERT_EQ(TopicMatcher::valid(""), false);
+	ASSERT_EQ(TopicMatcher::valid("+/a/#"), true);
+}
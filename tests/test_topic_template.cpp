@@ -0,0 +1,44 @@
+#include <gtest/gtest.h>
+#include <string>
+#include <topic_template.h>
+
+using namespace std;
+
+TEST(MQTTScripted, TopicTemplateLevels)
+{
+	TopicTemplate name("{topic[1]}-{topic[3]}");
+	string buffer;
+	ASSERT_EQ(name.isConstant(), false);
+	ASSERT_EQ(name.expand("site/north/meter/7", buffer), "north-7");
+	ASSERT_EQ(name.expand("site/south/meter", buffer), "south-");
+	TopicTemplate last("asset_{topic[-1]}");
+	ASSERT_EQ(last.expand("a/b/c", buffer), "asset_c");
+	TopicTemplate whole("{{{topic}}}");
+	ASSERT_EQ(whole.expand("a/b", buffer), "{a/b}");
+}
+
+TEST(MQTTScripted, TopicTemplateConstant)
+{
+	string buffer;
+	TopicTemplate name("mqtt");
+	ASSERT_EQ(name.isConstant(), true);
+	ASSERT_EQ(name.expand("a/b", buffer), "mqtt");
+	TopicTemplate literal("site/{topic}", false);
+	ASSERT_EQ(literal.isConstant(), true);
+	ASSERT_EQ(literal.expand("a/b", buffer), "site/{topic}");
+}
+
+TEST(MQTTScripted, TopicTemplateCache)
+{
+	string buffer;
+	TopicTemplate name("{topic[0]}");
+	const string& first = name.expand("a/b", buffer);
+	for (int i = 0; i < MAX_TEMPLATE_TOPICS + 10; i++)
+	{
+		string topic = to_string(i) + "/x";
+		ASSERT_EQ(name.expand(topic, buffer), to_string(i));
+	}
+	// Cached expansions remain valid once the cache is full
+	ASSERT_EQ(&name.expand("a/b", buffer), &first);
+	ASSERT_EQ(first, "a");
+}
@@ -0,0 +1,377 @@
+/*
+ * FogLAMP "MQTTScripted" timestamp parser.
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <timestamp_parser.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <ctype.h>
+
+using namespace std;
+
+/**
+ * Return the number of days since the epoch for a date in the
+ * proleptic Gregorian calendar.
+ *
+ * @param y	The year
+ * @param m	The month, 1 to 12
+ * @param d	The day of the month
+ */
+static int64_t daysFromCivil(int y, unsigned int m, unsigned int d)
+{
+	y -= m <= 2;
+	const int64_t era = (y >= 0 ? y : y - 399) / 400;
+	const unsigned int yoe = (unsigned int)(y - era * 400);
+	const unsigned int doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	const unsigned int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + (int64_t)doe - 719468;
+}
+
+/**
+ * Parse a fixed number of decimal digits
+ *
+ * @param p	The characters to parse
+ * @param n	The number of digits
+ * @param value	The parsed value
+ * @return bool	True if n digits were found
+ */
+static inline bool parseDigits(const char *p, int n, int& value)
+{
+	value = 0;
+	for (int i = 0; i < n; i++)
+	{
+		if (p[i] < '0' || p[i] > '9')
+			return false;
+		value = value * 10 + (p[i] - '0');
+	}
+	return true;
+}
+
+/**
+ * Create a timestamp parser, compiling the format into a parse plan
+ *
+ * @param format	The format of the timestamps
+ * @param offset	The offset of the timezone from UTC in seconds
+ */
+TimestampParser::TimestampParser(const string& format, long offset) : m_format(format), m_offset(offset)
+{
+	if (format.empty())
+	{
+		m_plan = Auto;
+	}
+	else if (format.compare("epoch") == 0 || format.compare("%s") == 0)
+	{
+		m_plan = EpochSeconds;
+	}
+	else if (format.compare("epoch_ms") == 0)
+	{
+		m_plan = EpochMillis;
+	}
+	else if (format.compare("epoch_us") == 0)
+	{
+		m_plan = EpochMicros;
+	}
+	else if (format.compare(0, 17, "%Y-%m-%dT%H:%M:%S") == 0
+			|| format.compare(0, 17, "%Y-%m-%d %H:%M:%S") == 0)
+	{
+		// Any fraction or zone designator is handled by the ISO parser
+		string suffix = format.substr(17);
+		if (suffix.empty() || suffix.compare("Z") == 0 || suffix.compare("%z") == 0
+				|| suffix.compare("%Z") == 0)
+			m_plan = ISO8601;
+		else
+			m_plan = Strptime;
+	}
+	else
+	{
+		m_plan = Strptime;
+	}
+}
+
+/**
+ * Parse a timestamp string
+ *
+ * @param ts	The NULL terminated timestamp
+ * @param tv	The UTC time of the timestamp
+ * @return bool	True if the timestamp was parsed
+ */
+bool TimestampParser::parse(const char *ts, struct timeval& tv) const
+{
+	switch (m_plan)
+	{
+		case Auto:
+			return parseISO(ts, tv) || parseNumeric(ts, tv);
+		case ISO8601:
+			return parseISO(ts, tv) || parseStrptime(ts, tv);
+		case EpochSeconds:
+		case EpochMillis:
+		case EpochMicros:
+			return parseNumeric(ts, tv);
+		case Strptime:
+		default:
+			return parseStrptime(ts, tv);
+	}
+}
+
+/**
+ * Convert an integer timestamp, the time since the epoch
+ *
+ * @param value	The timestamp value
+ * @param tv	The UTC time of the timestamp
+ * @return bool	True if the timestamp was converted
+ */
+bool TimestampParser::fromInteger(int64_t value, struct timeval& tv) const
+{
+	Plan plan = m_plan;
+	if (plan != EpochSeconds && plan != EpochMillis && plan != EpochMicros)
+	{
+		// Infer the units from the magnitude of the value
+		int64_t mag = value < 0 ? -value : value;
+		if (mag < 100000000000LL)
+			plan = EpochSeconds;
+		else if (mag < 100000000000000LL)
+			plan = EpochMillis;
+		else
+			plan = EpochMicros;
+	}
+	int64_t usecs;
+	switch (plan)
+	{
+		case EpochSeconds:
+			tv.tv_sec = value;
+			tv.tv_usec = 0;
+			return true;
+		case EpochMillis:
+			usecs = value * 1000;
+			break;
+		default:
+			usecs = value;
+			break;
+	}
+	tv.tv_sec = usecs / 1000000;
+	tv.tv_usec = usecs % 1000000;
+	if (tv.tv_usec < 0)
+	{
+		tv.tv_sec--;
+		tv.tv_usec += 1000000;
+	}
+	return true;
+}
+
+/**
+ * Convert a floating point timestamp, the time since the epoch
+ *
+ * @param value	The timestamp value
+ * @param tv	The UTC time of the timestamp
+ * @return bool	True if the timestamp was converted
+ */
+bool TimestampParser::fromDouble(double value, struct timeval& tv) const
+{
+	if (!isfinite(value))
+	{
+		return false;
+	}
+	Plan plan = m_plan;
+	if (plan != EpochSeconds && plan != EpochMillis && plan != EpochMicros)
+	{
+		double mag = fabs(value);
+		if (mag < 1e11)
+			plan = EpochSeconds;
+		else if (mag < 1e14)
+			plan = EpochMillis;
+		else
+			plan = EpochMicros;
+	}
+	double usecs;
+	switch (plan)
+	{
+		case EpochSeconds:
+			usecs = value * 1e6;
+			break;
+		case EpochMillis:
+			usecs = value * 1e3;
+			break;
+		default:
+			usecs = value;
+			break;
+	}
+	int64_t us = (int64_t)llround(usecs);
+	tv.tv_sec = us / 1000000;
+	tv.tv_usec = us % 1000000;
+	if (tv.tv_usec < 0)
+	{
+		tv.tv_sec--;
+		tv.tv_usec += 1000000;
+	}
+	return true;
+}
+
+/**
+ * Parse an ISO-8601/RFC-3339 timestamp of the form
+ * YYYY-MM-DD[T ]HH:MM:SS[.ffffff][Z|+HH:MM|-HH:MM|+HHMM|-HHMM]
+ *
+ * If the timestamp has no zone designator the configured timezone is used.
+ *
+ * @param ts	The NULL terminated timestamp
+ * @param tv	The UTC time of the timestamp
+ * @return bool	True if the timestamp was parsed
+ */
+bool TimestampParser::parseISO(const char *ts, struct timeval& tv) const
+{
+int	year, month, day, hour, minute, second;
+
+	const char *p = ts;
+	if (!parseDigits(p, 4, year) || p[4] != '-'
+			|| !parseDigits(p + 5, 2, month) || p[7] != '-'
+			|| !parseDigits(p + 8, 2, day)
+			|| (p[10] != 'T' && p[10] != 't' && p[10] != ' ')
+			|| !parseDigits(p + 11, 2, hour) || p[13] != ':'
+			|| !parseDigits(p + 14, 2, minute) || p[16] != ':'
+			|| !parseDigits(p + 17, 2, second))
+	{
+		return false;
+	}
+	if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 60)
+	{
+		return false;
+	}
+	p += 19;
+
+	long usec = 0;
+	if (*p == '.' || *p == ',')
+	{
+		p++;
+		int n = 0;
+		while (*p >= '0' && *p <= '9')
+		{
+			if (n < 6)
+			{
+				usec = usec * 10 + (*p - '0');
+				n++;
+			}
+			p++;
+		}
+		if (n == 0)
+		{
+			return false;
+		}
+		while (n++ < 6)
+		{
+			usec *= 10;
+		}
+	}
+
+	long offset = m_offset;
+	if (*p == 'Z' || *p == 'z')
+	{
+		offset = 0;
+		p++;
+	}
+	else if (*p == '+' || *p == '-')
+	{
+		int zh, zm = 0;
+		if (!parseDigits(p + 1, 2, zh))
+		{
+			return false;
+		}
+		const char *q = p + 3;
+		if (*q == ':')
+		{
+			q++;
+		}
+		if (*q >= '0' && *q <= '9')
+		{
+			if (!parseDigits(q, 2, zm))
+			{
+				return false;
+			}
+			q += 2;
+		}
+		offset = zh * 3600 + zm * 60;
+		if (*p == '-')
+		{
+			offset = -offset;
+		}
+		p = q;
+	}
+	if (*p != 0)
+	{
+		return false;
+	}
+
+	tv.tv_sec = daysFromCivil(year, month, day) * 86400
+			+ hour * 3600 + minute * 60 + second - offset;
+	tv.tv_usec = usec;
+	return true;
+}
+
+/**
+ * Parse a timestamp using the strptime format. Any fractional
+ * seconds following a '.' immediately after the text matched by the
+ * format are also used.
+ *
+ * @param ts	The NULL terminated timestamp
+ * @param tv	The UTC time of the timestamp
+ * @return bool	True if the timestamp was parsed
+ */
+bool TimestampParser::parseStrptime(const char *ts, struct timeval& tv) const
+{
+struct tm tm;
+
+	if (m_format.empty())
+	{
+		return false;
+	}
+	memset(&tm, 0, sizeof(tm));
+	const char *end = strptime(ts, m_format.c_str(), &tm);
+	if (end == NULL)
+	{
+		return false;
+	}
+	// timegm treats the time as UTC and, unlike mktime, does not consult
+	// the local timezone
+	long offset = m_offset;
+	if (m_format.find("%z") != string::npos)
+	{
+		offset = tm.tm_gmtoff;
+	}
+	tv.tv_sec = timegm(&tm) - offset;
+	tv.tv_usec = 0;
+	// Only a fraction that immediately follows the end of the format,
+	// the seconds, is used, a '.' may also separate the date fields
+	if (end[0] == '.' && isdigit((unsigned char)end[1]))
+	{
+		tv.tv_usec = (long)(strtod(end, NULL) * 1000000);
+	}
+	return true;
+}
+
+/**
+ * Parse a string that contains a numeric timestamp
+ *
+ * @param ts	The NULL terminated timestamp
+ * @param tv	The UTC time of the timestamp
+ * @return bool	True if the timestamp was parsed
+ */
+bool TimestampParser::parseNumeric(const char *ts, struct timeval& tv) const
+{
+	char *end;
+	long long ivalue = strtoll(ts, &end, 10);
+	if (end != ts && *end == 0)
+	{
+		return fromInteger(ivalue, tv);
+	}
+	double dvalue = strtod(ts, &end);
+	if (end != ts && *end == 0)
+	{
+		return fromDouble(dvalue, tv);
+	}
+	return false;
+}
@@ -0,0 +1,192 @@
+/*
+ * FogLAMP "MQTTScripted" topic matcher.
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <topic_matcher.h>
+#include <string.h>
+#include <map>
+
+using namespace std;
+
+#define NO_MATCH	-1
+
+/**
+ * A node in the tree of topic levels. Each node records the index of
+ * the filter that ends at the node and the index of any filter that
+ * ends with a # wildcard at this level.
+ */
+class TopicMatcher::Node {
+	public:
+		Node() : index(NO_MATCH), multiLevel(NO_MATCH), singleLevel(NULL) {};
+		~Node()
+		{
+			for (auto& child : children)
+				delete child.second;
+			delete singleLevel;
+		};
+		int			index;
+		int			multiLevel;
+		std::map<std::string, Node *>
+					children;
+		Node			*singleLevel;
+};
+
+/**
+ * Return the lower of two filter indexes, ignoring NO_MATCH
+ */
+static inline int first(int a, int b)
+{
+	if (a == NO_MATCH)
+		return b;
+	if (b == NO_MATCH)
+		return a;
+	return a < b ? a : b;
+}
+
+/**
+ * Construct an empty topic matcher
+ */
+TopicMatcher::TopicMatcher() : m_root(new Node)
+{
+}
+
+/**
+ * Destructor for the topic matcher
+ */
+TopicMatcher::~TopicMatcher()
+{
+	delete m_root;
+}
+
+/**
+ * Check a topic filter is valid. The + wildcard must occupy an entire
+ * level and the # wildcard must occupy the entire last level.
+ *
+ * @param filter	The topic filter
+ * @return bool		True if the filter is valid
+ */
+bool TopicMatcher::valid(const string& filter)
+{
+	if (filter.empty())
+	{
+		return false;
+	}
+	for (size_t i = 0; i < filter.length(); i++)
+	{
+		char c = filter[i];
+		if (c == '+' || c == '#')
+		{
+			if (i > 0 && filter[i - 1] != '/')
+				return false;
+			if (c == '#' && i != filter.length() - 1)
+				return false;
+			if (c == '+' && i + 1 < filter.length() && filter[i + 1] != '/')
+				return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Add a topic filter to the matcher
+ *
+ * @param filter	The topic filter
+ * @param index		The value returned when a topic matches the filter
+ * @return bool		False if the filter is not valid
+ */
+bool TopicMatcher::add(const string& filter, int index)
+{
+	if (!valid(filter))
+	{
+		return false;
+	}
+	Node *node = m_root;
+	size_t start = 0;
+	while (true)
+	{
+		size_t end = filter.find('/', start);
+		string level = filter.substr(start, end == string::npos ? string::npos : end - start);
+		if (level.compare("#") == 0)
+		{
+			node->multiLevel = first(node->multiLevel, index);
+			return true;
+		}
+		Node *next;
+		if (level.compare("+") == 0)
+		{
+			if (!node->singleLevel)
+				node->singleLevel = new Node;
+			next = node->singleLevel;
+		}
+		else
+		{
+			auto it = node->children.find(level);
+			if (it == node->children.end())
+				it = node->children.insert(make_pair(level, new Node)).first;
+			next = it->second;
+		}
+		node = next;
+		if (end == string::npos)
+		{
+			break;
+		}
+		start = end + 1;
+	}
+	node->index = first(node->index, index);
+	return true;
+}
+
+/**
+ * Match a topic name against the filters
+ *
+ * @param topic		The topic name
+ * @param length	The length of the topic name
+ * @return int		The index of the first filter that matches, or -1 if none match
+ */
+int TopicMatcher::match(const char *topic, size_t length) const
+{
+	return match(m_root, topic, topic + length, true);
+}
+
+/**
+ * Match the remaining levels of a topic name below a node of the tree
+ *
+ * @param node		The node
+ * @param level		The start of the next level of the topic name
+ * @param end		The end of the topic name
+ * @param firstLevel	True if this is the first level of the topic name
+ * @return int		The index of the first filter that matches, or -1 if none match
+ */
+int TopicMatcher::match(const Node *node, const char *level, const char *end, bool firstLevel) const
+{
+	// Wildcards do not match topics that start with $
+	bool wildcards = !(firstLevel && level < end && *level == '$');
+
+	// A # matches the parent level as well as any number of child levels
+	int result = wildcards ? node->multiLevel : NO_MATCH;
+
+	const char *sep = (const char *)memchr(level, '/', end - level);
+	const char *levelEnd = sep ? sep : end;
+	string name(level, levelEnd - level);
+	auto it = node->children.find(name);
+	if (it != node->children.end())
+	{
+		if (sep)
+			result = first(result, match(it->second, sep + 1, end, false));
+		else
+			result = first(result, first(it->second->index, it->second->multiLevel));
+	}
+	if (wildcards && node->singleLevel)
+	{
+		if (sep)
+			result = first(result, match(node->singleLevel, sep + 1, end, false));
+		else
+			result = first(result, first(node->singleLevel->index, node->singleLevel->multiLevel));
+	}
+	return result;
+}
@@ -0,0 +1,189 @@
+/*
+ * FogLAMP "MQTTScripted" topic templates.
+ *
+ * Copyright (c) 2021 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Mark Riddoch
+ */
+#include <topic_template.h>
+#include <logger.h>
+#include <string.h>
+#include <stdlib.h>
+
+using namespace std;
+
+/**
+ * Create a template
+ *
+ * @param text		The template text
+ * @param compile	If false the text is used literally and not as a template
+ */
+TopicTemplate::TopicTemplate(const string& text, bool compile) : m_text(text), m_constant(true)
+{
+	if (compile && !this->compile())
+	{
+		Logger::getLogger()->error("Invalid topic template '%s', the name will be used as given",
+				text.c_str());
+		m_parts.clear();
+	}
+	if (m_parts.empty())
+	{
+		m_parts.emplace_back(Literal, text, 0);
+	}
+	for (auto& part : m_parts)
+	{
+		if (part.type != Literal)
+			m_constant = false;
+	}
+}
+
+/**
+ * Compile the template text into a sequence of literal text and
+ * references to the topic
+ *
+ * @return bool	False if the template is not valid
+ */
+bool TopicTemplate::compile()
+{
+	string literal;
+	size_t i = 0;
+	while (i < m_text.length())
+	{
+		char c = m_text[i];
+		if (c == '}')
+		{
+			if (i + 1 < m_text.length() && m_text[i + 1] == '}')
+			{
+				literal += '}';
+				i += 2;
+				continue;
+			}
+			return false;
+		}
+		if (c != '{')
+		{
+			literal += c;
+			i++;
+			continue;
+		}
+		if (i + 1 < m_text.length() && m_text[i + 1] == '{')
+		{
+			literal += '{';
+			i += 2;
+			continue;
+		}
+		size_t close = m_text.find('}', i);
+		if (close == string::npos)
+		{
+			return false;
+		}
+		string reference = m_text.substr(i + 1, close - i - 1);
+		if (!literal.empty())
+		{
+			m_parts.emplace_back(Literal, literal, 0);
+			literal.clear();
+		}
+		if (reference.compare("topic") == 0)
+		{
+			m_parts.emplace_back(Topic, "", 0);
+		}
+		else if (reference.compare(0, 6, "topic[") == 0 && reference[reference.length() - 1] == ']')
+		{
+			const char *index = reference.c_str() + 6;
+			char *end;
+			long level = strtol(index, &end, 10);
+			if (end == index || *end != ']')
+			{
+				return false;
+			}
+			m_parts.emplace_back(Level, "", (int)level);
+		}
+		else
+		{
+			return false;
+		}
+		i = close + 1;
+	}
+	if (!literal.empty())
+	{
+		m_parts.emplace_back(Literal, literal, 0);
+	}
+	return true;
+}
+
+/**
+ * Expand the template for a topic
+ *
+ * @param topic		The topic name
+ * @param length	The length of the topic name
+ * @param buffer	Used to hold the expansion if the cache is full
+ * @return string	The expanded template
+ */
+const string& TopicTemplate::expand(const char *topic, size_t length, string& buffer) const
+{
+	if (m_constant)
+	{
+		return m_text;
+	}
+	m_key.assign(topic, length);
+	auto it = m_cache.find(m_key);
+	if (it != m_cache.end())
+	{
+		return it->second;
+	}
+	if (m_cache.size() >= MAX_TEMPLATE_TOPICS)
+	{
+		buffer.clear();
+		substitute(topic, length, buffer);
+		return buffer;
+	}
+	string result;
+	substitute(topic, length, result);
+	return m_cache.emplace(m_key, result).first->second;
+}
+
+/**
+ * Substitute the topic into the template
+ *
+ * @param topic		The topic name
+ * @param length	The length of the topic name
+ * @param result	The string to which the expansion is appended
+ */
+void TopicTemplate::substitute(const char *topic, size_t length, string& result) const
+{
+	vector<pair<const char *, size_t> > levels;
+	const char *start = topic, *end = topic + length;
+	while (true)
+	{
+		const char *sep = (const char *)memchr(start, '/', end - start);
+		if (!sep)
+		{
+			levels.push_back(make_pair(start, (size_t)(end - start)));
+			break;
+		}
+		levels.push_back(make_pair(start, (size_t)(sep - start)));
+		start = sep + 1;
+	}
+
+	for (auto& part : m_parts)
+	{
+		switch (part.type)
+		{
+			case Literal:
+				result.append(part.text);
+				break;
+			case Topic:
+				result.append(topic, length);
+				break;
+			case Level:
+			{
+				long level = part.level < 0 ? (long)levels.size() + part.level : part.level;
+				if (level >= 0 && level < (long)levels.size())
+					result.append(levels[level].first, levels[level].second);
+				break;
+			}
+		}
+	}
+}